@@ -16,8 +16,8 @@ PKG_CONFIG_PATH?=$(SYSROOT)$(PKGCONFIGDIR)
 MIXP_LIBS?=`$(PKG_CONFIG) --libs libmixp`
 MIXP_CFLAGS?=`$(PKG_CONFIG) --cflags libmixp`
 
-HASH_LIBS=-lhash
-HASH_CFLAGS=
+PTHREAD_LIBS=-lpthread
+PTHREAD_CFLAGS=
 
 CFLAGS+=$(MIXP_CFLAGS)
 LDFLAGS+=$(MIXP_LIBS)
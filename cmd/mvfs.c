@@ -19,17 +19,16 @@ int catfile(MVFS_FILE* file)
     }
     
     char buffer[1024];
-    buffer[sizeof(buffer)-1] = 0;
 
     while (mvfs_file_eof(file)==0)
     {
-	int ret = mvfs_file_read(file, buffer, sizeof(buffer)-1);
+	int ret = mvfs_file_read(file, buffer, sizeof(buffer));
 	if (ret<0)
 	{
 	    fprintf(stderr,"UGH! error: %d\n", file->errcode);
 	    return 0;	    
 	}
-	printf("%s", buffer);
+	fwrite(buffer, 1, ret, stdout);
     }
     printf("\n");
     return 0;
@@ -74,17 +73,23 @@ int run_ls2(MVFS_FILESYSTEM* fs, const char* filename)
     int rl_blocks = 0;
     int rl_mtime  = 0;
 
-    while (s = mvfs_file_scan(dir))
+    MVFS_STAT* batch[256];
+    ssize_t count, x;
+    while ((count = mvfs_file_scan_batch(dir, batch, 256)) > 0)
     {
-	char date_buf[64];
-	strftime(date_buf, sizeof(date_buf)-1, "%c", localtime(&s->mtime));
-	rl_blocks = MAX(rl_blocks, decsize(s->size/4096));
-	rl_size   = MAX(rl_size,   decsize(s->size));
-	rl_name   = MAX(rl_name,   strlen(s->name));
-	rl_uid    = MAX(rl_uid,    strlen(s->uid));
-	rl_gid    = MAX(rl_gid,    strlen(s->gid));
-	rl_mtime  = MAX(rl_mtime,  strlen(date_buf));	
-	mvfs_stat_free(s);
+	for (x=0; x<count; x++)
+	{
+	    char date_buf[64];
+	    s = batch[x];
+	    strftime(date_buf, sizeof(date_buf)-1, "%c", localtime(&s->mtime));
+	    rl_blocks = MAX(rl_blocks, decsize(s->size/4096));
+	    rl_size   = MAX(rl_size,   decsize(s->size));
+	    rl_name   = MAX(rl_name,   strlen(s->name));
+	    rl_uid    = MAX(rl_uid,    strlen(s->uid));
+	    rl_gid    = MAX(rl_gid,    strlen(s->gid));
+	    rl_mtime  = MAX(rl_mtime,  strlen(date_buf));	
+	    mvfs_stat_free(s);
+	}
     }
 
     char fmtbuf[128];
@@ -97,14 +102,18 @@ int run_ls2(MVFS_FILESYSTEM* fs, const char* filename)
 	    rl_name);
 
     mvfs_file_reset(dir);
-    while (s = mvfs_file_scan(dir))
+    while ((count = mvfs_file_scan_batch(dir, batch, 256)) > 0)
     {
-	char mode_buf[64];
-	char date_buf[64];
-	strftime(date_buf, sizeof(date_buf)-1, "%c", localtime(&s->mtime));
-	mvfs_strmode(s->mode,mode_buf);	
-	printf(fmtbuf, mode_buf, s->size/4096, s->uid, s->gid, s->size, date_buf, s->name);
-	mvfs_stat_free(s);
+	for (x=0; x<count; x++)
+	{
+	    char mode_buf[64];
+	    char date_buf[64];
+	    s = batch[x];
+	    strftime(date_buf, sizeof(date_buf)-1, "%c", localtime(&s->mtime));
+	    mvfs_strmode(s->mode,mode_buf);	
+	    printf(fmtbuf, mode_buf, s->size/4096, s->uid, s->gid, s->size, date_buf, s->name);
+	    mvfs_stat_free(s);
+	}
     }
 }
 
@@ -0,0 +1,855 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <mvfs/mvfs.h>
+#include <mvfs/autoconnect_ops.h>
+#include <mvfs/metacache_ops.h>
+#include <mvfs/datacache_ops.h>
+#include <mvfs/walk.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#define READ_BUFSIZE	(1024*1024)
+#define RANDREAD_BLOCK	4096
+#define RANDREAD_OPS	20000
+#define STAT_OPS	200000
+#define ARGS_OPS	200000
+#define MCSTAT_OPS	2000
+#define MCSTORM_OPS	100000
+#define MCSTORM_PATHS	64
+#define MCLS_ROUNDS	200
+#define DCREAD_ROUNDS	3
+#define SCAN_ROUNDS	20
+#define SCAN_BATCH	256
+#define WALK_ROUNDS	5
+
+#ifdef __GLIBC__
+// count heap allocations - glibc lets us interpose malloc for the
+// whole process, including its own internal callers like strdup().
+// only while alloc_counting is set, so the threaded benchmarks don't
+// fight over the counter's cacheline
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t nmemb, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+static long alloc_count = 0;
+static int  alloc_counting = 0;
+
+void* malloc(size_t size)
+{
+    if (alloc_counting)
+	__sync_fetch_and_add(&alloc_count, 1);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t nmemb, size_t size)
+{
+    if (alloc_counting)
+	__sync_fetch_and_add(&alloc_count, 1);
+    return __libc_calloc(nmemb, size);
+}
+
+void* realloc(void* ptr, size_t size)
+{
+    if (alloc_counting)
+	__sync_fetch_and_add(&alloc_count, 1);
+    return __libc_realloc(ptr, size);
+}
+#else
+static long alloc_count = 0;
+static int  alloc_counting = 0;
+#endif
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec/1000000.0;
+}
+
+static void report(const char* name, long long bytes, double secs)
+{
+    if (secs <= 0)
+	secs = 0.000001;
+    printf("%-24s %12lld bytes %8.3f sec %10.2f MB/s\n", name, bytes, secs, bytes/secs/(1024*1024));
+}
+
+static void report_ops(const char* name, long ops, double secs)
+{
+    if (secs <= 0)
+	secs = 0.000001;
+    printf("%-24s %12ld ops   %8.3f sec %10.0f ops/s\n", name, ops, secs, ops/secs);
+}
+
+// read the whole file with growing read pipeline depth
+int bench_pipeline(MVFS_FILESYSTEM* fs, const char* filename)
+{
+    static const int depths[] = { 1, 2, 4, 8, 16, 32 };
+    char* buffer = malloc(READ_BUFSIZE);
+    int x;
+
+    for (x=0; x<sizeof(depths)/sizeof(depths[0]); x++)
+    {
+	MVFS_FILE* file = mvfs_fs_openfile(fs, filename, O_RDONLY);
+	if (file == NULL)
+	{
+	    fprintf(stderr,"Cannot open file: \"%s\"\n", filename);
+	    free(buffer);
+	    return -1;
+	}
+
+	if (mvfs_file_setflag(file, READ_PIPELINE, depths[x]) != 0)
+	    fprintf(stderr,"WARN: fs doesn't support READ_PIPELINE\n");
+
+	long long total = 0;
+	ssize_t ret;
+	double start = now();
+	while ((ret = mvfs_file_read(file, buffer, READ_BUFSIZE)) > 0)
+	    total += ret;
+	double secs = now()-start;
+	mvfs_file_close(file);
+
+	char name[64];
+	sprintf(name, "pipeline depth %d", depths[x]);
+	report(name, total, secs);
+    }
+
+    free(buffer);
+    return 0;
+}
+
+// read the whole file in chunks of given size, copying or lending
+static long long read_file(MVFS_FILESYSTEM* fs, const char* filename, size_t chunk, int lend, double* secs)
+{
+    MVFS_FILE* file = mvfs_fs_openfile(fs, filename, O_RDONLY);
+    if (file == NULL)
+    {
+	fprintf(stderr,"Cannot open file: \"%s\"\n", filename);
+	return -1;
+    }
+
+    char* buffer = malloc(chunk);
+    long long total = 0;
+    ssize_t ret;
+    double start = now();
+
+    if (lend)
+    {
+	const void* data;
+	mvfs_file_setflag(file, READ_AHEAD, 4*READ_BUFSIZE);
+	while ((ret = mvfs_file_read_into(file, &data, chunk)) > 0)
+	{
+	    total += ret;
+	    mvfs_file_release(file, data);
+	}
+    }
+    else
+    {
+	while ((ret = mvfs_file_read(file, buffer, chunk)) > 0)
+	    total += ret;
+    }
+
+    *secs = now()-start;
+    mvfs_file_close(file);
+    free(buffer);
+    return total;
+}
+
+// compare plain reads and zero-copy reads for several chunk sizes
+int bench_read(MVFS_FILESYSTEM* fs, const char* filename)
+{
+    static const size_t sizes[] = { 4096, 65536, 1024*1024 };
+    int x;
+
+    for (x=0; x<sizeof(sizes)/sizeof(sizes[0]); x++)
+    {
+	char name[64];
+	double secs;
+	long long total;
+
+	if ((total = read_file(fs, filename, sizes[x], 0, &secs)) < 0)
+	    return -1;
+	sprintf(name, "read %ldk", (long)sizes[x]/1024);
+	report(name, total, secs);
+
+	if ((total = read_file(fs, filename, sizes[x], 1, &secs)) < 0)
+	    return -1;
+	sprintf(name, "read_into %ldk", (long)sizes[x]/1024);
+	report(name, total, secs);
+    }
+
+    return 0;
+}
+
+typedef struct
+{
+    MVFS_FILE*	file;
+    long	blocks;
+    unsigned	seed;
+    long long	bytes;
+    int		errors;
+} RANDREAD_WORKER;
+
+static void* randread_worker(void* arg)
+{
+    RANDREAD_WORKER* w = (RANDREAD_WORKER*)arg;
+    char buffer[RANDREAD_BLOCK];
+    int x;
+
+    for (x=0; x<RANDREAD_OPS; x++)
+    {
+	off64_t offset = (off64_t)(rand_r(&w->seed) % w->blocks) * RANDREAD_BLOCK;
+	ssize_t ret = mvfs_file_pread(w->file, buffer, RANDREAD_BLOCK, offset);
+	if (ret < 0)
+	    w->errors++;
+	else
+	    w->bytes += ret;
+    }
+    return NULL;
+}
+
+// random 4k preads on one shared file handle from growing number of threads
+int bench_randread(MVFS_FILESYSTEM* fs, const char* filename)
+{
+    static const int threads[] = { 1, 2, 4, 8, 16 };
+    int x, y;
+
+    MVFS_FILE* file = mvfs_fs_openfile(fs, filename, O_RDONLY);
+    if (file == NULL)
+    {
+	fprintf(stderr,"Cannot open file: \"%s\"\n", filename);
+	return -1;
+    }
+
+    MVFS_STAT* st = mvfs_file_stat(file);
+    long blocks = (st ? st->size / RANDREAD_BLOCK : 0);
+    mvfs_stat_free(st);
+    if (blocks < 1)
+    {
+	fprintf(stderr,"File too small: \"%s\"\n", filename);
+	mvfs_file_close(file);
+	return -1;
+    }
+
+    for (x=0; x<sizeof(threads)/sizeof(threads[0]); x++)
+    {
+	RANDREAD_WORKER workers[threads[x]];
+	pthread_t tids[threads[x]];
+	long long total = 0;
+	int errors = 0;
+
+	double start = now();
+	for (y=0; y<threads[x]; y++)
+	{
+	    memset(&workers[y], 0, sizeof(workers[y]));
+	    workers[y].file   = file;
+	    workers[y].blocks = blocks;
+	    workers[y].seed   = y+1;
+	    pthread_create(&tids[y], NULL, randread_worker, &workers[y]);
+	}
+	for (y=0; y<threads[x]; y++)
+	{
+	    pthread_join(tids[y], NULL);
+	    total  += workers[y].bytes;
+	    errors += workers[y].errors;
+	}
+	double secs = now()-start;
+
+	char name[64];
+	sprintf(name, "randread %d threads", threads[x]);
+	report(name, total, secs);
+	if (errors)
+	    fprintf(stderr,"WARN: %d failed reads\n", errors);
+    }
+
+    mvfs_file_close(file);
+    return 0;
+}
+
+// scan the whole file via read() vs. an memory mapping
+int bench_map(MVFS_FILESYSTEM* fs, const char* filename)
+{
+    MVFS_FILE* file = mvfs_fs_openfile(fs, filename, O_RDONLY);
+    if (file == NULL)
+    {
+	fprintf(stderr,"Cannot open file: \"%s\"\n", filename);
+	return -1;
+    }
+
+    MVFS_STAT* st = mvfs_file_stat(file);
+    size_t size = (st ? st->size : 0);
+    mvfs_stat_free(st);
+    if (size == 0)
+    {
+	fprintf(stderr,"Empty file: \"%s\"\n", filename);
+	mvfs_file_close(file);
+	return -1;
+    }
+
+    char* buffer = malloc(READ_BUFSIZE);
+    unsigned long sum1 = 0, sum2 = 0;
+    long long total = 0;
+    ssize_t ret;
+    size_t x;
+
+    double start = now();
+    while ((ret = mvfs_file_read(file, buffer, READ_BUFSIZE)) > 0)
+    {
+	for (x=0; x<ret; x++)
+	    sum1 += (unsigned char)buffer[x];
+	total += ret;
+    }
+    report("read + scan", total, now()-start);
+    free(buffer);
+
+    start = now();
+    const unsigned char* data = mvfs_file_map(file, 0, size, PROT_READ);
+    if (data == NULL)
+    {
+	fprintf(stderr,"Cannot map file: \"%s\"\n", filename);
+	mvfs_file_close(file);
+	return -1;
+    }
+    for (x=0; x<size; x++)
+	sum2 += data[x];
+    mvfs_file_unmap(file, (void*)data, size);
+    report("map + scan", size, now()-start);
+
+    if (sum1 != sum2)
+	fprintf(stderr,"WARN: checksums differ\n");
+
+    mvfs_file_close(file);
+    return 0;
+}
+
+// stat the same file directly and through the autoconnect fs
+int bench_acstat(MVFS_FILESYSTEM* fs, const char* url, const char* filename)
+{
+    char fullurl[4096];
+    size_t len = strlen(url);
+    if ((len) && (url[len-1] == '/'))
+	len--;
+    snprintf(fullurl, sizeof(fullurl), "%.*s%s", (int)len, url, filename);
+
+    MVFS_FILESYSTEM* acfs = mvfs_autoconnectfs_create();
+    MVFS_STAT* st;
+    long x;
+
+    double start = now();
+    for (x=0; x<STAT_OPS; x++)
+    {
+	if ((st = mvfs_fs_statfile(fs, filename)) == NULL)
+	{
+	    fprintf(stderr,"Cannot stat file: \"%s\"\n", filename);
+	    return -1;
+	}
+	mvfs_stat_free(st);
+    }
+    report_ops("stat direct", STAT_OPS, now()-start);
+
+    start = now();
+    for (x=0; x<STAT_OPS; x++)
+    {
+	if ((st = mvfs_fs_statfile(acfs, fullurl)) == NULL)
+	{
+	    fprintf(stderr,"Cannot stat url: \"%s\"\n", fullurl);
+	    return -1;
+	}
+	mvfs_stat_free(st);
+    }
+    report_ops("stat autoconnect", STAT_OPS, now()-start);
+
+    mvfs_fs_unref(acfs);
+    return 0;
+}
+
+// stat an existing and an missing file, directly and through metacache
+static int _mcstat_loop(MVFS_FILESYSTEM* fs, const char* filename, const char* missing, const char* title)
+{
+    MVFS_STAT* st;
+    long x;
+
+    double start = now();
+    for (x=0; x<MCSTAT_OPS; x++)
+    {
+	if ((st = mvfs_fs_statfile(fs, filename)) == NULL)
+	{
+	    fprintf(stderr,"Cannot stat file: \"%s\"\n", filename);
+	    return -1;
+	}
+	mvfs_stat_free(st);
+	if ((st = mvfs_fs_statfile(fs, missing)) != NULL)
+	{
+	    fprintf(stderr,"File should not exist: \"%s\"\n", missing);
+	    mvfs_stat_free(st);
+	    return -1;
+	}
+    }
+    report_ops(title, MCSTAT_OPS*2, now()-start);
+    return 0;
+}
+
+static void _mcstat_report(MVFS_FILESYSTEM* mcfs)
+{
+    MVFS_METACACHE_STATS stats;
+    mvfs_metacachefs_getstats(mcfs, &stats);
+    printf("%-24s hits=%lu neg_hits=%lu dir_hits=%lu misses=%lu coalesced=%lu expired=%lu\n", "",
+	stats.hits, stats.neg_hits, stats.dir_hits, stats.misses, stats.coalesced, stats.expired);
+    printf("%-24s entries=%lu bytes=%lu evictions=%lu\n", "",
+	stats.entries, (unsigned long)stats.bytes, stats.evictions);
+}
+
+int bench_mcstat(MVFS_FILESYSTEM* fs, const char* filename)
+{
+    char missing[4096];
+    snprintf(missing, sizeof(missing), "%s.missing", filename);
+
+    if (_mcstat_loop(fs, filename, missing, "stat direct"))
+	return -1;
+
+    MVFS_FILESYSTEM* mcfs = mvfs_metacachefs_create_1(fs);
+    if (_mcstat_loop(mcfs, filename, missing, "stat metacache"))
+	return -1;
+    _mcstat_report(mcfs);
+    mvfs_fs_unref(mcfs);
+
+    // no negative caching and an short TTL, so records expire while
+    // the backend is busy answering for the missing file
+    MVFS_ARGS* args = mvfs_args_alloc();
+    mvfs_args_set(args, "ttl", "1");
+    mvfs_args_set(args, "neg_ttl", "0");
+    mcfs = mvfs_metacachefs_create_args(fs, args);
+    mvfs_args_free(args);
+    if (_mcstat_loop(mcfs, filename, missing, "stat metacache ttl=1ms"))
+	return -1;
+    _mcstat_report(mcfs);
+    mvfs_fs_unref(mcfs);
+    return 0;
+}
+
+typedef struct
+{
+    MVFS_FILESYSTEM* fs;
+    char**           paths;
+    unsigned         seed;
+    long             ops;
+} MCSTORM_WORKER;
+
+static void* mcstorm_worker(void* arg)
+{
+    MCSTORM_WORKER* w = (MCSTORM_WORKER*)arg;
+    long x;
+
+    for (x=0; x<MCSTORM_OPS; x++)
+    {
+	MVFS_STAT* st = mvfs_fs_statfile(w->fs, w->paths[rand_r(&w->seed) % MCSTORM_PATHS]);
+	mvfs_stat_free(st);
+	w->ops++;
+    }
+    return NULL;
+}
+
+// random stats on an small set of (mostly missing) paths from growing
+// number of threads, each round on an cold metacache
+int bench_mcstorm(MVFS_FILESYSTEM* fs, const char* filename)
+{
+    static const int threads[] = { 1, 2, 4, 8, 16 };
+    char* paths[MCSTORM_PATHS];
+    int x, y;
+
+    paths[0] = strdup(filename);
+    for (x=1; x<MCSTORM_PATHS; x++)
+    {
+	paths[x] = malloc(strlen(filename)+32);
+	sprintf(paths[x], "%s.missing.%d", filename, x);
+    }
+
+    for (x=0; x<sizeof(threads)/sizeof(threads[0]); x++)
+    {
+	MCSTORM_WORKER workers[threads[x]];
+	pthread_t tids[threads[x]];
+	long total = 0;
+
+	MVFS_FILESYSTEM* mcfs = mvfs_metacachefs_create_1(fs);
+
+	double start = now();
+	for (y=0; y<threads[x]; y++)
+	{
+	    memset(&workers[y], 0, sizeof(workers[y]));
+	    workers[y].fs    = mcfs;
+	    workers[y].paths = paths;
+	    workers[y].seed  = y+1;
+	    pthread_create(&tids[y], NULL, mcstorm_worker, &workers[y]);
+	}
+	for (y=0; y<threads[x]; y++)
+	{
+	    pthread_join(tids[y], NULL);
+	    total += workers[y].ops;
+	}
+	double secs = now()-start;
+
+	char name[64];
+	sprintf(name, "mcstorm %d threads", threads[x]);
+	report_ops(name, total, secs);
+	_mcstat_report(mcfs);
+	mvfs_fs_unref(mcfs);
+    }
+
+    for (x=0; x<MCSTORM_PATHS; x++)
+	free(paths[x]);
+    return 0;
+}
+
+// "ls -l": scan an directory, then stat each entry and an missing one
+static long _mcls_round(MVFS_FILESYSTEM* fs, const char* dirname)
+{
+    char path[4096];
+    long ops = 0;
+
+    MVFS_FILE* dir = mvfs_fs_openfile(fs, dirname, O_RDONLY);
+    if (dir == NULL)
+	return -1;
+
+    MVFS_STAT* st;
+    while ((st = mvfs_file_scan(dir)))
+    {
+	snprintf(path, sizeof(path), "%s/%s", dirname, st->name);
+	mvfs_stat_free(st);
+	mvfs_stat_free(mvfs_fs_statfile(fs, path));
+	ops++;
+    }
+    mvfs_file_close(dir);
+
+    snprintf(path, sizeof(path), "%s/.missing", dirname);
+    mvfs_stat_free(mvfs_fs_statfile(fs, path));
+    return ops+1;
+}
+
+int bench_mcls(MVFS_FILESYSTEM* fs, const char* dirname)
+{
+    MVFS_FILESYSTEM* mcfs = mvfs_metacachefs_create_1(fs);
+    MVFS_FILESYSTEM* fss[] = { fs, mcfs };
+    const char* names[] = { "ls -l direct", "ls -l metacache" };
+    int x, y;
+
+    for (x=0; x<2; x++)
+    {
+	long ops = 0;
+	double start = now();
+	for (y=0; y<MCLS_ROUNDS; y++)
+	{
+	    long n = _mcls_round(fss[x], dirname);
+	    if (n < 0)
+	    {
+		fprintf(stderr,"Cannot open directory: \"%s\"\n", dirname);
+		return -1;
+	    }
+	    ops += n;
+	}
+	report_ops(names[x], ops, now()-start);
+    }
+
+    _mcstat_report(mcfs);
+    mvfs_fs_unref(mcfs);
+    return 0;
+}
+
+// one full directory scan, entry by entry or in batches
+static long _scan_round(MVFS_FILESYSTEM* fs, const char* dirname, int batch)
+{
+    MVFS_STAT* stats[SCAN_BATCH];
+    long entries = 0;
+    ssize_t count, x;
+
+    MVFS_FILE* dir = mvfs_fs_openfile(fs, dirname, O_RDONLY);
+    if (dir == NULL)
+	return -1;
+
+    if (batch)
+    {
+	while ((count = mvfs_file_scan_batch(dir, stats, SCAN_BATCH)) > 0)
+	{
+	    for (x=0; x<count; x++)
+		mvfs_stat_free(stats[x]);
+	    entries += count;
+	}
+    }
+    else
+    {
+	MVFS_STAT* st;
+	while ((st = mvfs_file_scan(dir)))
+	{
+	    mvfs_stat_free(st);
+	    entries++;
+	}
+    }
+
+    mvfs_file_close(dir);
+    return entries;
+}
+
+int bench_scan(MVFS_FILESYSTEM* fs, const char* dirname)
+{
+    MVFS_FILESYSTEM* mcfs = mvfs_metacachefs_create_1(fs);
+    MVFS_FILESYSTEM* fss[] = { fs, fs, mcfs, mcfs };
+    const char* names[] = { "scan direct", "scan_batch direct", "scan metacache", "scan_batch metacache" };
+    int x, y;
+
+    for (x=0; x<4; x++)
+    {
+	long entries = 0;
+	long allocs = alloc_count;
+	alloc_counting = 1;
+	double start = now();
+	for (y=0; y<SCAN_ROUNDS; y++)
+	{
+	    long n = _scan_round(fss[x], dirname, x & 1);
+	    if (n < 0)
+	    {
+		alloc_counting = 0;
+		fprintf(stderr,"Cannot open directory: \"%s\"\n", dirname);
+		return -1;
+	    }
+	    entries += n;
+	}
+	alloc_counting = 0;
+	report_ops(names[x], entries, now()-start);
+	printf("%-24s %12.1f allocs/entry\n", "", entries ? (double)(alloc_count-allocs)/entries : 0.0);
+    }
+
+    mvfs_fs_unref(mcfs);
+    return 0;
+}
+
+// recursive walk - returns the number of entries below dirname
+static long _walk(MVFS_FILESYSTEM* fs, const char* dirname, int names_only)
+{
+    MVFS_STAT* stats[SCAN_BATCH];
+    char path[4096];
+    long entries = 0;
+    ssize_t count, x;
+
+    MVFS_FILE* dir = mvfs_fs_openfile(fs, dirname, O_RDONLY);
+    if (dir == NULL)
+	return 0;
+    if (names_only)
+	mvfs_file_setflag(dir, SCAN_NAMES_ONLY, 1);
+
+    while ((count = mvfs_file_scan_batch(dir, stats, SCAN_BATCH)) > 0)
+    {
+	for (x=0; x<count; x++)
+	{
+	    if (S_ISDIR(stats[x]->mode))
+	    {
+		snprintf(path, sizeof(path), "%s/%s", dirname, stats[x]->name);
+		entries += _walk(fs, path, names_only);
+	    }
+	    mvfs_stat_free(stats[x]);
+	}
+	entries += count;
+    }
+
+    mvfs_file_close(dir);
+    return entries;
+}
+
+static int _walk_count(const char* path, MVFS_STAT* st, int depth, void* arg)
+{
+    __sync_fetch_and_add((long*)arg, 1);
+    return 0;
+}
+
+int bench_walk(MVFS_FILESYSTEM* fs, const char* dirname)
+{
+    const char* names[] = { "walk stat", "walk names only" };
+    const int threads[] = { 1, 4, 8 };
+    char name[64];
+    int x, y, z;
+
+    for (x=0; x<2; x++)
+    {
+	long entries = 0;
+	double start = now();
+	for (y=0; y<WALK_ROUNDS; y++)
+	    entries += _walk(fs, dirname, x);
+	report_ops(names[x], entries, now()-start);
+    }
+
+    // mvfs_walk(), unordered and ordered
+    for (x=0; x<2; x++)
+    {
+	for (z=0; z<3; z++)
+	{
+	    MVFS_WALK_OPTS opts = { .threads = threads[z], .ordered = x };
+	    long entries = 0;
+	    double start = now();
+
+	    opts.arg = &entries;
+	    for (y=0; y<WALK_ROUNDS; y++)
+	    {
+		int ret = mvfs_walk(fs, dirname, _walk_count, &opts);
+		if (ret < 0)
+		{
+		    fprintf(stderr,"Cannot walk \"%s\": %s\n", dirname, strerror(-ret));
+		    return -1;
+		}
+	    }
+	    snprintf(name, sizeof(name), "mvfs_walk%s %d thr", (x ? " ordered" : ""), threads[z]);
+	    report_ops(name, entries, now()-start);
+	}
+    }
+    return 0;
+}
+
+// hot file: whole-file reads and random 4k preads, directly and through datacache
+int bench_dcread(MVFS_FILESYSTEM* fs, const char* filename)
+{
+    MVFS_FILESYSTEM* dcfs = mvfs_datacachefs_create_1(fs, 0);
+    MVFS_FILESYSTEM* fss[] = { fs, dcfs };
+    const char* names[] = { "direct", "datacache" };
+    char buffer[RANDREAD_BLOCK];
+    char name[64];
+    int x, y;
+
+    for (x=0; x<2; x++)
+    {
+	for (y=0; y<DCREAD_ROUNDS; y++)
+	{
+	    double secs;
+	    long long total = read_file(fss[x], filename, 65536, 0, &secs);
+	    if (total < 0)
+		return -1;
+	    sprintf(name, "read %s #%d", names[x], y+1);
+	    report(name, total, secs);
+	}
+
+	MVFS_FILE* file = mvfs_fs_openfile(fss[x], filename, O_RDONLY);
+	MVFS_STAT* st = (file ? mvfs_file_stat(file) : NULL);
+	long blocks = (st ? st->size / RANDREAD_BLOCK : 0);
+	mvfs_stat_free(st);
+	if (blocks < 1)
+	{
+	    fprintf(stderr,"File too small: \"%s\"\n", filename);
+	    mvfs_file_close(file);
+	    return -1;
+	}
+
+	unsigned seed = 1;
+	long long total = 0;
+	double start = now();
+	for (y=0; y<RANDREAD_OPS; y++)
+	{
+	    off64_t offset = (off64_t)(rand_r(&seed) % blocks) * RANDREAD_BLOCK;
+	    ssize_t ret = mvfs_file_pread(file, buffer, RANDREAD_BLOCK, offset);
+	    if (ret > 0)
+		total += ret;
+	}
+	sprintf(name, "randread %s", names[x]);
+	report(name, total, now()-start);
+	mvfs_file_close(file);
+    }
+
+    MVFS_DATACACHE_STATS stats;
+    mvfs_datacachefs_getstats(dcfs, &stats);
+    printf("%-24s hits=%lu misses=%lu evictions=%lu invalidations=%lu blocks=%lu bytes=%lu\n", "",
+	stats.hits, stats.misses, stats.evictions, stats.invalidations, stats.blocks, (unsigned long)stats.bytes);
+
+    mvfs_fs_unref(dcfs);
+    return 0;
+}
+
+// parse an URL into args and query them, counting heap allocations
+int bench_args(const char* url)
+{
+    long x;
+    long allocs = alloc_count;
+
+    alloc_counting = 1;
+    double start = now();
+    for (x=0; x<ARGS_OPS; x++)
+    {
+	MVFS_ARGS* args = mvfs_args_from_url(url);
+	if ((args == NULL) || (mvfs_args_get(args,"type") == NULL))
+	{
+	    alloc_counting = 0;
+	    fprintf(stderr,"Cannot parse url: \"%s\"\n", url);
+	    return -1;
+	}
+	mvfs_args_get(args,"host");
+	mvfs_args_get(args,"port");
+	mvfs_args_get(args,"path");
+	mvfs_args_free(args);
+    }
+    alloc_counting = 0;
+    report_ops("args from url", ARGS_OPS, now()-start);
+    printf("%-24s %12.1f allocs/op\n", "", (double)(alloc_count-allocs)/ARGS_OPS);
+    return 0;
+}
+
+void usage(const char* argv0)
+{
+    fprintf(stderr,"%s <url> pipeline <filename>\n", argv0);
+    fprintf(stderr,"%s <url> read <filename>\n", argv0);
+    fprintf(stderr,"%s <url> randread <filename>\n", argv0);
+    fprintf(stderr,"%s <url> map <filename>\n", argv0);
+    fprintf(stderr,"%s <url> acstat <filename>\n", argv0);
+    fprintf(stderr,"%s <url> mcstat <filename>\n", argv0);
+    fprintf(stderr,"%s <url> mcstorm <filename>\n", argv0);
+    fprintf(stderr,"%s <url> mcls <dirname>\n", argv0);
+    fprintf(stderr,"%s <url> dcread <filename>\n", argv0);
+    fprintf(stderr,"%s <url> scan <dirname>\n", argv0);
+    fprintf(stderr,"%s <url> walk <dirname>\n", argv0);
+    fprintf(stderr,"%s <url> args\n", argv0);
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 3)
+    {
+	usage(argv[0]);
+	return 1;
+    }
+
+    // doesn't need an connection
+    if (strcmp(argv[2],"args")==0)
+	return bench_args(argv[1]) ? 1 : 0;
+
+    MVFS_ARGS* args = mvfs_args_from_url(argv[1]);
+    MVFS_FILESYSTEM* fs = mvfs_fs_create_args(args);
+    if (fs == NULL)
+    {
+	fprintf(stderr,"Could not connect to filesystem \"%s\"\n", argv[1]);
+	return 1;
+    }
+
+    if ((strcmp(argv[2],"pipeline")==0) && (argc > 3))
+	return bench_pipeline(fs, argv[3]) ? 1 : 0;
+    if ((strcmp(argv[2],"read")==0) && (argc > 3))
+	return bench_read(fs, argv[3]) ? 1 : 0;
+    if ((strcmp(argv[2],"randread")==0) && (argc > 3))
+	return bench_randread(fs, argv[3]) ? 1 : 0;
+    if ((strcmp(argv[2],"map")==0) && (argc > 3))
+	return bench_map(fs, argv[3]) ? 1 : 0;
+    if ((strcmp(argv[2],"acstat")==0) && (argc > 3))
+	return bench_acstat(fs, argv[1], argv[3]) ? 1 : 0;
+    if ((strcmp(argv[2],"mcstat")==0) && (argc > 3))
+	return bench_mcstat(fs, argv[3]) ? 1 : 0;
+    if ((strcmp(argv[2],"mcstorm")==0) && (argc > 3))
+	return bench_mcstorm(fs, argv[3]) ? 1 : 0;
+    if ((strcmp(argv[2],"mcls")==0) && (argc > 3))
+	return bench_mcls(fs, argv[3]) ? 1 : 0;
+    if ((strcmp(argv[2],"dcread")==0) && (argc > 3))
+	return bench_dcread(fs, argv[3]) ? 1 : 0;
+    if ((strcmp(argv[2],"scan")==0) && (argc > 3))
+	return bench_scan(fs, argv[3]) ? 1 : 0;
+    if ((strcmp(argv[2],"walk")==0) && (argc > 3))
+	return bench_walk(fs, argv[3]) ? 1 : 0;
+
+    usage(argv[0]);
+    return 1;
+}
@@ -22,9 +22,15 @@ MVFS_ARGS*  mvfs_args_alloc();
 /* free an given args structure */
 int         mvfs_args_parse(const char* s);
 
-/* set an argument value */
+/* set an argument value - NULL removes it */
 int         mvfs_args_set(MVFS_ARGS* args, const char* name, const char* value);
 
+/* set an argument value from the first sz chars of value */
+int         mvfs_args_setn(MVFS_ARGS* args, const char* name, const char* value, int sz);
+
+/* release an args structure along with all its values */
+int         mvfs_args_free(MVFS_ARGS* args);
+
 /* get an argument value - not that the result is readonly and only of temporary lifetime - strdup() asap */
 const char* mvfs_args_get(MVFS_ARGS* args, const char* name);
 
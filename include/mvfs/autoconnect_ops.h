@@ -20,6 +20,10 @@ MVFS_FILESYSTEM* mvfs_autoconnectfs_create();
 // each connection is represented by an string with newline (\n)
 char*            mvfs_autoconnectfs_getconnections(MVFS_FILESYSTEM* fs);
 
+// drop connections which have been idle (no operations running and no
+// files open) for at least max_idle seconds - returns the number dropped
+int              mvfs_autoconnectfs_evict(MVFS_FILESYSTEM* fs, int max_idle);
+
 #ifdef __cplusplus
 }
 #endif
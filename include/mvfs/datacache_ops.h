@@ -0,0 +1,43 @@
+/*
+    libmvfs - metux Virtual Filesystem Library
+
+    Data-caching filesystem API
+
+    Copyright (C) 2008 Enrico Weigelt, metux IT service <weigelt@metux.de>
+    This code is published under the terms of the GNU Public License 2.0
+*/
+
+#ifndef __MVFS_DATACACHE_OPS_H
+#define __MVFS_DATACACHE_OPS_H
+
+#include <mvfs/mvfs.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct
+{
+    unsigned long hits;			// block reads served from memory
+    unsigned long misses;		// blocks fetched from the backend
+    unsigned long disk_hits;		// block reads served from the disk cache
+    unsigned long evictions;		// blocks dropped to stay within the capacity
+    unsigned long invalidations;	// files whose cached blocks became stale (changed or written)
+    unsigned long blocks;		// blocks currently cached
+    size_t        bytes;		// memory currently used by cached blocks
+} MVFS_DATACACHE_STATS;
+
+// capacity: memory budget in bytes (0 = default)
+MVFS_FILESYSTEM* mvfs_datacachefs_create_1(MVFS_FILESYSTEM* fs, size_t capacity);
+
+// args: "capacity" (bytes), "blocksize", "cache_dir" and "cache_dir_max" (bytes) - args may be NULL
+MVFS_FILESYSTEM* mvfs_datacachefs_create_args(MVFS_FILESYSTEM* fs, MVFS_ARGS* args);
+
+// fetch the cache counters
+int              mvfs_datacachefs_getstats(MVFS_FILESYSTEM* fs, MVFS_DATACACHE_STATS* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
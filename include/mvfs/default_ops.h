@@ -22,6 +22,14 @@ ssize_t    mvfs_default_fileops_pread   (MVFS_FILE* fp, void* buf, size_t count,
 ssize_t    mvfs_default_fileops_pwrite  (MVFS_FILE* fp, const void* buf, size_t count, off64_t offset);
 ssize_t    mvfs_default_fileops_read    (MVFS_FILE* fp, void* buf, size_t count);
 ssize_t    mvfs_default_fileops_write   (MVFS_FILE* fp, const void* buf, size_t count);
+ssize_t    mvfs_default_fileops_read_into (MVFS_FILE* fp, const void** data, size_t count);
+int        mvfs_default_fileops_release (MVFS_FILE* fp, const void* data);
+ssize_t    mvfs_default_fileops_readv   (MVFS_FILE* fp, const struct iovec* iov, int iovcnt);
+ssize_t    mvfs_default_fileops_writev  (MVFS_FILE* fp, const struct iovec* iov, int iovcnt);
+ssize_t    mvfs_default_fileops_preadv  (MVFS_FILE* fp, const struct iovec* iov, int iovcnt, off64_t offset);
+ssize_t    mvfs_default_fileops_pwritev (MVFS_FILE* fp, const struct iovec* iov, int iovcnt, off64_t offset);
+void*      mvfs_default_fileops_mmap    (MVFS_FILE* fp, off64_t offset, size_t len, int prot);
+int        mvfs_default_fileops_munmap  (MVFS_FILE* fp, void* addr, size_t len);
 int        mvfs_default_fileops_setflag (MVFS_FILE* fp, MVFS_FILE_FLAG flag, long value);
 int        mvfs_default_fileops_getflag (MVFS_FILE* fp, MVFS_FILE_FLAG flag, long* value);
 MVFS_STAT* mvfs_default_fileops_stat    (MVFS_FILE* fp);
@@ -30,6 +38,7 @@ int        mvfs_default_fileops_eof     (MVFS_FILE* fp);
 int        mvfs_default_fileops_free    (MVFS_FILE* fp);
 MVFS_STAT* mvfs_default_fileops_scan    (MVFS_FILE* fp);
 int        mvfs_default_fileops_reset   (MVFS_FILE* fp);
+ssize_t    mvfs_default_fileops_scan_batch (MVFS_FILE* fp, MVFS_STAT** stats, size_t max);
 MVFS_FILE* mvfs_default_fileops_lookup  (MVFS_FILE* fp, const char* name);
 
 MVFS_FILE* mvfs_default_fsops_openfile (MVFS_FILESYSTEM* fs, const char* name, mode_t mode);
@@ -21,20 +21,56 @@
 extern "C" {
 #endif
 
+/*
+   read()/pread() only touch the first (returned) bytes of the caller's
+   buffer - the rest is left as it is, never zero-filled.
+
+   pread()/pwrite() don't move the file position. Drivers with native
+   positional I/O (eg. hostfs) allow several threads to use them on
+   the same file at once.
+
+   readv()/writev()/preadv()/pwritev() work like their POSIX
+   counterparts. Drivers without native support fall back to one
+   call per vector element, stopping at the first short transfer.
+
+   mvfs_file_map() maps len bytes at offset into memory (prot as for
+   mmap(2), offset needs no alignment) and returns NULL on error. It
+   has to be given back with mvfs_file_unmap() on the same file. Drivers
+   without native mmap() get an emulation which reads the region into
+   anonymous memory and writes it back on unmap if PROT_WRITE was
+   given. Like with mmap(2), the file isn't extended by the mapping.
+
+   read_into() is the zero-copy variant: instead of copying, the driver
+   lends an pointer to up to count bytes of its own buffers, which stays
+   valid until it's given back via mvfs_file_release(). That has to
+   happen before the next operation on the file. Drivers which can't
+   lend anything fall back to an temporary buffer.
+*/
 off64_t    mvfs_file_seek    (MVFS_FILE* fp, off64_t offset, int whence);
 ssize_t    mvfs_file_read    (MVFS_FILE* fp, void* buf, size_t count);
+ssize_t    mvfs_file_read_into (MVFS_FILE* fp, const void** data, size_t count);
+int        mvfs_file_release (MVFS_FILE* fp, const void* data);
 ssize_t    mvfs_file_write   (MVFS_FILE* fp, const void* buf, size_t count);
 ssize_t    mvfs_file_pread   (MVFS_FILE* fp, void* buf, size_t count, off64_t offset);
 ssize_t    mvfs_file_pwrite  (MVFS_FILE* fp, const void* buf, size_t count, off64_t offset);
+ssize_t    mvfs_file_readv   (MVFS_FILE* fp, const struct iovec* iov, int iovcnt);
+ssize_t    mvfs_file_writev  (MVFS_FILE* fp, const struct iovec* iov, int iovcnt);
+ssize_t    mvfs_file_preadv  (MVFS_FILE* fp, const struct iovec* iov, int iovcnt, off64_t offset);
+ssize_t    mvfs_file_pwritev (MVFS_FILE* fp, const struct iovec* iov, int iovcnt, off64_t offset);
+void*      mvfs_file_map     (MVFS_FILE* fp, off64_t offset, size_t len, int prot);
+int        mvfs_file_unmap   (MVFS_FILE* fp, void* addr, size_t len);
 int        mvfs_file_setflag (MVFS_FILE* fp, MVFS_FILE_FLAG flag, long value);
 int        mvfs_file_getflag (MVFS_FILE* fp, MVFS_FILE_FLAG flag, long* value);
 MVFS_STAT* mvfs_file_stat    (MVFS_FILE* fp);
+int        mvfs_file_eof     (MVFS_FILE* fp);
+int        mvfs_file_close   (MVFS_FILE* fp);
 MVFS_FILE* mvfs_file_alloc   (MVFS_FILESYSTEM* fs, MVFS_FILE_OPS ops);
 int        mvfs_file_unref   (MVFS_FILE* file);
 int        mvfs_file_ref     (MVFS_FILE* file);
 MVFS_FILE* mvfs_file_lookup  (MVFS_FILE* file, const char* name);
 MVFS_STAT* mvfs_file_scan    (MVFS_FILE* file);
 int        mvfs_file_reset   (MVFS_FILE* file);
+ssize_t    mvfs_file_scan_batch (MVFS_FILE* file, MVFS_STAT** stats, size_t max);
 
 MVFS_FILE*       mvfs_fs_openfile (MVFS_FILESYSTEM* fs, const char* name, mode_t mode);
 MVFS_STAT*       mvfs_fs_statfile (MVFS_FILESYSTEM* fs, const char* name);
@@ -16,8 +16,29 @@
 extern "C" {
 #endif
 
+typedef struct
+{
+    unsigned long hits;		// served from an stat record
+    unsigned long neg_hits;	// served from an negative (ENOENT) record
+    unsigned long misses;	// had to ask the backend, including coalesced ones
+    unsigned long coalesced;	// misses served by another thread's backend stat
+    unsigned long dir_hits;	// stats and scans served from an directory listing
+    unsigned long expired;	// records dropped since their TTL passed
+    unsigned long evictions;	// records dropped to stay within the limits
+    unsigned long entries;	// records currently cached
+    size_t        bytes;	// memory currently used by the cache
+} MVFS_METACACHE_STATS;
+
 MVFS_FILESYSTEM* mvfs_metacachefs_create_1(MVFS_FILESYSTEM* fs);
 
+// args: "ttl", "neg_ttl" (milliseconds), "ttl_prefix" (per prefix
+// overrides, eg. "/tmp=0,/usr=60000:10000"), "max_entries" and
+// "max_bytes" (cache size limits, 0 = unlimited) - args may be NULL
+MVFS_FILESYSTEM* mvfs_metacachefs_create_args(MVFS_FILESYSTEM* fs, MVFS_ARGS* args);
+
+// fetch the cache counters
+int              mvfs_metacachefs_getstats(MVFS_FILESYSTEM* fs, MVFS_METACACHE_STATS* stats);
+
 #ifdef __cplusplus
 }
 #endif
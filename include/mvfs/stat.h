@@ -38,12 +38,22 @@ struct __mvfs_stat
     time_t      ctime;
 };
 
-/* Free an MVFS_STAT structure. - returns error on NULL ptr passed */
+/*
+   MVFS_STAT structures are reference counted and shared - don't change
+   one after handing it out, use mvfs_stat_copy() instead. Only allocate
+   them via mvfs_stat_alloc().
+*/
+
+/* Free an MVFS_STAT structure (drop an reference). - returns error on NULL ptr passed */
 int        mvfs_stat_free  (MVFS_STAT* st);
 /* Allocate a new MVFS_STAT structure, initialized w/ given parameters (copied) */
 MVFS_STAT* mvfs_stat_alloc (const char* name, const char* uid, const char* gid);
-/* Duplicate (copy) an given MVFS_STAT structure */
+/* Duplicate an given MVFS_STAT structure (take another reference) */
 MVFS_STAT* mvfs_stat_dup   (MVFS_STAT* st);
+/* Copy an given MVFS_STAT structure into an new one, which may be changed */
+MVFS_STAT* mvfs_stat_copy  (MVFS_STAT* st);
+/* Get the pooled copy of an uid/gid name - valid until the process ends */
+const char* mvfs_stat_intern(const char* str);
 
 #ifdef __cplusplus
 }
@@ -16,8 +16,8 @@
 #endif
 
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <inttypes.h>
-#include <hash.h>
 #include <mvfs/stat.h>
 
 #ifdef __cplusplus
@@ -33,14 +33,20 @@ typedef struct __mvfs_fs_ops	MVFS_FILESYSTEM_OPS;
 typedef struct __mvfs_dir	MVFS_DIR;
 typedef struct __mvfs_dir_ops	MVFS_DIR_OPS;
 typedef struct __mvfs_symlink   MVFS_SYMLINK;
+typedef struct __mvfs_readahead MVFS_READAHEAD;
+typedef struct __mvfs_writebehind MVFS_WRITEBEHIND;
 
 typedef enum
 {
     NONBLOCK	  = 1,
     READ_TIMEOUT  = 2,
     WRITE_TIMEOUT = 3,
-    READ_AHEAD    = 4,
-    WRITE_ASYNC   = 5
+    READ_AHEAD    = 4,			// read-ahead window size, 0 = off - not while other threads read the file
+    WRITE_ASYNC   = 5,
+    READ_AHEAD_HITS   = 6,		// readonly: reads served from the read-ahead window
+    READ_AHEAD_MISSES = 7,		// readonly: reads which had to go to the backend
+    READ_PIPELINE     = 8,		// number of parallel read requests per file
+    SCAN_NAMES_ONLY   = 9		// dir scans may only fill in names and file types (mode & S_IFMT)
 } MVFS_FILE_FLAG;
 
 struct __mvfs_symlink
@@ -63,11 +69,20 @@ struct __mvfs_file_ops
     int          (*eof)      (MVFS_FILE* fp);
     MVFS_STAT*   (*stat)     (MVFS_FILE* fp);					
     int          (*free)     (MVFS_FILE* fp);					// free private data (NOT the MVFS_FILE struct !)
+    ssize_t      (*read_into)(MVFS_FILE* fp, const void** data, size_t count);	// lend a chunk of the driver's buffers
+    int          (*release)  (MVFS_FILE* fp, const void* data);			// give back data lent by read_into()
+    ssize_t      (*readv)    (MVFS_FILE* fp, const struct iovec* iov, int iovcnt);			// scatter read
+    ssize_t      (*writev)   (MVFS_FILE* fp, const struct iovec* iov, int iovcnt);			// gather write
+    ssize_t      (*preadv)   (MVFS_FILE* fp, const struct iovec* iov, int iovcnt, off64_t offset);	// scatter read @ offset
+    ssize_t      (*pwritev)  (MVFS_FILE* fp, const struct iovec* iov, int iovcnt, off64_t offset);	// gather write @ offset
+    void*        (*mmap)     (MVFS_FILE* fp, off64_t offset, size_t len, int prot);	// map an region into memory
+    int          (*munmap)   (MVFS_FILE* fp, void* addr, size_t len);		// release an mapping from mmap()
     
     // dir operations
     MVFS_FILE*   (*lookup)   (MVFS_FILE* fp, const char* name);			// open an specific direntry
-    MVFS_STAT*   (*scan)     (MVFS_FILE* fp);					// scan for next dir entry, returned stat MAY be incomplete
+    MVFS_STAT*   (*scan)     (MVFS_FILE* fp);					// scan for next dir entry, returned stat MAY be incomplete - NULL at end (errcode 0) or on error
     int          (*reset)    (MVFS_FILE* fp);					// reset dir scanning
+    ssize_t      (*scan_batch)(MVFS_FILE* fp, MVFS_STAT** stats, size_t max);	// scan for up to max dir entries at once, 0 at end, -1 w/ errcode on error
 };
 
 struct __mvfs_file
@@ -76,6 +91,8 @@ struct __mvfs_file
     int  		errcode;	// error code of last operation
     MVFS_FILE_OPS	ops;		// file operations
     MVFS_FILESYSTEM*	fs;
+    MVFS_READAHEAD*	readahead;	// read-ahead engine, NULL if disabled
+    MVFS_WRITEBEHIND*	writebehind;	// write-behind engine, NULL if disabled
 
     struct
     {
@@ -0,0 +1,55 @@
+/*
+    libmvfs - metux Virtual Filesystem Library
+
+    Parallel tree walker API
+
+    Copyright (C) 2008 Enrico Weigelt, metux IT service <weigelt@metux.de>
+    This code is published under the terms of the GNU Public License 2.0
+*/
+
+#ifndef __LIBMVFS_WALK_H
+#define __LIBMVFS_WALK_H
+
+#include <mvfs/mvfs.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+   called for every entry below the root - depth is 1 for the root's
+   own entries. returning an negative value aborts the walk, mvfs_walk()
+   then returns it. the stat is only valid during the call.
+*/
+typedef int (*MVFS_WALK_CALLBACK)(const char* path, MVFS_STAT* st, int depth, void* arg);
+
+/* decide whether to descend into an directory - nonzero to descend */
+typedef int (*MVFS_WALK_FILTER)(const char* path, MVFS_STAT* st, int depth, void* arg);
+
+typedef struct
+{
+    int              threads;		// worker threads (0 = number of CPUs)
+    int              max_depth;		// don't descend below this depth (0 = unlimited)
+    int              ordered;		// callbacks in serial (depth-first, scan) order, from the calling thread
+    int              names_only;	// stats may only carry names and file types (SCAN_NAMES_ONLY)
+    MVFS_WALK_FILTER filter;		// NULL = descend into all directories
+    void*            arg;		// passed to callback and filter
+} MVFS_WALK_OPTS;
+
+/*
+   walk the tree below root, spreading directory scans over an pool of
+   worker threads. unless ordered, the callback is called concurrently
+   from the workers, in no particular order. the filter always is.
+   symlinks are not followed. opts may be NULL.
+
+   returns 0 on success, an negative errno if the root can't be
+   scanned or the callback's return value if it aborted the walk.
+   unreadable directories below the root are skipped.
+*/
+int mvfs_walk(MVFS_FILESYSTEM* fs, const char* root, MVFS_WALK_CALLBACK callback, MVFS_WALK_OPTS* opts);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -3,5 +3,3 @@
 #
 
 FS_SRCNAMES += autoconnect_ops
-FS_LIBS     += $(HASH_LIBS)
-FS_CFLAGS   += $(HASH_CFLAGS)
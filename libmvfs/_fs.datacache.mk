@@ -0,0 +1,7 @@
+#
+# Rules for the data caching fs
+#
+
+FS_SRCNAMES += datacache_fs diskcache
+FS_LIBS     +=
+FS_CFLAGS   +=
@@ -3,5 +3,3 @@
 #
 
 FS_SRCNAMES += metacache_fs
-FS_LIBS     += $(HASH_LIBS)
-FS_CFLAGS   += $(HASH_CFLAGS)
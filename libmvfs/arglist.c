@@ -3,6 +3,11 @@
 
     Argument list handling
 
+    Args are tiny (an URL gives at most 7 keys), so they're kept in an
+    flat array, the first few entries right inside the args object.
+    Well known key names are interned - no copy needed and mostly
+    found by pointer comparison.
+
     Copyright (C) 2008 Enrico Weigelt, metux IT service <weigelt@metux.de>
     This code is published under the terms of the GNU Public License 2.0
 */
@@ -11,7 +16,6 @@
 
 #include <string.h>
 #include <malloc.h>
-#include <hash.h>
 #include <stdio.h>
 #include <errno.h>
 
@@ -19,23 +23,118 @@
 #include <mvfs/url.h>
 #include <mvfs/_utils.h>
 
+#define ARGS_INLINE	8
+
+typedef struct
+{
+    const char* name;
+    char*       value;
+    int         interned;
+} MVFS_ARG;
+
 struct __mvfs_args
 {
-    hash hashtable;
+    int       count;
+    int       size;
+    MVFS_ARG* entries;			// either inline_entries or malloc()'ed
+    MVFS_ARG  inline_entries[ARGS_INLINE];
+};
+
+static const char* _interned[] =
+{
+    "url", "path", "host", "port", "username", "secret", "type",
+    "chroot", "pipeline", NULL
 };
 
-// not very efficient yet, but should work for now
+static const char* _intern(const char* name)
+{
+    int x;
+    for (x=0; _interned[x]; x++)
+	if ((_interned[x] == name) || (!strcmp(_interned[x], name)))
+	    return _interned[x];
+    return NULL;
+}
+
+static MVFS_ARG* _find(MVFS_ARGS* args, const char* name)
+{
+    int x;
+
+    // callers mostly pass the same literals we've interned
+    for (x=0; x<args->count; x++)
+	if (args->entries[x].name == name)
+	    return &args->entries[x];
+
+    for (x=0; x<args->count; x++)
+	if (!strcmp(args->entries[x].name, name))
+	    return &args->entries[x];
+
+    return NULL;
+}
+
+static void _drop(MVFS_ARGS* args, MVFS_ARG* ent)
+{
+    free(ent->value);
+    if (!ent->interned)
+	free((char*)ent->name);
+    *ent = args->entries[--args->count];
+}
+
+// takes over the value string
+static int _put(MVFS_ARGS* args, const char* name, char* value)
+{
+    if (value == NULL)
+    {
+	ERRMSG("failed for key %s", name);
+	return -1;
+    }
+
+    MVFS_ARG* ent = _find(args, name);
+    if (ent)
+    {
+	free(ent->value);
+	ent->value = value;
+	return 1;
+    }
+
+    if (args->count == args->size)
+    {
+	int size = args->size*2;
+	MVFS_ARG* entries = malloc(size*sizeof(MVFS_ARG));
+	if (entries == NULL)
+	{
+	    ERRMSG("failed for key %s", name);
+	    free(value);
+	    return -1;
+	}
+	memcpy(entries, args->entries, args->count*sizeof(MVFS_ARG));
+	if (args->entries != args->inline_entries)
+	    free(args->entries);
+	args->entries = entries;
+	args->size    = size;
+    }
+
+    ent = &args->entries[args->count++];
+    ent->value    = value;
+    ent->name     = _intern(name);
+    ent->interned = (ent->name != NULL);
+    if (!ent->interned)
+	ent->name = strdup(name);
+
+    return 1;
+}
 
 MVFS_ARGS* mvfs_args_alloc()
 {
-    MVFS_ARGS* args = calloc(1,sizeof(MVFS_ARGS));
-    if (!hash_initialise(&(args->hashtable), 997U, hash_hash_string, hash_compare_string, hash_copy_string, free, free))
+    MVFS_ARGS* args = malloc(sizeof(MVFS_ARGS));
+    if (args == NULL)
     {
-	ERRMSG("hash init failed");
-	free(args);
+	ERRMSG("out of memory");
 	return NULL;
     }
-    
+
+    args->count   = 0;
+    args->size    = ARGS_INLINE;
+    args->entries = args->inline_entries;
     return args;
 }
 
@@ -43,12 +142,9 @@ const char* mvfs_args_get(MVFS_ARGS* args, const char* name)
 {
     if (args==NULL)
 	return NULL;
-    
-    const char* str = NULL;
-    if (hash_retrieve(&(args->hashtable), (char*)name, (void**)&str))
-	return str;
-    
-    return NULL;
+
+    MVFS_ARG* ent = _find(args, name);
+    return (ent ? ent->value : NULL);
 }
 
 int mvfs_args_set(MVFS_ARGS* args, const char* name, const char* value)
@@ -56,14 +152,15 @@ int mvfs_args_set(MVFS_ARGS* args, const char* name, const char* value)
     if (args == NULL)
 	return -1;
 
-    hash_delete(&(args->hashtable), (char*)name);
     if (value==NULL)
+    {
+	MVFS_ARG* ent = _find(args, name);
+	if (ent)
+	    _drop(args, ent);
 	return 0;
-	
-    if (!hash_insert(&(args->hashtable), strdup(name), strdup(value)))
-	ERRMSG("failed for key %s", name);
+    }
 
-    return 1;
+    return _put(args, name, strdup(value));
 }
 
 int mvfs_args_setn(MVFS_ARGS* args, const char* name, const char* value, int sz)
@@ -71,14 +168,15 @@ int mvfs_args_setn(MVFS_ARGS* args, const char* name, const char* value, int sz)
     if (args == NULL)
 	return -1;
 
-    hash_delete(&(args->hashtable), (char*)name);
     if (value==NULL)
+    {
+	MVFS_ARG* ent = _find(args, name);
+	if (ent)
+	    _drop(args, ent);
 	return 0;
-	
-    if (!hash_insert(&(args->hashtable), strdup(name), strndup(value,sz)))
-	ERRMSG("failed for key %s", name);
+    }
 
-    return 1;
+    return _put(args, name, strndup(value,sz));
 }
 
 int mvfs_args_free(MVFS_ARGS* args)
@@ -86,7 +184,11 @@ int mvfs_args_free(MVFS_ARGS* args)
     if (args==NULL)
 	return -EFAULT;
 
-    hash_deinitialise(&(args->hashtable));
+    while (args->count)
+	_drop(args, &args->entries[0]);
+    if (args->entries != args->inline_entries)
+	free(args->entries);
+    free(args);
     return 0;
 }
 
@@ -97,7 +199,13 @@ MVFS_ARGS* mvfs_args_from_url(const char* url)
 
     MVFS_URL* u = mvfs_url_parse(url);
     MVFS_ARGS* args = mvfs_args_alloc();
-    
+    if ((u == NULL) || (args == NULL))
+    {
+	free(u);
+	mvfs_args_free(args);
+	return NULL;
+    }
+
     mvfs_args_set(args,"url",      url);
     mvfs_args_set(args,"path",     u->pathname);
     mvfs_args_set(args,"host",     u->hostname);
@@ -110,5 +218,6 @@ MVFS_ARGS* mvfs_args_from_url(const char* url)
     else
 	mvfs_args_set(args,"type", u->type);
 
+    free(u);
     return args;
 }
@@ -17,6 +17,9 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
 #include <mvfs/mvfs.h>
 #include <mvfs/autoconnect_ops.h>
 #include <mvfs/_utils.h>
@@ -83,6 +86,7 @@ static MVFS_FILE*   _autoconnectfs_fsop_open     (MVFS_FILESYSTEM* fs, const cha
 static int          _autoconnectfs_fsop_unlink   (MVFS_FILESYSTEM* fs, const char* name);
 static int          _autoconnectfs_fsop_chmod    (MVFS_FILESYSTEM* fs, const char* name, mode_t mode);
 static MVFS_SYMLINK _autoconnectfs_fsop_readlink (MVFS_FILESYSTEM* fs, const char* name);
+static int          _autoconnectfs_fsop_free     (MVFS_FILESYSTEM* fs);
 
 static MVFS_FILESYSTEM_OPS _fsops = 
 {
@@ -90,34 +94,146 @@ static MVFS_FILESYSTEM_OPS _fsops =
     .unlink	= _autoconnectfs_fsop_unlink,
     .stat	= _autoconnectfs_fsop_stat,
     .chmod      = _autoconnectfs_fsop_chmod,
-    .readlink   = _autoconnectfs_fsop_readlink
+    .readlink   = _autoconnectfs_fsop_readlink,
+    .free	= _autoconnectfs_fsop_free
 };
 
 typedef struct _FSENT		FSENT;
 typedef struct _LOOKUP		LOOKUP;
 
-// should use an hashtable
+/*
+   Connection registry: an hash table keyed by the normalized
+   "type://host:port/" string, protected by an rwlock so lookups
+   of already known connections can run in parallel. Connecting
+   happens outside of the lock.
+
+   Each entry counts the operations currently using it, so idle
+   connections (no operations and no open files) can be evicted
+   safely via mvfs_autoconnectfs_evict().
+
+   In front of it sits an small direct mapped cache from the raw URL
+   prefix (everything before the path) to the registry entry, so
+   repeated lookups neither parse the URL nor build an args table.
+*/
 struct _FSENT
 {
     MVFS_FILESYSTEM* fs;
     char*            url;
+    unsigned         hash;
+    int              refcount;		// lookups in flight
+    time_t           lastused;
     FSENT*           next;
 };
 
+#define ACFS_RCACHE_SIZE	64		// must be an power of 2
+#define ACFS_RCACHE_PREFIX	128
+
+typedef struct
+{
+    char             prefix[ACFS_RCACHE_PREFIX];
+    unsigned         hash;
+    FSENT*           ent;
+} RCACHE_SLOT;
+
 typedef struct
 {
-    FSENT* filesystems;
+    pthread_rwlock_t lock;
+    FSENT**          buckets;
+    unsigned         nbuckets;		// always an power of 2
+    unsigned         count;
+    RCACHE_SLOT      rcache[ACFS_RCACHE_SIZE];
 } ACFS_FS_PRIV;
 
 struct _LOOKUP
 {
     MVFS_FILESYSTEM* fs;
     char*            filename;
+    FSENT*           ent;
 };
 
-static LOOKUP _lookup_fs(ACFS_FS_PRIV* priv, const char* file)
+#define ACFS_INITIAL_BUCKETS	64
+
+// FNV-1a
+static unsigned _hash_mem(const char* ptr, size_t len)
+{
+    unsigned h = 2166136261U;
+    for (; len; len--, ptr++)
+	h = (h ^ (unsigned char)*ptr) * 16777619U;
+    return h;
+}
+
+static inline unsigned _hash_url(const char* url)
+{
+    return _hash_mem(url, strlen(url));
+}
+
+// called with at least the read lock held
+static FSENT* _registry_find(ACFS_FS_PRIV* priv, const char* url, unsigned hash)
+{
+    FSENT* p;
+    for (p=priv->buckets[hash & (priv->nbuckets-1)]; p; p=p->next)
+	if ((p->hash == hash) && (!strcmp(p->url,url)))
+	    return p;
+    return NULL;
+}
+
+// called with the write lock held
+static void _registry_grow(ACFS_FS_PRIV* priv)
+{
+    unsigned nbuckets = priv->nbuckets*2;
+    FSENT** buckets = calloc(nbuckets, sizeof(FSENT*));
+    if (buckets == NULL)
+	return;
+
+    unsigned x;
+    for (x=0; x<priv->nbuckets; x++)
+    {
+	FSENT* p = priv->buckets[x];
+	while (p)
+	{
+	    FSENT* next = p->next;
+	    p->next = buckets[p->hash & (nbuckets-1)];
+	    buckets[p->hash & (nbuckets-1)] = p;
+	    p = next;
+	}
+    }
+
+    free(priv->buckets);
+    priv->buckets  = buckets;
+    priv->nbuckets = nbuckets;
+}
+
+static inline void _registry_use(FSENT* ent)
+{
+    __sync_fetch_and_add(&ent->refcount, 1);
+    __atomic_store_n(&ent->lastused, time(NULL), __ATOMIC_RELAXED);
+}
+
+static void _release_fs(LOOKUP lu)
+{
+    if (lu.ent)
+	__sync_fetch_and_sub(&lu.ent->refcount, 1);
+    free(lu.filename);
+}
+
+// build the registry key - type and host are case insensitive
+static void _make_key(char* buffer, size_t size, const char* type, const char* host, const char* port)
 {
-    LOOKUP ret = { .fs = NULL, .filename = NULL };
+    if ((port) && strlen(port))
+	snprintf(buffer, size, "%s://%s:%s/", type, host, port);
+    else
+	snprintf(buffer, size, "%s://%s/", type, host);
+
+    char* p;
+    for (p=buffer; *p && (*p != ':' || p[1] != '/'); p++)
+	*p = tolower(*p);
+    for (p+=3; *p && (*p != ':') && (*p != '/'); p++)
+	*p = tolower(*p);
+}
+
+static LOOKUP _resolve_url(ACFS_FS_PRIV* priv, const char* file)
+{
+    LOOKUP ret = { .fs = NULL, .filename = NULL, .ent = NULL };
     MVFS_ARGS* args = mvfs_args_from_url(file);
 
     const char* type = mvfs_args_get(args,"type");
@@ -129,26 +245,26 @@ static LOOKUP _lookup_fs(ACFS_FS_PRIV* priv, const char* file)
     if (!host)  host = "";
     if (!type)  type = "file";
 
+    // path points into args, which get modified below
+    char* filename = strdup(path);
+
     char buffer[8194];
-    if ((port) && strlen(port))
-	sprintf(buffer,"%s://%s:%s/", type, host, port);
-    else
-	sprintf(buffer,"%s://%s/", type, host);
+    _make_key(buffer, sizeof(buffer), type, host, port);
+    unsigned hash = _hash_url(buffer);
 
     // FIXME: the whole of this could reside in an URI->Plan9 fs layer, which does the connection handling automatically
     DEBUGMSG("looking for fs for: \"%s\" (key: %s)", file, buffer);
 
-    // now try to find a matching fs -- fixme !!!!
-    FSENT* p;
-    for (p=priv->filesystems; p; p=p->next)
+    pthread_rwlock_rdlock(&priv->lock);
+    FSENT* ent = _registry_find(priv, buffer, hash);
+    if (ent)
+	_registry_use(ent);
+    pthread_rwlock_unlock(&priv->lock);
+
+    if (ent)
     {
-	if (!strcmp(p->url,buffer))
-	{
-	    DEBUGMSG("found an existing connection for: %s (%s", file, buffer);
-	    ret.fs       = p->fs;
-	    ret.filename = strdup(path);
-	    goto out;
-	}
+	DEBUGMSG("found an existing connection for: %s (%s)", file, buffer);
+	goto found;
     }
 
     DEBUGMSG("Dont have an connection for %s (%s) yet - trying to connect ...", file, buffer);
@@ -159,27 +275,108 @@ static LOOKUP _lookup_fs(ACFS_FS_PRIV* priv, const char* file)
     if (fs == NULL)
     {
 	ERRMSG("Couldnt connect to service: %s", buffer);
-	goto err;
+	free(filename);
+	goto out;
     }
 
-    FSENT* newfs = calloc(1,sizeof(FSENT));
-    newfs->fs   = fs;
-    newfs->url  = strdup(buffer);
-    newfs->next = priv->filesystems;
-    priv->filesystems = newfs;
+    pthread_rwlock_wrlock(&priv->lock);
 
-    DEBUGMSG("Now opening file: %s via fs", file);
+    // somebody else might have connected meanwhile - use that one
+    if ((ent = _registry_find(priv, buffer, hash)))
+    {
+	_registry_use(ent);
+	pthread_rwlock_unlock(&priv->lock);
+	mvfs_fs_unref(fs);
+	goto found;
+    }
+
+    ent = calloc(1,sizeof(FSENT));
+    ent->fs       = fs;
+    ent->url      = strdup(buffer);
+    ent->hash     = hash;
+    ent->refcount = 1;
+    ent->lastused = time(NULL);
+    ent->next     = priv->buckets[hash & (priv->nbuckets-1)];
+    priv->buckets[hash & (priv->nbuckets-1)] = ent;
+    if (++priv->count > priv->nbuckets*2)
+	_registry_grow(priv);
 
-    ret.fs       = fs;
-    ret.filename = strdup(path);
+    pthread_rwlock_unlock(&priv->lock);
 
-err:
+    DEBUGMSG("Now opening file: %s via fs", file);
+
+found:
+    ret.fs       = ent->fs;
+    ret.filename = filename;
+    ret.ent      = ent;
 
 out:
     mvfs_args_free(args);
     return ret;
 }
 
+/*
+   find the length of the URL prefix in front of the path, the way
+   mvfs_url_parse() would split it. returns 0 for URLs we'd rather
+   leave to the full parser (user names, odd syntax, too long).
+*/
+static int _url_prefix(const char* file, size_t* len)
+{
+    if (file[0] == '/')
+    {
+	*len = 0;		// plain local filename
+	return 1;
+    }
+
+    const char* colon = strchr(file, ':');
+    if ((colon == NULL) || (colon[1] != '/') || (colon[2] != '/'))
+	return 0;
+    if (strchr(file, '@'))
+	return 0;
+
+    const char* slash = strchr(colon+3, '/');
+    *len = (slash ? (size_t)(slash-file) : strlen(file));
+    return (*len < ACFS_RCACHE_PREFIX);
+}
+
+static LOOKUP _lookup_fs(ACFS_FS_PRIV* priv, const char* file)
+{
+    size_t plen;
+    if (!_url_prefix(file, &plen))
+	return _resolve_url(priv, file);
+
+    unsigned hash = _hash_mem(file, plen);
+    RCACHE_SLOT* slot = &priv->rcache[hash & (ACFS_RCACHE_SIZE-1)];
+    FSENT* ent = NULL;
+
+    pthread_rwlock_rdlock(&priv->lock);
+    if ((slot->ent) && (slot->hash == hash) && (!memcmp(slot->prefix, file, plen)) && (!slot->prefix[plen]))
+    {
+	ent = slot->ent;
+	_registry_use(ent);
+    }
+    pthread_rwlock_unlock(&priv->lock);
+
+    if (ent)
+    {
+	LOOKUP ret = { .fs = ent->fs, .filename = strdup(file[plen] ? file+plen : "/"), .ent = ent };
+	return ret;
+    }
+
+    // the entry can't go away while we're holding an reference
+    LOOKUP ret = _resolve_url(priv, file);
+    if (ret.ent)
+    {
+	pthread_rwlock_wrlock(&priv->lock);
+	memcpy(slot->prefix, file, plen);
+	slot->prefix[plen] = 0;
+	slot->hash = hash;
+	slot->ent  = ret.ent;
+	pthread_rwlock_unlock(&priv->lock);
+    }
+    return ret;
+}
+
 static MVFS_FILE* _autoconnectfs_fsop_open(MVFS_FILESYSTEM* fs, const char* name, mode_t mode)
 {
     __FSOPS_HEAD(NULL);
@@ -191,7 +388,7 @@ static MVFS_FILE* _autoconnectfs_fsop_open(MVFS_FILESYSTEM* fs, const char* name
     }
 
     MVFS_FILE* f = mvfs_fs_openfile(lu.fs, lu.filename, mode);
-    free(lu.filename);
+    _release_fs(lu);
     return f;
 }
 
@@ -206,7 +403,7 @@ static MVFS_STAT* _autoconnectfs_fsop_stat(MVFS_FILESYSTEM* fs, const char* name
     }
 
     MVFS_STAT* st = mvfs_fs_statfile(lu.fs, lu.filename);
-    free(lu.filename);
+    _release_fs(lu);
     return st;
 }
 
@@ -221,7 +418,7 @@ static int _autoconnectfs_fsop_unlink(MVFS_FILESYSTEM* fs, const char* name)
     }
 
     int ret = mvfs_fs_unlink(lu.fs, lu.filename);
-    free(lu.filename);
+    _release_fs(lu);
     return ret;
 }
 
@@ -236,7 +433,7 @@ static int _autoconnectfs_fsop_chmod(MVFS_FILESYSTEM* fs, const char* name, mode
     }
 
     int ret = mvfs_fs_chmod(lu.fs, lu.filename, mode);
-    free(lu.filename);
+    _release_fs(lu);
     return ret;
 }
 
@@ -251,7 +448,7 @@ static MVFS_SYMLINK _autoconnectfs_fsop_readlink(MVFS_FILESYSTEM* fs, const char
     }
 
     MVFS_SYMLINK ret = mvfs_fs_readlink(lu.fs, lu.filename);
-    free(lu.filename);
+    _release_fs(lu);
     return ret;
 }
 
@@ -259,26 +456,104 @@ MVFS_FILESYSTEM* mvfs_autoconnectfs_create()
 {
     MVFS_FILESYSTEM* fs = mvfs_fs_alloc(_fsops,FS_MAGIC);
     ACFS_FS_PRIV* priv = (ACFS_FS_PRIV*)calloc(1,sizeof(ACFS_FS_PRIV));
+    pthread_rwlock_init(&priv->lock, NULL);
+    priv->nbuckets = ACFS_INITIAL_BUCKETS;
+    priv->buckets  = calloc(priv->nbuckets, sizeof(FSENT*));
     fs->priv.ptr = priv;
     return fs;
 }
 
+static void _free_ent(FSENT* ent)
+{
+    mvfs_fs_unref(ent->fs);
+    free(ent->url);
+    free(ent);
+}
+
+static int _autoconnectfs_fsop_free(MVFS_FILESYSTEM* fs)
+{
+    __FSOPS_HEAD(-EFAULT);
+
+    unsigned x;
+    for (x=0; x<fspriv->nbuckets; x++)
+    {
+	FSENT* p = fspriv->buckets[x];
+	while (p)
+	{
+	    FSENT* next = p->next;
+	    _free_ent(p);
+	    p = next;
+	}
+    }
+
+    pthread_rwlock_destroy(&fspriv->lock);
+    free(fspriv->buckets);
+    free(fspriv);
+    fs->priv.ptr = NULL;
+    return 0;
+}
+
+int mvfs_autoconnectfs_evict(MVFS_FILESYSTEM* fs, int max_idle)
+{
+    __FSOPS_HEAD(-EFAULT);
+
+    time_t limit = time(NULL) - max_idle;
+    int evicted = 0;
+    unsigned x;
+
+    // under the write lock nobody can pick up an entry, so an unused
+    // entry whose fs isn't referenced by any open file is really idle
+    pthread_rwlock_wrlock(&fspriv->lock);
+    for (x=0; x<fspriv->nbuckets; x++)
+    {
+	FSENT** pp = &fspriv->buckets[x];
+	while (*pp)
+	{
+	    FSENT* p = *pp;
+	    if ((__atomic_load_n(&p->refcount, __ATOMIC_RELAXED) == 0) &&
+		(__atomic_load_n(&p->fs->refcount, __ATOMIC_RELAXED) == 1) &&
+		(__atomic_load_n(&p->lastused, __ATOMIC_RELAXED) <= limit))
+	    {
+		DEBUGMSG("evicting idle connection: %s", p->url);
+		unsigned y;
+		for (y=0; y<ACFS_RCACHE_SIZE; y++)
+		    if (fspriv->rcache[y].ent == p)
+			fspriv->rcache[y].ent = NULL;
+		*pp = p->next;
+		_free_ent(p);
+		fspriv->count--;
+		evicted++;
+	    }
+	    else
+		pp = &p->next;
+	}
+    }
+    pthread_rwlock_unlock(&fspriv->lock);
+
+    return evicted;
+}
+
 char* mvfs_autoconnectfs_getconnections(MVFS_FILESYSTEM* fs)
 {
     __FSOPS_HEAD(NULL);
-    FSENT* ent = fspriv->filesystems;
-    int sz = 0;
-    
-    for (ent=fspriv->filesystems; ent; ent=ent->next)
-	sz += strlen(ent->url)+4;
-    
+    FSENT* ent;
+    int sz = 1;
+    unsigned x;
+
+    pthread_rwlock_rdlock(&fspriv->lock);
+
+    for (x=0; x<fspriv->nbuckets; x++)
+	for (ent=fspriv->buckets[x]; ent; ent=ent->next)
+	    sz += strlen(ent->url)+1;
+
     char* buffer = malloc(sz);
-    buffer[0] = 0;
-    
-    for (ent=fspriv->filesystems; ent; ent=ent->next)
-    {
-	strcat(buffer,ent->url);
-	strcat(buffer,"\n");
-    }
+    char* p = buffer;
+
+    for (x=0; x<fspriv->nbuckets; x++)
+	for (ent=fspriv->buckets[x]; ent; ent=ent->next)
+	    p += sprintf(p, "%s\n", ent->url);
+    *p = 0;
+
+    pthread_rwlock_unlock(&fspriv->lock);
     return buffer;
 }
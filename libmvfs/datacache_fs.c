@@ -0,0 +1,1180 @@
+/*
+    libmvfs - metux Virtual Filesystem Library
+
+    Filesystem driver: data-caching fs
+
+    File contents are cached in fixed size blocks, keyed by the file's
+    cache generation and the block index. An generation stands for one
+    known version of an file: on open it's checked against the mtime
+    and size from an fresh stat (close-to-open consistency), and every
+    write through this fs replaces it. Stale blocks so just aren't found
+    anymore and age out of the LRU. (Like NFS, changes by others which
+    keep both the size and the mtime's second aren't noticed.)
+
+    The cache is bounded by an memory budget, spread over several shards
+    by block index, each with its own rwlock. Least recently used blocks
+    are evicted first (CLOCK style, like metacache_fs).
+
+    Optionally blocks are also kept in an cache directory (see diskcache.c),
+    so they survive restarts. An file version's blocks there are found by
+    its path, mtime and size - the same revalidation on open applies.
+    Memory misses are looked up there before going to the backend.
+
+    Directories and other non-regular files are passed through.
+
+    Copyright (C) 2008 Enrico Weigelt, metux IT service <weigelt@metux.de>
+    This code is published under the terms of the GNU Public License 2.0
+*/
+
+#include "mvfs-internal.h"
+
+#define _LARGEFILE64_SOURCE
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <malloc.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include <mvfs/mvfs.h>
+#include <mvfs/stat.h>
+#include <mvfs/default_ops.h>
+#include <mvfs/datacache_ops.h>
+#include <mvfs/_utils.h>
+
+#include "diskcache.h"
+
+#define	FS_MAGIC	"metux/datacache-fs-1"
+
+static off64_t    _mvfs_datacache_fileopseek   (MVFS_FILE* file, off64_t offset, int whence);
+static ssize_t    _mvfs_datacache_fileoppread  (MVFS_FILE* file, void* buf, size_t count, off64_t offset);
+static ssize_t    _mvfs_datacache_fileoppwrite (MVFS_FILE* file, const void* buf, size_t count, off64_t offset);
+static ssize_t    _mvfs_datacache_fileopread   (MVFS_FILE* file, void* buf, size_t count);
+static ssize_t    _mvfs_datacache_fileopwrite  (MVFS_FILE* file, const void* buf, size_t count);
+static ssize_t    _mvfs_datacache_fileopwritev (MVFS_FILE* file, const struct iovec* iov, int iovcnt);
+static ssize_t    _mvfs_datacache_fileoppwritev(MVFS_FILE* file, const struct iovec* iov, int iovcnt, off64_t offset);
+static int        _mvfs_datacache_fileopsetflag(MVFS_FILE* file, MVFS_FILE_FLAG flag, long value);
+static int        _mvfs_datacache_fileopgetflag(MVFS_FILE* file, MVFS_FILE_FLAG flag, long* value);
+static int        _mvfs_datacache_fileopclose  (MVFS_FILE* file);
+static int        _mvfs_datacache_fileopfree   (MVFS_FILE* file);
+static int        _mvfs_datacache_fileopeof    (MVFS_FILE* file);
+static MVFS_STAT* _mvfs_datacache_fileopstat   (MVFS_FILE* file);
+static MVFS_FILE* _mvfs_datacache_fileoplookup (MVFS_FILE* file, const char* name);
+static MVFS_STAT* _mvfs_datacache_fileopscan   (MVFS_FILE* file);
+static int        _mvfs_datacache_fileopreset  (MVFS_FILE* file);
+static ssize_t    _mvfs_datacache_fileopscanbatch(MVFS_FILE* file, MVFS_STAT** stats, size_t max);
+
+// readv, preadv, read_into and mmap fall back to the defaults,
+// which go through our read/pread - and so through the cache
+static MVFS_FILE_OPS _fileops =
+{
+    .seek	= _mvfs_datacache_fileopseek,
+    .read       = _mvfs_datacache_fileopread,
+    .write      = _mvfs_datacache_fileopwrite,
+    .pread	= _mvfs_datacache_fileoppread,
+    .pwrite	= _mvfs_datacache_fileoppwrite,
+    .writev	= _mvfs_datacache_fileopwritev,
+    .pwritev	= _mvfs_datacache_fileoppwritev,
+    .setflag	= _mvfs_datacache_fileopsetflag,
+    .getflag	= _mvfs_datacache_fileopgetflag,
+    .close	= _mvfs_datacache_fileopclose,
+    .free	= _mvfs_datacache_fileopfree,
+    .eof        = _mvfs_datacache_fileopeof,
+    .lookup     = _mvfs_datacache_fileoplookup,
+    .scan       = _mvfs_datacache_fileopscan,
+    .reset      = _mvfs_datacache_fileopreset,
+    .scan_batch = _mvfs_datacache_fileopscanbatch,
+    .stat       = _mvfs_datacache_fileopstat
+};
+
+static MVFS_STAT*   _mvfs_datacache_fsop_stat     (MVFS_FILESYSTEM* fs, const char* name);
+static MVFS_FILE*   _mvfs_datacache_fsop_open     (MVFS_FILESYSTEM* fs, const char* name, mode_t mode);
+static int          _mvfs_datacache_fsop_unlink   (MVFS_FILESYSTEM* fs, const char* name);
+static int          _mvfs_datacache_fsop_chmod    (MVFS_FILESYSTEM* fs, const char* name, mode_t mode);
+static int          _mvfs_datacache_fsop_chown    (MVFS_FILESYSTEM* fs, const char* name, const char* uid, const char* gid);
+static int          _mvfs_datacache_fsop_mkdir    (MVFS_FILESYSTEM* fs, const char* name, mode_t mode);
+static MVFS_SYMLINK _mvfs_datacache_fsop_readlink (MVFS_FILESYSTEM* fs, const char* name);
+static int          _mvfs_datacache_fsop_symlink  (MVFS_FILESYSTEM* fs, const char* n1, const char* n2);
+static int          _mvfs_datacache_fsop_rename   (MVFS_FILESYSTEM* fs, const char* n1, const char* n2);
+static int          _mvfs_datacache_fsop_free     (MVFS_FILESYSTEM* fs);
+
+static MVFS_FILESYSTEM_OPS _fsops =
+{
+    .openfile	= _mvfs_datacache_fsop_open,
+    .unlink	= _mvfs_datacache_fsop_unlink,
+    .stat       = _mvfs_datacache_fsop_stat,
+    .chmod      = _mvfs_datacache_fsop_chmod,
+    .chown      = _mvfs_datacache_fsop_chown,
+    .mkdir      = _mvfs_datacache_fsop_mkdir,
+    .readlink   = _mvfs_datacache_fsop_readlink,
+    .symlink    = _mvfs_datacache_fsop_symlink,
+    .rename     = _mvfs_datacache_fsop_rename,
+    .free       = _mvfs_datacache_fsop_free
+};
+
+// default budget: 64MB in 64k blocks
+#define CACHE_CAPACITY		(64*1024*1024)
+#define CACHE_BLOCKSIZE		65536
+#define CACHE_SHARDS		16	// must be an power of 2
+#define CACHE_INITIAL_BUCKETS	64
+#define CACHE_MAX_NODES		4096
+#define CACHE_NODE_BUCKETS	1024	// must be an power of 2
+#define CACHE_DIR_MAX		(1024*1024*1024)
+
+typedef struct __datacache_block DATACACHE_BLOCK;
+
+struct __datacache_block
+{
+    uint64_t         gen;
+    uint64_t         index;
+    unsigned         hash;
+    size_t           len;		// valid bytes - less than an full block at EOF
+    int              referenced;	// hit since last seen by the evictor
+    DATACACHE_BLOCK* next;		// hash chain
+    DATACACHE_BLOCK* newer;		// LRU list
+    DATACACHE_BLOCK* older;
+    char             data[];
+};
+
+typedef struct
+{
+    pthread_rwlock_t     lock;
+    DATACACHE_BLOCK**    buckets;
+    unsigned             nbuckets;	// always an power of 2
+    DATACACHE_BLOCK*     newest;
+    DATACACHE_BLOCK*     oldest;
+    size_t               bytes;
+    MVFS_DATACACHE_STATS stats;		// counters, updated atomically
+} DATACACHE_SHARD;
+
+typedef struct __datacache_node DATACACHE_NODE;
+
+// an file we've seen - its current generation tags its cached blocks
+struct __datacache_node
+{
+    uint64_t        gen;
+    uint64_t        disk;		// version's id in the disk cache - 0 if none
+    time_t          mtime;		// version the generation stands for
+    long            size;
+    int             refs;		// open files
+    unsigned        hash;
+    DATACACHE_NODE* next;		// hash chain
+    DATACACHE_NODE* newer;		// LRU list
+    DATACACHE_NODE* older;
+    char            path[];
+};
+
+typedef struct
+{
+    MVFS_FILE*      cfid;
+    DATACACHE_NODE* node;		// NULL if not cached (eg. directories)
+    char*           pathname;
+    mode_t          mode;
+    off64_t         pos;		// we don't move the backend file's position
+    int             eof;
+} DATACACHE_FILE_PRIV;
+
+typedef struct
+{
+    MVFS_FILESYSTEM*	fs;
+    MVFS_DISKCACHE*	disk;		// NULL if memory only
+    DATACACHE_SHARD	shards[CACHE_SHARDS];
+    size_t		blocksize;
+    size_t		max_bytes;	// per shard
+    pthread_mutex_t	nodes_lock;	// protects the nodes and the generation counter
+    DATACACHE_NODE*	nodes[CACHE_NODE_BUCKETS];
+    DATACACHE_NODE*	newest_node;
+    DATACACHE_NODE*	oldest_node;
+    unsigned long	nnodes;
+    uint64_t		generation;	// last generation handed out
+    unsigned long	invalidations;
+} DATACACHE_FS_PRIV;
+
+#ifdef _MVFS_SANITY_CHECKS
+
+#define __FILEOPS_HEAD(err);					\
+	if (file==NULL)						\
+	{							\
+	    ERRMSG("NULL file handle");				\
+	    return err;						\
+	}							\
+	DATACACHE_FILE_PRIV* priv __attribute__((unused)) = (file->priv.ptr);	\
+	if (priv == NULL)					\
+	{							\
+	    ERRMSG("corrupt file handle");			\
+	    return err;						\
+	}							\
+	if (file->fs==NULL)					\
+	{							\
+	    ERRMSG("NULL file handle");				\
+	    return err;						\
+	}							\
+	DATACACHE_FS_PRIV* fspriv __attribute__((unused)) = (file->fs->priv.ptr); \
+	if (fspriv == NULL)					\
+	{							\
+	    ERRMSG("corrupt fs handle");			\
+	    return err;						\
+	}
+
+#define __FSOPS_HEAD(err);					\
+	if (fs==NULL)						\
+	{							\
+	    ERRMSG("NULL fs handle");				\
+	    return err;						\
+	}							\
+	DATACACHE_FS_PRIV* fspriv __attribute__((unused)) = (fs->priv.ptr); \
+	if (fspriv == NULL)					\
+	{							\
+	    ERRMSG("corrupt fspriv");				\
+	    return err;						\
+	}							\
+	if (fspriv->fs == NULL)					\
+	{							\
+	    ERRMSG("missing backend fs");			\
+	    return err;						\
+	}
+
+#else
+
+#define __FILEOPS_HEAD(err);					\
+	DATACACHE_FILE_PRIV* priv __attribute__((unused)) = (file->priv.ptr);	\
+	DATACACHE_FS_PRIV* fspriv __attribute__((unused)) = (file->fs->priv.ptr); \
+
+#define __FSOPS_HEAD(err);					\
+	DATACACHE_FS_PRIV* fspriv __attribute__((unused)) = (fs->priv.ptr); \
+
+#endif
+
+#define STAT_INC(shard,counter)	__sync_fetch_and_add(&((shard)->stats.counter), 1)
+
+// FNV-1a, like metacache_fs
+static unsigned _hash_name(const char* name)
+{
+    unsigned h = 2166136261u;
+    while (*name)
+	h = (h ^ (unsigned char)*name++) * 16777619u;
+    return h;
+}
+
+static inline unsigned _hash_block(uint64_t gen, uint64_t index)
+{
+    uint64_t h = (gen * 0x9e3779b97f4a7c15ull) ^ ((index+1) * 0xc2b2ae3d27d4eb4full);
+    return (unsigned)(h ^ (h >> 32));
+}
+
+// consecutive blocks of an file go to consecutive shards, so they
+// never compete for the same shard's budget
+static inline DATACACHE_SHARD* _shard(DATACACHE_FS_PRIV* fspriv, uint64_t gen, uint64_t index)
+{
+    return &fspriv->shards[((gen * 0x9e3779b97f4a7c15ull >> 56) + index) & (CACHE_SHARDS-1)];
+}
+
+static inline size_t _block_size(DATACACHE_BLOCK* blk)
+{
+    return sizeof(DATACACHE_BLOCK)+blk->len;
+}
+
+static void _lru_unlink(DATACACHE_SHARD* shard, DATACACHE_BLOCK* blk)
+{
+    if (blk->newer)
+	blk->newer->older = blk->older;
+    else
+	shard->newest = blk->older;
+    if (blk->older)
+	blk->older->newer = blk->newer;
+    else
+	shard->oldest = blk->newer;
+    blk->newer = blk->older = NULL;
+}
+
+static void _lru_push(DATACACHE_SHARD* shard, DATACACHE_BLOCK* blk)
+{
+    blk->older = shard->newest;
+    blk->newer = NULL;
+    if (shard->newest)
+	shard->newest->newer = blk;
+    else
+	shard->oldest = blk;
+    shard->newest = blk;
+}
+
+static void _shard_grow(DATACACHE_SHARD* shard)
+{
+    unsigned nbuckets = shard->nbuckets*2;
+    DATACACHE_BLOCK** buckets = calloc(nbuckets, sizeof(DATACACHE_BLOCK*));
+    if (buckets == NULL)
+	return;
+
+    unsigned x;
+    for (x=0; x<shard->nbuckets; x++)
+    {
+	DATACACHE_BLOCK* blk = shard->buckets[x];
+	while (blk)
+	{
+	    DATACACHE_BLOCK* next = blk->next;
+	    blk->next = buckets[blk->hash & (nbuckets-1)];
+	    buckets[blk->hash & (nbuckets-1)] = blk;
+	    blk = next;
+	}
+    }
+
+    free(shard->buckets);
+    shard->buckets  = buckets;
+    shard->nbuckets = nbuckets;
+}
+
+static DATACACHE_BLOCK* _shard_find(DATACACHE_SHARD* shard, uint64_t gen, uint64_t index, unsigned hash)
+{
+    DATACACHE_BLOCK* blk;
+    for (blk=shard->buckets[hash & (shard->nbuckets-1)]; blk; blk=blk->next)
+	if ((blk->hash == hash) && (blk->gen == gen) && (blk->index == index))
+	    return blk;
+    return NULL;
+}
+
+static void _shard_drop(DATACACHE_SHARD* shard, DATACACHE_BLOCK* blk)
+{
+    DATACACHE_BLOCK** p;
+    for (p=&shard->buckets[blk->hash & (shard->nbuckets-1)]; *p; p=&(*p)->next)
+    {
+	if (*p == blk)
+	{
+	    *p = blk->next;
+	    break;
+	}
+    }
+    _lru_unlink(shard, blk);
+    shard->stats.blocks--;
+    shard->bytes -= _block_size(blk);
+    free(blk);
+}
+
+// evict blocks until we're within the budget again - called with write lock
+static void _shard_trim(DATACACHE_FS_PRIV* fspriv, DATACACHE_SHARD* shard)
+{
+    while ((shard->oldest) && (shard->bytes > fspriv->max_bytes))
+    {
+	DATACACHE_BLOCK* blk = shard->oldest;
+	if (blk->referenced)
+	{
+	    blk->referenced = 0;
+	    _lru_unlink(shard, blk);
+	    _lru_push(shard, blk);
+	    continue;
+	}
+	_shard_drop(shard, blk);
+	STAT_INC(shard, evictions);
+    }
+}
+
+/*
+   copy up to count bytes at offset off within an cached block. returns
+   the number of bytes copied (0 if off is behind the file's end) or -1
+   if the block isn't cached.
+*/
+static ssize_t _block_read(DATACACHE_FS_PRIV* fspriv, uint64_t gen, uint64_t index, void* buf, size_t off, size_t count)
+{
+    unsigned hash = _hash_block(gen, index);
+    DATACACHE_SHARD* shard = _shard(fspriv, gen, index);
+
+    pthread_rwlock_rdlock(&shard->lock);
+    DATACACHE_BLOCK* blk = _shard_find(shard, gen, index, hash);
+    if (blk == NULL)
+    {
+	pthread_rwlock_unlock(&shard->lock);
+	return -1;
+    }
+
+    size_t n = ((off < blk->len) ? blk->len - off : 0);
+    if (n > count)
+	n = count;
+    memcpy(buf, blk->data+off, n);
+
+    // avoid dirtying the cacheline if already marked
+    if (!__atomic_load_n(&blk->referenced, __ATOMIC_RELAXED))
+	__atomic_store_n(&blk->referenced, 1, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&shard->lock);
+
+    STAT_INC(shard, hits);
+    return n;
+}
+
+static inline void _block_init(DATACACHE_BLOCK* blk, uint64_t gen, uint64_t index)
+{
+    blk->gen        = gen;
+    blk->index      = index;
+    blk->hash       = _hash_block(gen, index);
+    blk->referenced = 0;
+    blk->next       = blk->newer = blk->older = NULL;
+}
+
+// don't waste the budget on the tail block
+static DATACACHE_BLOCK* _block_shrink(DATACACHE_FS_PRIV* fspriv, DATACACHE_BLOCK* blk)
+{
+    if (blk->len < fspriv->blocksize)
+    {
+	DATACACHE_BLOCK* shrunk = realloc(blk, sizeof(DATACACHE_BLOCK)+blk->len);
+	if (shrunk)
+	    return shrunk;
+    }
+    return blk;
+}
+
+// load an block from the disk cache - NULL if it's not there
+static DATACACHE_BLOCK* _block_load(DATACACHE_FS_PRIV* fspriv, uint64_t disk, uint64_t gen, uint64_t index)
+{
+    if ((fspriv->disk == NULL) || (disk == 0))
+	return NULL;
+
+    DATACACHE_BLOCK* blk = malloc(sizeof(DATACACHE_BLOCK)+fspriv->blocksize);
+    if (blk == NULL)
+	return NULL;
+
+    ssize_t len = mvfs_diskcache_read(fspriv->disk, disk, index, blk->data);
+    if (len < 0)
+    {
+	free(blk);
+	return NULL;
+    }
+
+    blk->len = len;
+    blk = _block_shrink(fspriv, blk);
+    _block_init(blk, gen, index);
+
+    STAT_INC(_shard(fspriv, gen, index), disk_hits);
+    return blk;
+}
+
+// read an whole block from the backend - less than an block only at EOF
+static DATACACHE_BLOCK* _block_fetch(DATACACHE_FS_PRIV* fspriv, MVFS_FILE* cfid, uint64_t gen, uint64_t index, int* errcode)
+{
+    DATACACHE_BLOCK* blk = malloc(sizeof(DATACACHE_BLOCK)+fspriv->blocksize);
+    if (blk == NULL)
+    {
+	*errcode = ENOMEM;
+	return NULL;
+    }
+
+    off64_t offset = (off64_t)(index*fspriv->blocksize);
+    blk->len = 0;
+    while (blk->len < fspriv->blocksize)
+    {
+	ssize_t got = mvfs_file_pread(cfid, blk->data+blk->len, fspriv->blocksize-blk->len, offset+blk->len);
+	if (got < 0)
+	{
+	    *errcode = (cfid->errcode ? cfid->errcode : EIO);
+	    free(blk);
+	    return NULL;
+	}
+	if (got == 0)
+	    break;
+	blk->len += got;
+    }
+
+    blk = _block_shrink(fspriv, blk);
+    _block_init(blk, gen, index);
+
+    STAT_INC(_shard(fspriv, gen, index), misses);
+    return blk;
+}
+
+// add an fetched block to the cache - takes it over
+static void _block_store(DATACACHE_FS_PRIV* fspriv, DATACACHE_BLOCK* blk)
+{
+    DATACACHE_SHARD* shard = _shard(fspriv, blk->gen, blk->index);
+
+    pthread_rwlock_wrlock(&shard->lock);
+
+    // another thread fetched it meanwhile
+    if (_shard_find(shard, blk->gen, blk->index, blk->hash))
+    {
+	pthread_rwlock_unlock(&shard->lock);
+	free(blk);
+	return;
+    }
+
+    blk->next = shard->buckets[blk->hash & (shard->nbuckets-1)];
+    shard->buckets[blk->hash & (shard->nbuckets-1)] = blk;
+    _lru_push(shard, blk);
+    shard->stats.blocks++;
+    shard->bytes += _block_size(blk);
+
+    if (shard->stats.blocks > shard->nbuckets)
+	_shard_grow(shard);
+    _shard_trim(fspriv, shard);
+    pthread_rwlock_unlock(&shard->lock);
+}
+
+static inline uint64_t _node_gen(DATACACHE_NODE* node)
+{
+    return __atomic_load_n(&node->gen, __ATOMIC_ACQUIRE);
+}
+
+// hand out an fresh generation - called with nodes_lock held
+static inline void _node_renew(DATACACHE_FS_PRIV* fspriv, DATACACHE_NODE* node)
+{
+    __atomic_store_n(&node->gen, ++fspriv->generation, __ATOMIC_RELEASE);
+    fspriv->invalidations++;
+}
+
+static DATACACHE_NODE* _node_find(DATACACHE_FS_PRIV* fspriv, const char* path, unsigned hash)
+{
+    DATACACHE_NODE* node;
+    for (node=fspriv->nodes[hash & (CACHE_NODE_BUCKETS-1)]; node; node=node->next)
+	if ((node->hash == hash) && (!strcmp(node->path, path)))
+	    return node;
+    return NULL;
+}
+
+static void _node_drop(DATACACHE_FS_PRIV* fspriv, DATACACHE_NODE* node)
+{
+    DATACACHE_NODE** p;
+    for (p=&fspriv->nodes[node->hash & (CACHE_NODE_BUCKETS-1)]; *p; p=&(*p)->next)
+    {
+	if (*p == node)
+	{
+	    *p = node->next;
+	    break;
+	}
+    }
+    if (node->newer)
+	node->newer->older = node->older;
+    else
+	fspriv->newest_node = node->older;
+    if (node->older)
+	node->older->newer = node->newer;
+    else
+	fspriv->oldest_node = node->newer;
+    fspriv->nnodes--;
+    free(node);
+}
+
+static void _node_touch(DATACACHE_FS_PRIV* fspriv, DATACACHE_NODE* node)
+{
+    if (fspriv->newest_node == node)
+	return;
+
+    // unlink (if linked at all) and push as newest
+    if (node->newer)
+	node->newer->older = node->older;
+    if (node->older)
+	node->older->newer = node->newer;
+    else if (fspriv->oldest_node == node)
+	fspriv->oldest_node = node->newer;
+
+    node->older = fspriv->newest_node;
+    node->newer = NULL;
+    if (fspriv->newest_node)
+	fspriv->newest_node->newer = node;
+    else
+	fspriv->oldest_node = node;
+    fspriv->newest_node = node;
+}
+
+/*
+   get the node for an opened file, checking its generation against
+   the file's current stat. unused nodes beyond the limit are dropped -
+   their blocks can't be found anymore and just age out.
+*/
+static DATACACHE_NODE* _node_get(DATACACHE_FS_PRIV* fspriv, const char* path, MVFS_STAT* st)
+{
+    unsigned hash = _hash_name(path);
+
+    pthread_mutex_lock(&fspriv->nodes_lock);
+    DATACACHE_NODE* node = _node_find(fspriv, path, hash);
+    if (node == NULL)
+    {
+	DATACACHE_NODE* old = fspriv->oldest_node;
+	while ((old) && (fspriv->nnodes >= CACHE_MAX_NODES))
+	{
+	    DATACACHE_NODE* newer = old->newer;
+	    if (old->refs == 0)
+		_node_drop(fspriv, old);
+	    old = newer;
+	}
+
+	size_t len = strlen(path);
+	if ((node = calloc(1,sizeof(DATACACHE_NODE)+len+1)) == NULL)
+	{
+	    pthread_mutex_unlock(&fspriv->nodes_lock);
+	    ERRMSG("out of memory");
+	    return NULL;
+	}
+	memcpy(node->path, path, len+1);
+	node->hash = hash;
+	node->next = fspriv->nodes[hash & (CACHE_NODE_BUCKETS-1)];
+	fspriv->nodes[hash & (CACHE_NODE_BUCKETS-1)] = node;
+	fspriv->nnodes++;
+	__atomic_store_n(&node->disk, mvfs_diskcache_file(fspriv->disk, path, st->mtime, st->size), __ATOMIC_RELAXED);
+	__atomic_store_n(&node->gen, ++fspriv->generation, __ATOMIC_RELEASE);
+    }
+    else if ((node->mtime != st->mtime) || (node->size != st->size))
+    {
+	DEBUGMSG("%s changed - dropping cached data", path);
+	__atomic_store_n(&node->disk, mvfs_diskcache_file(fspriv->disk, path, st->mtime, st->size), __ATOMIC_RELAXED);
+	_node_renew(fspriv, node);
+    }
+
+    node->mtime = st->mtime;
+    node->size  = st->size;
+    node->refs++;
+    _node_touch(fspriv, node);
+    pthread_mutex_unlock(&fspriv->nodes_lock);
+    return node;
+}
+
+static void _node_put(DATACACHE_FS_PRIV* fspriv, DATACACHE_NODE* node)
+{
+    if (node == NULL)
+	return;
+    pthread_mutex_lock(&fspriv->nodes_lock);
+    node->refs--;
+    pthread_mutex_unlock(&fspriv->nodes_lock);
+}
+
+// drop the cached blocks - called with nodes_lock held
+static inline void _node_stale(DATACACHE_FS_PRIV* fspriv, DATACACHE_NODE* node)
+{
+    if (node->disk)
+	mvfs_diskcache_drop(fspriv->disk, node->path);
+    __atomic_store_n(&node->disk, 0, __ATOMIC_RELAXED);
+    _node_renew(fspriv, node);
+    node->mtime = 0;		// make the next open revalidate
+    node->size  = -1;
+}
+
+// the file has been written through this fs
+static void _node_written(DATACACHE_FS_PRIV* fspriv, DATACACHE_NODE* node)
+{
+    pthread_mutex_lock(&fspriv->nodes_lock);
+    _node_stale(fspriv, node);
+    pthread_mutex_unlock(&fspriv->nodes_lock);
+}
+
+// the path has been removed or replaced
+static void _node_invalidate(DATACACHE_FS_PRIV* fspriv, const char* path)
+{
+    pthread_mutex_lock(&fspriv->nodes_lock);
+    DATACACHE_NODE* node = _node_find(fspriv, path, _hash_name(path));
+    if (node)
+    {
+	if (node->refs)
+	    _node_stale(fspriv, node);
+	else
+	    _node_drop(fspriv, node);
+    }
+    mvfs_diskcache_drop(fspriv->disk, path);
+    pthread_mutex_unlock(&fspriv->nodes_lock);
+}
+
+// read through the cache - sets file->errcode
+static ssize_t _cached_pread(MVFS_FILE* file, void* buf, size_t count, off64_t offset)
+{
+    DATACACHE_FILE_PRIV* priv = (file->priv.ptr);
+    DATACACHE_FS_PRIV* fspriv = (file->fs->priv.ptr);
+    uint64_t gen = _node_gen(priv->node);
+    // loaded after the generation: an renewed one comes with its disk id
+    uint64_t disk = __atomic_load_n(&priv->node->disk, __ATOMIC_RELAXED);
+    size_t bs = fspriv->blocksize;
+    size_t done = 0;
+
+    if (offset < 0)
+    {
+	file->errcode = EINVAL;
+	return -1;
+    }
+
+    while (done < count)
+    {
+	uint64_t index = (offset+done) / bs;
+	size_t   off   = (offset+done) % bs;
+
+	ssize_t n = _block_read(fspriv, gen, index, (char*)buf+done, off, count-done);
+	if (n < 0)
+	{
+	    int err, fetched = 0;
+	    DATACACHE_BLOCK* blk = _block_load(fspriv, disk, gen, index);
+	    if ((blk == NULL) && ((blk = _block_fetch(fspriv, priv->cfid, gen, index, &err))))
+		fetched = 1;
+	    if (blk == NULL)
+	    {
+		if (done)
+		    break;
+		file->errcode = err;
+		return -1;
+	    }
+
+	    n = ((off < blk->len) ? blk->len - off : 0);
+	    if ((size_t)n > count-done)
+		n = count-done;
+	    memcpy((char*)buf+done, blk->data+off, n);
+
+	    // the file has been written meanwhile - don't cache old data
+	    if (_node_gen(priv->node) == gen)
+	    {
+		if (fetched && disk)
+		    mvfs_diskcache_write(fspriv->disk, disk, index, blk->data, blk->len);
+		_block_store(fspriv, blk);
+	    }
+	    else
+		free(blk);
+	}
+
+	done += n;
+
+	// ended within an block: that's EOF
+	if (off+n < bs)
+	    break;
+    }
+
+    file->errcode = 0;
+    return done;
+}
+
+// ret bytes have been written through this file
+static inline ssize_t _written(MVFS_FILE* file, ssize_t ret)
+{
+    DATACACHE_FILE_PRIV* priv = (file->priv.ptr);
+    DATACACHE_FS_PRIV* fspriv = (file->fs->priv.ptr);
+
+    if (ret < 0)
+	file->errcode = priv->cfid->errcode;
+    else if ((ret > 0) && (priv->node))
+	_node_written(fspriv, priv->node);
+    return ret;
+}
+
+static off64_t _mvfs_datacache_fileopseek (MVFS_FILE* file, off64_t offset, int whence)
+{
+    __FILEOPS_HEAD((off64_t)-1);
+    if (priv->node == NULL)
+	return mvfs_file_seek(priv->cfid, offset, whence);
+
+    switch (whence)
+    {
+	case SEEK_SET:	break;
+	case SEEK_CUR:	offset += priv->pos;	break;
+	case SEEK_END:
+	    // only the backend knows the current size
+	    if ((offset = mvfs_file_seek(priv->cfid, offset, SEEK_END)) < 0)
+	    {
+		file->errcode = priv->cfid->errcode;
+		return (off64_t)-1;
+	    }
+	break;
+	default:
+	    file->errcode = EINVAL;
+	    return (off64_t)-1;
+    }
+
+    if (offset < 0)
+    {
+	file->errcode = EINVAL;
+	return (off64_t)-1;
+    }
+
+    priv->pos = offset;
+    priv->eof = 0;
+    file->errcode = 0;
+    return offset;
+}
+
+static ssize_t _mvfs_datacache_fileoppread (MVFS_FILE* file, void* buf, size_t count, off64_t offset)
+{
+    __FILEOPS_HEAD((ssize_t)-1);
+    if (priv->node == NULL)
+	return mvfs_file_pread(priv->cfid, buf, count, offset);
+    return _cached_pread(file, buf, count, offset);
+}
+
+static ssize_t _mvfs_datacache_fileopread (MVFS_FILE* file, void* buf, size_t count)
+{
+    __FILEOPS_HEAD((ssize_t)-1);
+    if (priv->node == NULL)
+	return mvfs_file_read(priv->cfid, buf, count);
+
+    ssize_t ret = _cached_pread(file, buf, count, priv->pos);
+    if (ret > 0)
+	priv->pos += ret;
+    else if ((ret == 0) && (count))
+	priv->eof = 1;
+    return ret;
+}
+
+static ssize_t _mvfs_datacache_fileopwrite (MVFS_FILE* file, const void* buf, size_t count)
+{
+    __FILEOPS_HEAD((ssize_t)-1);
+    if (priv->node == NULL)
+	return mvfs_file_write(priv->cfid, buf, count);
+
+    // the backend decides where appended data goes
+    if (priv->mode & O_APPEND)
+    {
+	ssize_t ret = _written(file, mvfs_file_write(priv->cfid, buf, count));
+	if (ret > 0)
+	    priv->pos = mvfs_file_seek(priv->cfid, 0, SEEK_CUR);
+	return ret;
+    }
+
+    ssize_t ret = _written(file, mvfs_file_pwrite(priv->cfid, buf, count, priv->pos));
+    if (ret > 0)
+	priv->pos += ret;
+    return ret;
+}
+
+static ssize_t _mvfs_datacache_fileoppwrite (MVFS_FILE* file, const void* buf, size_t count, off64_t offset)
+{
+    __FILEOPS_HEAD((ssize_t)-1);
+    return _written(file, mvfs_file_pwrite(priv->cfid, buf, count, offset));
+}
+
+static ssize_t _mvfs_datacache_fileopwritev (MVFS_FILE* file, const struct iovec* iov, int iovcnt)
+{
+    __FILEOPS_HEAD((ssize_t)-1);
+    if (priv->node == NULL)
+	return mvfs_file_writev(priv->cfid, iov, iovcnt);
+
+    if (priv->mode & O_APPEND)
+    {
+	ssize_t ret = _written(file, mvfs_file_writev(priv->cfid, iov, iovcnt));
+	if (ret > 0)
+	    priv->pos = mvfs_file_seek(priv->cfid, 0, SEEK_CUR);
+	return ret;
+    }
+
+    ssize_t ret = _written(file, mvfs_file_pwritev(priv->cfid, iov, iovcnt, priv->pos));
+    if (ret > 0)
+	priv->pos += ret;
+    return ret;
+}
+
+static ssize_t _mvfs_datacache_fileoppwritev (MVFS_FILE* file, const struct iovec* iov, int iovcnt, off64_t offset)
+{
+    __FILEOPS_HEAD((ssize_t)-1);
+    return _written(file, mvfs_file_pwritev(priv->cfid, iov, iovcnt, offset));
+}
+
+static int _mvfs_datacache_fileopsetflag (MVFS_FILE* file, MVFS_FILE_FLAG flag, long value)
+{
+    __FILEOPS_HEAD(-1);
+    return mvfs_file_setflag(priv->cfid, flag, value);
+}
+
+static int _mvfs_datacache_fileopgetflag (MVFS_FILE* file, MVFS_FILE_FLAG flag, long* value)
+{
+    __FILEOPS_HEAD(-1);
+    return mvfs_file_getflag(priv->cfid, flag, value);
+}
+
+static int _mvfs_datacache_fileopclose(MVFS_FILE* file)
+{
+    __FILEOPS_HEAD(-1);
+    if (priv->cfid)
+	mvfs_file_close(priv->cfid);
+    priv->cfid = NULL;
+    _node_put(fspriv, priv->node);
+    priv->node = NULL;
+    free(priv->pathname);
+    priv->pathname = NULL;
+    return 0;
+}
+
+static int _mvfs_datacache_fileopfree(MVFS_FILE* file)
+{
+    __FILEOPS_HEAD(-1);
+    _mvfs_datacache_fileopclose(file);
+    free(priv);
+    file->priv.ptr = NULL;
+    mvfs_fs_unref(file->fs);
+    return 0;
+}
+
+static int _mvfs_datacache_fileopeof(MVFS_FILE* file)
+{
+    __FILEOPS_HEAD(1);
+    if (priv->node)
+	return priv->eof;
+    return mvfs_file_eof(priv->cfid);
+}
+
+static MVFS_STAT* _mvfs_datacache_fileopstat(MVFS_FILE* file)
+{
+    __FILEOPS_HEAD(NULL);
+    MVFS_STAT* st = mvfs_file_stat(priv->cfid);
+    if (st == NULL)
+	file->errcode = priv->cfid->errcode;
+    return st;
+}
+
+// wrap an backend file - regular files get their node (and so the cache)
+static MVFS_FILE* _open_cfid(MVFS_FILESYSTEM* fs, MVFS_FILE* cfid, const char* name, mode_t mode)
+{
+    DATACACHE_FS_PRIV* fspriv = (fs->priv.ptr);
+    DATACACHE_FILE_PRIV* priv = calloc(1,sizeof(DATACACHE_FILE_PRIV));
+    if (priv == NULL)
+    {
+	ERRMSG("out of memory");
+	mvfs_file_close(cfid);
+	fs->errcode = ENOMEM;
+	return NULL;
+    }
+
+    priv->cfid     = cfid;
+    priv->pathname = strdup(name);
+    priv->mode     = mode;
+
+    MVFS_STAT* st = mvfs_file_stat(cfid);
+    if ((st) && (S_ISREG(st->mode)))
+	priv->node = _node_get(fspriv, name, st);
+    mvfs_stat_free(st);
+
+    MVFS_FILE* file = mvfs_file_alloc(fs, _fileops);
+    file->priv.ptr = priv;
+    return file;
+}
+
+static MVFS_FILE* _mvfs_datacache_fileoplookup(MVFS_FILE* file, const char* name)
+{
+    __FILEOPS_HEAD(NULL);
+    MVFS_FILE* f = mvfs_file_lookup(priv->cfid, name);
+    if (f == NULL)
+	return NULL;
+
+    size_t len = strlen(priv->pathname);
+    char fn[len+strlen(name)+2];
+    if ((len) && (priv->pathname[len-1] == '/'))
+	sprintf(fn, "%s%s", priv->pathname, name);
+    else
+	sprintf(fn, "%s/%s", priv->pathname, name);
+    return _open_cfid(file->fs, f, fn, O_RDONLY);
+}
+
+static MVFS_STAT* _mvfs_datacache_fileopscan(MVFS_FILE* file)
+{
+    __FILEOPS_HEAD(NULL);
+    MVFS_STAT* st = mvfs_file_scan(priv->cfid);
+    file->errcode = ((st == NULL) ? priv->cfid->errcode : 0);
+    return st;
+}
+
+static int _mvfs_datacache_fileopreset(MVFS_FILE* file)
+{
+    __FILEOPS_HEAD(-1);
+    return mvfs_file_reset(priv->cfid);
+}
+
+static ssize_t _mvfs_datacache_fileopscanbatch(MVFS_FILE* file, MVFS_STAT** stats, size_t max)
+{
+    __FILEOPS_HEAD(-1);
+    ssize_t ret = mvfs_file_scan_batch(priv->cfid, stats, max);
+    if (ret < 0)
+	file->errcode = priv->cfid->errcode;
+    return ret;
+}
+
+static MVFS_FILE* _mvfs_datacache_fsop_open(MVFS_FILESYSTEM* fs, const char* name, mode_t mode)
+{
+    __FSOPS_HEAD(NULL);
+
+    MVFS_FILE* fid = mvfs_fs_openfile(fspriv->fs, name, mode);
+    if (fid == NULL)
+    {
+	DEBUGMSG("couldnt open file: \"%s\"", name);
+	fs->errcode = fspriv->fs->errcode;
+	return NULL;
+    }
+
+    return _open_cfid(fs, fid, name, mode);
+}
+
+static MVFS_STAT* _mvfs_datacache_fsop_stat(MVFS_FILESYSTEM* fs, const char* filename)
+{
+    __FSOPS_HEAD(NULL);
+    MVFS_STAT* st = mvfs_fs_statfile(fspriv->fs, filename);
+    if (st == NULL)
+	fs->errcode = fspriv->fs->errcode;
+    return st;
+}
+
+static int _mvfs_datacache_fsop_unlink(MVFS_FILESYSTEM* fs, const char* filename)
+{
+    __FSOPS_HEAD(-EFAULT);
+    int ret = mvfs_fs_unlink(fspriv->fs, filename);
+    _node_invalidate(fspriv, filename);
+    return ret;
+}
+
+static int _mvfs_datacache_fsop_chmod(MVFS_FILESYSTEM* fs, const char* filename, mode_t mode)
+{
+    __FSOPS_HEAD(-EFAULT);
+    return mvfs_fs_chmod(fspriv->fs, filename, mode);
+}
+
+static int _mvfs_datacache_fsop_chown(MVFS_FILESYSTEM* fs, const char* filename, const char* uid, const char* gid)
+{
+    __FSOPS_HEAD(-EFAULT);
+    return mvfs_fs_chown(fspriv->fs, filename, uid, gid);
+}
+
+static int _mvfs_datacache_fsop_mkdir(MVFS_FILESYSTEM* fs, const char* filename, mode_t mode)
+{
+    __FSOPS_HEAD(-EFAULT);
+    return mvfs_fs_mkdir(fspriv->fs, filename, mode);
+}
+
+static MVFS_SYMLINK _mvfs_datacache_fsop_readlink(MVFS_FILESYSTEM* fs, const char* filename)
+{
+    __FSOPS_HEAD(((MVFS_SYMLINK){.errcode = -EFAULT}));
+    return mvfs_fs_readlink(fspriv->fs, filename);
+}
+
+// n2 is the new link
+static int _mvfs_datacache_fsop_symlink(MVFS_FILESYSTEM* fs, const char* n1, const char* n2)
+{
+    __FSOPS_HEAD(-EFAULT);
+    int ret = mvfs_fs_symlink(fspriv->fs, n1, n2);
+    _node_invalidate(fspriv, n2);
+    return ret;
+}
+
+static int _mvfs_datacache_fsop_rename(MVFS_FILESYSTEM* fs, const char* n1, const char* n2)
+{
+    __FSOPS_HEAD(-EFAULT);
+    int ret = mvfs_fs_rename(fspriv->fs, n1, n2);
+    _node_invalidate(fspriv, n1);
+    _node_invalidate(fspriv, n2);
+    return ret;
+}
+
+static int _mvfs_datacache_fsop_free(MVFS_FILESYSTEM* fs)
+{
+    __FSOPS_HEAD(-EFAULT);
+    int x;
+
+    for (x=0; x<CACHE_SHARDS; x++)
+    {
+	DATACACHE_SHARD* shard = &fspriv->shards[x];
+	while (shard->newest)
+	    _shard_drop(shard, shard->newest);
+	free(shard->buckets);
+	pthread_rwlock_destroy(&shard->lock);
+    }
+    while (fspriv->newest_node)
+	_node_drop(fspriv, fspriv->newest_node);
+    pthread_mutex_destroy(&fspriv->nodes_lock);
+    mvfs_diskcache_close(fspriv->disk);
+    free(fspriv);
+    fs->priv.ptr = NULL;
+    return 0;
+}
+
+static MVFS_FILESYSTEM* _create(MVFS_FILESYSTEM* clientfs, size_t capacity, size_t blocksize, const char* cache_dir, uint64_t cache_dir_max)
+{
+    if (clientfs==NULL)
+    {
+	DEBUGMSG("NULL fs passed");
+	return NULL;
+    }
+
+    DATACACHE_FS_PRIV* fspriv = calloc(1,sizeof(DATACACHE_FS_PRIV));
+    if (fspriv == NULL)
+    {
+	ERRMSG("out of memory");
+	return NULL;
+    }
+
+    int x;
+    for (x=0; x<CACHE_SHARDS; x++)
+    {
+	DATACACHE_SHARD* shard = &fspriv->shards[x];
+	if ((shard->buckets = calloc(CACHE_INITIAL_BUCKETS, sizeof(DATACACHE_BLOCK*))) == NULL)
+	{
+	    ERRMSG("out of memory");
+	    while (x--)
+		free(fspriv->shards[x].buckets);
+	    free(fspriv);
+	    return NULL;
+	}
+	shard->nbuckets = CACHE_INITIAL_BUCKETS;
+	pthread_rwlock_init(&shard->lock, NULL);
+    }
+    pthread_mutex_init(&fspriv->nodes_lock, NULL);
+
+    MVFS_FILESYSTEM* newfs = mvfs_fs_alloc(_fsops, FS_MAGIC);
+    newfs->priv.ptr = fspriv;
+    fspriv->fs = clientfs;
+    fspriv->blocksize = (blocksize ? blocksize : CACHE_BLOCKSIZE);
+
+    // the budget applies per shard - but each must hold at least one block
+    if (capacity == 0)
+	capacity = CACHE_CAPACITY;
+    fspriv->max_bytes = (capacity + CACHE_SHARDS-1) / CACHE_SHARDS;
+    if (fspriv->max_bytes < sizeof(DATACACHE_BLOCK)+fspriv->blocksize)
+	fspriv->max_bytes = sizeof(DATACACHE_BLOCK)+fspriv->blocksize;
+
+    // not fatal - we just run memory only
+    if ((cache_dir) && ((fspriv->disk = mvfs_diskcache_open(cache_dir, fspriv->blocksize,
+	(cache_dir_max ? cache_dir_max : CACHE_DIR_MAX))) == NULL))
+	ERRMSG("disk cache \"%s\" not usable - caching in memory only", cache_dir);
+
+    return newfs;
+}
+
+MVFS_FILESYSTEM* mvfs_datacachefs_create_1(MVFS_FILESYSTEM* clientfs, size_t capacity)
+{
+    return _create(clientfs, capacity, 0, NULL, 0);
+}
+
+/*
+   create an data cache on top of clientfs. args (may be NULL):
+
+     capacity      - memory budget for cached blocks in bytes
+     blocksize     - size of the cached blocks in bytes
+     cache_dir     - directory for keeping blocks across restarts
+     cache_dir_max - size limit of the cache directory's data in bytes
+*/
+MVFS_FILESYSTEM* mvfs_datacachefs_create_args(MVFS_FILESYSTEM* clientfs, MVFS_ARGS* args)
+{
+    size_t capacity = 0, blocksize = 0;
+    uint64_t cache_dir_max = 0;
+    const char* val;
+
+    if ((val = mvfs_args_get(args, "capacity")))
+	capacity = strtoul(val, NULL, 10);
+    if ((val = mvfs_args_get(args, "blocksize")))
+	blocksize = strtoul(val, NULL, 10);
+    if ((val = mvfs_args_get(args, "cache_dir_max")))
+	cache_dir_max = strtoull(val, NULL, 10);
+
+    return _create(clientfs, capacity, blocksize, mvfs_args_get(args, "cache_dir"), cache_dir_max);
+}
+
+int mvfs_datacachefs_getstats(MVFS_FILESYSTEM* fs, MVFS_DATACACHE_STATS* stats)
+{
+    __FSOPS_HEAD(-EFAULT);
+    if (stats == NULL)
+	return -EFAULT;
+    int x;
+
+    memset(stats, 0, sizeof(MVFS_DATACACHE_STATS));
+    for (x=0; x<CACHE_SHARDS; x++)
+    {
+	DATACACHE_SHARD* shard = &fspriv->shards[x];
+	pthread_rwlock_rdlock(&shard->lock);
+	stats->hits      += shard->stats.hits;
+	stats->misses    += shard->stats.misses;
+	stats->disk_hits += shard->stats.disk_hits;
+	stats->evictions += shard->stats.evictions;
+	stats->blocks    += shard->stats.blocks;
+	stats->bytes     += shard->bytes;
+	pthread_rwlock_unlock(&shard->lock);
+    }
+
+    pthread_mutex_lock(&fspriv->nodes_lock);
+    stats->invalidations = fspriv->invalidations;
+    pthread_mutex_unlock(&fspriv->nodes_lock);
+    return 0;
+}
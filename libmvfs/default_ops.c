@@ -15,6 +15,9 @@
 #include <stdio.h>
 #include <errno.h>
 #include <malloc.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include <mvfs/mvfs.h>
 #include <mvfs/default_ops.h>
@@ -65,6 +68,34 @@ ssize_t mvfs_default_fileops_write   (MVFS_FILE* fp, const void* buf, size_t cou
     return (ssize_t) -1;
 }
 
+// no driver buffers to lend - read into an temporary one
+ssize_t mvfs_default_fileops_read_into (MVFS_FILE* fp, const void** data, size_t count)
+{
+    void* buf = malloc(count ? count : 1);
+    if (buf == NULL)
+    {
+	fp->errcode = ENOMEM;
+	return (ssize_t) -1;
+    }
+
+    ssize_t ret = mvfs_file_read(fp, buf, count);
+    if (ret <= 0)
+    {
+	free(buf);
+	*data = NULL;
+	return ret;
+    }
+
+    *data = buf;
+    return ret;
+}
+
+int mvfs_default_fileops_release (MVFS_FILE* fp, const void* data)
+{
+    free((void*)data);
+    return 0;
+}
+
 ssize_t mvfs_default_fileops_pread    (MVFS_FILE* fp, void* buf, size_t count, off64_t offset)
 {
     DEBUGMSG("DUMMY");
@@ -79,6 +110,179 @@ ssize_t mvfs_default_fileops_pwrite   (MVFS_FILE* fp, const void* buf, size_t co
     return (ssize_t) -1;
 }
 
+// vectored I/O fallbacks: one call per element, stopping on short transfers.
+// errors are only reported if nothing has been transferred yet
+
+ssize_t mvfs_default_fileops_readv (MVFS_FILE* fp, const struct iovec* iov, int iovcnt)
+{
+    ssize_t done = 0;
+    int x;
+
+    for (x=0; x<iovcnt; x++)
+    {
+	if (iov[x].iov_len == 0)
+	    continue;
+	ssize_t ret = mvfs_file_read(fp, iov[x].iov_base, iov[x].iov_len);
+	if (ret < 0)
+	    return (done ? done : ret);
+	done += ret;
+	if ((size_t)ret < iov[x].iov_len)
+	    break;
+    }
+    return done;
+}
+
+ssize_t mvfs_default_fileops_writev (MVFS_FILE* fp, const struct iovec* iov, int iovcnt)
+{
+    ssize_t done = 0;
+    int x;
+
+    for (x=0; x<iovcnt; x++)
+    {
+	if (iov[x].iov_len == 0)
+	    continue;
+	ssize_t ret = mvfs_file_write(fp, iov[x].iov_base, iov[x].iov_len);
+	if (ret < 0)
+	    return (done ? done : ret);
+	done += ret;
+	if ((size_t)ret < iov[x].iov_len)
+	    break;
+    }
+    return done;
+}
+
+ssize_t mvfs_default_fileops_preadv (MVFS_FILE* fp, const struct iovec* iov, int iovcnt, off64_t offset)
+{
+    ssize_t done = 0;
+    int x;
+
+    for (x=0; x<iovcnt; x++)
+    {
+	if (iov[x].iov_len == 0)
+	    continue;
+	ssize_t ret = mvfs_file_pread(fp, iov[x].iov_base, iov[x].iov_len, offset+done);
+	if (ret < 0)
+	    return (done ? done : ret);
+	done += ret;
+	if ((size_t)ret < iov[x].iov_len)
+	    break;
+    }
+    return done;
+}
+
+ssize_t mvfs_default_fileops_pwritev (MVFS_FILE* fp, const struct iovec* iov, int iovcnt, off64_t offset)
+{
+    ssize_t done = 0;
+    int x;
+
+    for (x=0; x<iovcnt; x++)
+    {
+	if (iov[x].iov_len == 0)
+	    continue;
+	ssize_t ret = mvfs_file_pwrite(fp, iov[x].iov_base, iov[x].iov_len, offset+done);
+	if (ret < 0)
+	    return (done ? done : ret);
+	done += ret;
+	if ((size_t)ret < iov[x].iov_len)
+	    break;
+    }
+    return done;
+}
+
+/*
+   mmap() emulation: the region is read into an anonymous mapping,
+   with an header page in front of it telling munmap() what to write
+   back. Only the part which could be read gets written back, so the
+   file never grows.
+*/
+#define MAP_EMU_MAGIC	0x6d766d70
+
+typedef struct
+{
+    int		magic;
+    int		prot;
+    off64_t	offset;
+    size_t	len;
+    size_t	valid;
+} MAP_EMU_HEADER;
+
+void* mvfs_default_fileops_mmap (MVFS_FILE* fp, off64_t offset, size_t len, int prot)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    if (len == 0)
+    {
+	fp->errcode = EINVAL;
+	return NULL;
+    }
+
+    char* base = mmap(NULL, page+len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+    {
+	fp->errcode = errno;
+	return NULL;
+    }
+
+    MAP_EMU_HEADER* hdr = (MAP_EMU_HEADER*)base;
+    hdr->magic  = MAP_EMU_MAGIC;
+    hdr->prot   = prot;
+    hdr->offset = offset;
+    hdr->len    = len;
+    hdr->valid  = 0;
+
+    while (hdr->valid < len)
+    {
+	ssize_t got = mvfs_file_pread(fp, base+page+hdr->valid, len-hdr->valid, offset+hdr->valid);
+	if (got < 0)
+	{
+	    munmap(base, page+len);
+	    return NULL;
+	}
+	if (got == 0)
+	    break;
+	hdr->valid += got;
+    }
+
+    if ((prot & (PROT_READ|PROT_WRITE)) != (PROT_READ|PROT_WRITE))
+	mprotect(base+page, len, prot);
+
+    fp->errcode = 0;
+    return base+page;
+}
+
+int mvfs_default_fileops_munmap (MVFS_FILE* fp, void* addr, size_t len)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    char* base = (char*)addr - page;
+    MAP_EMU_HEADER* hdr = (MAP_EMU_HEADER*)base;
+
+    if ((hdr->magic != MAP_EMU_MAGIC) || (hdr->len != len))
+    {
+	ERRMSG("not an emulated mapping: %p", addr);
+	fp->errcode = EINVAL;
+	return -1;
+    }
+
+    int ret = 0;
+    if (hdr->prot & PROT_WRITE)
+    {
+	size_t done = 0;
+	while (done < hdr->valid)
+	{
+	    ssize_t s = mvfs_file_pwrite(fp, (char*)addr+done, hdr->valid-done, hdr->offset+done);
+	    if (s <= 0)
+	    {
+		ret = -1;
+		break;
+	    }
+	    done += s;
+	}
+    }
+
+    munmap(base, page+len);
+    return ret;
+}
+
 static inline const char* __mvfs_flag2str(MVFS_FILE_FLAG f)
 {
     switch (f)
@@ -88,6 +292,10 @@ static inline const char* __mvfs_flag2str(MVFS_FILE_FLAG f)
 	case WRITE_TIMEOUT:	return "WRITE_TIMEOUT";
 	case READ_AHEAD:	return "READ_AHEAD";
 	case WRITE_ASYNC:	return "WRITE_ASYNNC";
+	case READ_AHEAD_HITS:	return "READ_AHEAD_HITS";
+	case READ_AHEAD_MISSES:	return "READ_AHEAD_MISSES";
+	case READ_PIPELINE:	return "READ_PIPELINE";
+	case SCAN_NAMES_ONLY:	return "SCAN_NAMES_ONLY";
 	default:		return "UNKNOWN";
     }
 }
@@ -157,3 +365,23 @@ int mvfs_default_fileops_reset(MVFS_FILE* file)
 {
     return -EINVAL;
 }
+
+// drivers w/o batch support: one scan per entry
+ssize_t mvfs_default_fileops_scan_batch(MVFS_FILE* file, MVFS_STAT** stats, size_t max)
+{
+    size_t count = 0;
+    MVFS_STAT* st;
+
+    file->errcode = 0;
+    while ((count < max) && ((st = mvfs_file_scan(file))))
+	stats[count++] = st;
+
+    // an error must not look like the end of the directory
+    if ((count < max) && (file->errcode))
+    {
+	while (count)
+	    mvfs_stat_free(stats[--count]);
+	return -1;
+    }
+    return count;
+}
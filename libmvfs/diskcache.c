@@ -0,0 +1,589 @@
+/*
+    libmvfs - metux Virtual Filesystem Library
+
+    Persistent on-disk cache tier
+
+    The cache directory holds two append-only files: "data" with the
+    cached blocks and "index", an log of records telling which file
+    version (path + mtime + size) and block they belong to. Nothing is
+    ever overwritten, so an crash can only leave an torn tail: records
+    are checksummed and loading (via an read-only mapping) stops at the
+    first broken one, cutting it off. Blocks are checksummed too, in
+    case the index made it to disk but the data didn't.
+
+    An file version's id is the offset of its record in the index. Its
+    cached blocks are only used if an fresh stat of the file still
+    matches - this revalidation is up to the caller. Files changed in
+    ways an stat might not tell (eg. written within the same second)
+    have to be dropped explicitly: that records an version which never
+    matches, so the next one starts empty.
+
+    Once the data file exceeds the size limit, the whole cache is
+    dropped and started over.
+
+    Copyright (C) 2008 Enrico Weigelt, metux IT service <weigelt@metux.de>
+    This code is published under the terms of the GNU Public License 2.0
+*/
+
+#include "mvfs-internal.h"
+
+#include <string.h>
+#include <errno.h>
+#include <malloc.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#include <mvfs/mvfs.h>
+#include <mvfs/_utils.h>
+
+#include "diskcache.h"
+
+#define DC_INDEX_MAGIC		"mvfsdc01"
+#define DC_RECORD_MAGIC		0x6364766d
+#define DC_FILE			1
+#define DC_BLOCK		2
+#define DC_INITIAL_BUCKETS	256
+
+// ids carry the cache's epoch, so ones handed out before an reset don't match
+#define DC_ID(dc,off)		(((uint64_t)(dc)->epoch << 48) | (off))
+#define DC_ID_EPOCH(id)		((id) >> 48)
+#define DC_ID_OFFSET(id)	((id) & 0xffffffffffffull)
+
+typedef struct
+{
+    char     magic[8];
+    uint64_t blocksize;
+} DC_INDEX_HEADER;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t type;		// DC_FILE or DC_BLOCK
+    uint32_t len;		// whole record including the path, 8 byte aligned
+    uint32_t crc;		// of the whole record, computed with crc=0
+    uint64_t file;		// DC_BLOCK: index offset of the file's record
+    uint64_t index;		// DC_BLOCK: block index
+    uint64_t data_off;		// DC_BLOCK: position in the data file
+    uint32_t data_len;
+    uint32_t data_crc;
+    int64_t  mtime;		// DC_FILE
+    int64_t  size;
+    char     path[];		// DC_FILE: NUL terminated
+} DC_RECORD;
+
+typedef struct __dc_file DC_FILE_ENT;
+
+struct __dc_file
+{
+    uint64_t     off;
+    time_t       mtime;
+    long         size;
+    unsigned     hash;
+    DC_FILE_ENT* next;
+    char         path[];
+};
+
+typedef struct __dc_block DC_BLOCK_ENT;
+
+struct __dc_block
+{
+    uint64_t      file;
+    uint64_t      index;
+    uint64_t      data_off;
+    uint32_t      data_len;
+    uint32_t      data_crc;
+    unsigned      hash;
+    DC_BLOCK_ENT* next;
+};
+
+struct __mvfs_diskcache
+{
+    pthread_mutex_t lock;
+    int             index_fd;
+    int             data_fd;
+    size_t          blocksize;
+    uint64_t        max_bytes;
+    uint64_t        index_end;
+    uint64_t        data_end;
+    unsigned        epoch;
+    DC_FILE_ENT**   files;
+    unsigned        nfiles_buckets;
+    unsigned long   nfiles;
+    DC_BLOCK_ENT**  blocks;
+    unsigned        nblocks_buckets;
+    unsigned long   nblocks;
+};
+
+static uint32_t _crc_table[256];
+static pthread_once_t _crc_once = PTHREAD_ONCE_INIT;
+
+static void _crc_init()
+{
+    uint32_t x, y;
+    for (x=0; x<256; x++)
+    {
+	uint32_t c = x;
+	for (y=0; y<8; y++)
+	    c = ((c & 1) ? (0xedb88320 ^ (c >> 1)) : (c >> 1));
+	_crc_table[x] = c;
+    }
+}
+
+static uint32_t _crc32_update(uint32_t c, const void* data, size_t len)
+{
+    const unsigned char* p = data;
+    while (len--)
+	c = _crc_table[(c ^ *p++) & 0xff] ^ (c >> 8);
+    return c;
+}
+
+static inline uint32_t _crc32(const void* data, size_t len)
+{
+    return _crc32_update(0xffffffff, data, len) ^ 0xffffffff;
+}
+
+// checksum of the whole record, as if its crc field was 0
+static uint32_t _record_crc(const DC_RECORD* rec)
+{
+    DC_RECORD hdr = *rec;
+    hdr.crc = 0;
+    uint32_t c = _crc32_update(0xffffffff, &hdr, sizeof(hdr));
+    c = _crc32_update(c, rec->path, rec->len - sizeof(DC_RECORD));
+    return c ^ 0xffffffff;
+}
+
+static unsigned _hash_name(const char* name)
+{
+    unsigned h = 2166136261u;
+    while (*name)
+	h = (h ^ (unsigned char)*name++) * 16777619u;
+    return h;
+}
+
+static inline unsigned _hash_block(uint64_t file, uint64_t index)
+{
+    uint64_t h = (file * 0x9e3779b97f4a7c15ull) ^ ((index+1) * 0xc2b2ae3d27d4eb4full);
+    return (unsigned)(h ^ (h >> 32));
+}
+
+// double an table's buckets - files and blocks chain through next the same way
+#define _GROW(type, buckets, nbuckets)					\
+    {									\
+	unsigned n = nbuckets*2, x;					\
+	type** b = calloc(n, sizeof(type*));				\
+	if (b)								\
+	{								\
+	    for (x=0; x<nbuckets; x++)					\
+	    {								\
+		type* e = buckets[x];					\
+		while (e)						\
+		{							\
+		    type* next = e->next;				\
+		    e->next = b[e->hash & (n-1)];			\
+		    b[e->hash & (n-1)] = e;				\
+		    e = next;						\
+		}							\
+	    }								\
+	    free(buckets);						\
+	    buckets  = b;						\
+	    nbuckets = n;						\
+	}								\
+    }
+
+static DC_FILE_ENT* _file_find(MVFS_DISKCACHE* dc, const char* path, unsigned hash)
+{
+    DC_FILE_ENT* f;
+    for (f=dc->files[hash & (dc->nfiles_buckets-1)]; f; f=f->next)
+	if ((f->hash == hash) && (!strcmp(f->path, path)))
+	    return f;
+    return NULL;
+}
+
+// remember the latest version of an path
+static void _file_put(MVFS_DISKCACHE* dc, const char* path, uint64_t off, time_t mtime, long size)
+{
+    unsigned hash = _hash_name(path);
+    DC_FILE_ENT* f = _file_find(dc, path, hash);
+    if (f == NULL)
+    {
+	size_t len = strlen(path);
+	if ((f = malloc(sizeof(DC_FILE_ENT)+len+1)) == NULL)
+	    return;
+	memcpy(f->path, path, len+1);
+	f->hash = hash;
+	f->next = dc->files[hash & (dc->nfiles_buckets-1)];
+	dc->files[hash & (dc->nfiles_buckets-1)] = f;
+	if (++dc->nfiles > dc->nfiles_buckets)
+	    _GROW(DC_FILE_ENT, dc->files, dc->nfiles_buckets);
+    }
+    f->off   = off;
+    f->mtime = mtime;
+    f->size  = size;
+}
+
+static DC_BLOCK_ENT* _block_find(MVFS_DISKCACHE* dc, uint64_t file, uint64_t index, unsigned hash)
+{
+    DC_BLOCK_ENT* b;
+    for (b=dc->blocks[hash & (dc->nblocks_buckets-1)]; b; b=b->next)
+	if ((b->hash == hash) && (b->file == file) && (b->index == index))
+	    return b;
+    return NULL;
+}
+
+static void _block_put(MVFS_DISKCACHE* dc, const DC_RECORD* rec)
+{
+    unsigned hash = _hash_block(rec->file, rec->index);
+    DC_BLOCK_ENT* b = _block_find(dc, rec->file, rec->index, hash);
+    if (b == NULL)
+    {
+	if ((b = malloc(sizeof(DC_BLOCK_ENT))) == NULL)
+	    return;
+	b->file  = rec->file;
+	b->index = rec->index;
+	b->hash  = hash;
+	b->next  = dc->blocks[hash & (dc->nblocks_buckets-1)];
+	dc->blocks[hash & (dc->nblocks_buckets-1)] = b;
+	if (++dc->nblocks > dc->nblocks_buckets)
+	    _GROW(DC_BLOCK_ENT, dc->blocks, dc->nblocks_buckets);
+    }
+    b->data_off = rec->data_off;
+    b->data_len = rec->data_len;
+    b->data_crc = rec->data_crc;
+}
+
+static void _tables_clear(MVFS_DISKCACHE* dc)
+{
+    unsigned x;
+    for (x=0; x<dc->nfiles_buckets; x++)
+	while (dc->files[x])
+	{
+	    DC_FILE_ENT* f = dc->files[x];
+	    dc->files[x] = f->next;
+	    free(f);
+	}
+    for (x=0; x<dc->nblocks_buckets; x++)
+	while (dc->blocks[x])
+	{
+	    DC_BLOCK_ENT* b = dc->blocks[x];
+	    dc->blocks[x] = b->next;
+	    free(b);
+	}
+    dc->nfiles  = 0;
+    dc->nblocks = 0;
+}
+
+// drop everything and start over - called with lock held (or while opening)
+static int _reset(MVFS_DISKCACHE* dc)
+{
+    DC_INDEX_HEADER hdr;
+
+    _tables_clear(dc);
+    dc->epoch++;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, DC_INDEX_MAGIC, sizeof(hdr.magic));
+    hdr.blocksize = dc->blocksize;
+
+    if ((ftruncate(dc->index_fd, 0) < 0) || (ftruncate(dc->data_fd, 0) < 0) ||
+	(pwrite(dc->index_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)))
+    {
+	ERRMSG("cannot reset disk cache: %s", strerror(errno));
+	return -1;
+    }
+
+    dc->index_end = sizeof(hdr);
+    dc->data_end  = 0;
+    return 0;
+}
+
+// read the index, dropping an torn tail
+static int _load(MVFS_DISKCACHE* dc)
+{
+    struct stat st;
+    if (fstat(dc->index_fd, &st) < 0)
+	return -1;
+    uint64_t size = st.st_size;
+    if (fstat(dc->data_fd, &st) < 0)
+	return -1;
+    dc->data_end = st.st_size;
+
+    if (size < sizeof(DC_INDEX_HEADER))
+	return _reset(dc);
+
+    char* map = mmap(NULL, size, PROT_READ, MAP_SHARED, dc->index_fd, 0);
+    if (map == MAP_FAILED)
+	return -1;
+
+    DC_INDEX_HEADER* hdr = (DC_INDEX_HEADER*)map;
+    if ((memcmp(hdr->magic, DC_INDEX_MAGIC, sizeof(hdr->magic))) || (hdr->blocksize != dc->blocksize))
+    {
+	munmap(map, size);
+	DEBUGMSG("incompatible disk cache - starting over");
+	return _reset(dc);
+    }
+
+    uint64_t off = sizeof(DC_INDEX_HEADER);
+    while (off + sizeof(DC_RECORD) <= size)
+    {
+	const DC_RECORD* rec = (const DC_RECORD*)(map+off);
+	if ((rec->magic != DC_RECORD_MAGIC) || (rec->len < sizeof(DC_RECORD)) || (rec->len % 8) ||
+	    (off + rec->len > size) || (_record_crc(rec) != rec->crc))
+	    break;
+
+	if (rec->type == DC_FILE)
+	{
+	    if (memchr(rec->path, 0, rec->len - sizeof(DC_RECORD)) == NULL)
+		break;
+	    _file_put(dc, rec->path, off, rec->mtime, rec->size);
+	}
+	else if ((rec->type == DC_BLOCK) && (rec->data_off + rec->data_len <= dc->data_end))
+	    _block_put(dc, rec);
+
+	off += rec->len;
+    }
+    munmap(map, size);
+
+    if (off < size)
+    {
+	DEBUGMSG("dropping %ld bytes of torn index", (long)(size-off));
+	if (ftruncate(dc->index_fd, off) < 0)
+	    return -1;
+    }
+    dc->index_end = off;
+    return 0;
+}
+
+// append an record to the index - called with lock held
+static int _append(MVFS_DISKCACHE* dc, DC_RECORD* rec)
+{
+    rec->magic = DC_RECORD_MAGIC;
+    rec->crc   = 0;
+    rec->crc   = _record_crc(rec);
+
+    if (pwrite(dc->index_fd, rec, rec->len, dc->index_end) != (ssize_t)rec->len)
+    {
+	ERRMSG("cannot write disk cache index: %s", strerror(errno));
+	return -1;
+    }
+    dc->index_end += rec->len;
+    return 0;
+}
+
+// record an new file version, returns its id - called with lock held
+static uint64_t _add_file(MVFS_DISKCACHE* dc, const char* path, time_t mtime, long size)
+{
+    size_t len = sizeof(DC_RECORD) + ((strlen(path)+1+7) & ~7);
+    DC_RECORD* rec = calloc(1, len);
+    if (rec == NULL)
+	return 0;
+
+    rec->type  = DC_FILE;
+    rec->len   = len;
+    rec->mtime = mtime;
+    rec->size  = size;
+    strcpy(rec->path, path);
+
+    uint64_t off = dc->index_end;
+    uint64_t id = 0;
+    if (_append(dc, rec) == 0)
+    {
+	_file_put(dc, path, off, mtime, size);
+	id = DC_ID(dc, off);
+    }
+    free(rec);
+    return id;
+}
+
+static void _free(MVFS_DISKCACHE* dc)
+{
+    if (dc->files)
+	_tables_clear(dc);
+    free(dc->files);
+    free(dc->blocks);
+    if (dc->index_fd >= 0)
+	close(dc->index_fd);
+    if (dc->data_fd >= 0)
+	close(dc->data_fd);
+    pthread_mutex_destroy(&dc->lock);
+    free(dc);
+}
+
+MVFS_DISKCACHE* mvfs_diskcache_open(const char* dir, size_t blocksize, uint64_t max_bytes)
+{
+    char fn[4096];
+
+    if ((dir == NULL) || (blocksize == 0))
+	return NULL;
+
+    pthread_once(&_crc_once, _crc_init);
+
+    if ((mkdir(dir, 0700) < 0) && (errno != EEXIST))
+    {
+	ERRMSG("cannot create cache dir \"%s\": %s", dir, strerror(errno));
+	return NULL;
+    }
+
+    MVFS_DISKCACHE* dc = calloc(1,sizeof(MVFS_DISKCACHE));
+    if (dc == NULL)
+    {
+	ERRMSG("out of memory");
+	return NULL;
+    }
+    pthread_mutex_init(&dc->lock, NULL);
+    dc->blocksize       = blocksize;
+    dc->max_bytes       = max_bytes;
+    dc->epoch           = 1;
+    dc->nfiles_buckets  = DC_INITIAL_BUCKETS;
+    dc->nblocks_buckets = DC_INITIAL_BUCKETS;
+    dc->files           = calloc(DC_INITIAL_BUCKETS, sizeof(DC_FILE_ENT*));
+    dc->blocks          = calloc(DC_INITIAL_BUCKETS, sizeof(DC_BLOCK_ENT*));
+
+    snprintf(fn, sizeof(fn), "%s/index", dir);
+    dc->index_fd = open(fn, O_RDWR|O_CREAT, 0600);
+    snprintf(fn, sizeof(fn), "%s/data", dir);
+    dc->data_fd  = open(fn, O_RDWR|O_CREAT, 0600);
+
+    if ((dc->files == NULL) || (dc->blocks == NULL) || (dc->index_fd < 0) || (dc->data_fd < 0))
+    {
+	ERRMSG("cannot open disk cache in \"%s\": %s", dir, strerror(errno));
+	_free(dc);
+	return NULL;
+    }
+
+    // the files are append-only for just one writer
+    if (flock(dc->index_fd, LOCK_EX|LOCK_NB) < 0)
+    {
+	ERRMSG("disk cache \"%s\" is in use", dir);
+	_free(dc);
+	return NULL;
+    }
+
+    if (_load(dc) < 0)
+    {
+	ERRMSG("cannot load disk cache \"%s\": %s", dir, strerror(errno));
+	_free(dc);
+	return NULL;
+    }
+
+    DEBUGMSG("%s: %lu files, %lu blocks", dir, dc->nfiles, dc->nblocks);
+    return dc;
+}
+
+void mvfs_diskcache_close(MVFS_DISKCACHE* dc)
+{
+    if (dc)
+	_free(dc);
+}
+
+uint64_t mvfs_diskcache_file(MVFS_DISKCACHE* dc, const char* path, time_t mtime, long size)
+{
+    if ((dc == NULL) || (path == NULL))
+	return 0;
+
+    pthread_mutex_lock(&dc->lock);
+    DC_FILE_ENT* f = _file_find(dc, path, _hash_name(path));
+    if ((f) && (f->mtime == mtime) && (f->size == size))
+    {
+	uint64_t id = DC_ID(dc, f->off);
+	pthread_mutex_unlock(&dc->lock);
+	return id;
+    }
+
+    // new version - its blocks go under an new record
+    uint64_t id = _add_file(dc, path, mtime, size);
+    pthread_mutex_unlock(&dc->lock);
+    return id;
+}
+
+void mvfs_diskcache_drop(MVFS_DISKCACHE* dc, const char* path)
+{
+    if ((dc == NULL) || (path == NULL))
+	return;
+
+    pthread_mutex_lock(&dc->lock);
+    DC_FILE_ENT* f = _file_find(dc, path, _hash_name(path));
+    if ((f) && (f->size >= 0))
+	_add_file(dc, path, 0, -1);
+    pthread_mutex_unlock(&dc->lock);
+}
+
+ssize_t mvfs_diskcache_read(MVFS_DISKCACHE* dc, uint64_t file, uint64_t index, void* buf)
+{
+    if ((dc == NULL) || (file == 0))
+	return -1;
+
+    pthread_mutex_lock(&dc->lock);
+    uint64_t off = DC_ID_OFFSET(file);
+    unsigned hash = _hash_block(off, index);
+    DC_BLOCK_ENT* b = ((DC_ID_EPOCH(file) == dc->epoch) ? _block_find(dc, off, index, hash) : NULL);
+    if (b == NULL)
+    {
+	pthread_mutex_unlock(&dc->lock);
+	return -1;
+    }
+    DC_BLOCK_ENT ent = *b;
+    pthread_mutex_unlock(&dc->lock);
+
+    // the data file is never overwritten, just truncated by an reset -
+    // then the checksum won't match anymore
+    if ((ent.data_len > dc->blocksize) ||
+	(pread(dc->data_fd, buf, ent.data_len, ent.data_off) != (ssize_t)ent.data_len) ||
+	(_crc32(buf, ent.data_len) != ent.data_crc))
+    {
+	DEBUGMSG("broken block %ld @ %ld", (long)index, (long)ent.data_off);
+	return -1;
+    }
+    return ent.data_len;
+}
+
+int mvfs_diskcache_write(MVFS_DISKCACHE* dc, uint64_t file, uint64_t index, const void* data, size_t len)
+{
+    if ((dc == NULL) || (file == 0) || (len > dc->blocksize))
+	return -EINVAL;
+
+    DC_RECORD rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.type     = DC_BLOCK;
+    rec.len      = sizeof(rec);
+    rec.file     = DC_ID_OFFSET(file);
+    rec.index    = index;
+    rec.data_len = len;
+    rec.data_crc = _crc32(data, len);
+
+    // reserve room in the data file, write outside the lock
+    pthread_mutex_lock(&dc->lock);
+    if ((dc->max_bytes) && (dc->data_end + len > dc->max_bytes))
+    {
+	DEBUGMSG("disk cache full - starting over");
+	_reset(dc);
+    }
+    unsigned epoch = dc->epoch;
+    if (DC_ID_EPOCH(file) != epoch)
+    {
+	pthread_mutex_unlock(&dc->lock);
+	return -ESTALE;
+    }
+    rec.data_off = dc->data_end;
+    dc->data_end += len;
+    pthread_mutex_unlock(&dc->lock);
+
+    if (pwrite(dc->data_fd, data, len, rec.data_off) != (ssize_t)len)
+    {
+	ERRMSG("cannot write disk cache data: %s", strerror(errno));
+	return -EIO;
+    }
+
+    // only now the index may point to it
+    pthread_mutex_lock(&dc->lock);
+    int ret = -ESTALE;
+    if ((dc->epoch == epoch) && ((ret = _append(dc, &rec)) == 0))
+	_block_put(dc, &rec);
+    pthread_mutex_unlock(&dc->lock);
+    return ret;
+}
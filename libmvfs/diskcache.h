@@ -0,0 +1,40 @@
+/*
+    libmvfs - metux Virtual Filesystem Library
+
+    Persistent on-disk cache tier - internal, don't use outside of libmvfs
+
+    Copyright (C) 2008 Enrico Weigelt, metux IT service <weigelt@metux.de>
+    This code is published under the terms of the GNU Public License 2.0
+*/
+
+#ifndef __MVFS_INTERNAL_DISKCACHE_H
+#define __MVFS_INTERNAL_DISKCACHE_H
+
+#include <mvfs/types.h>
+#include <inttypes.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct __mvfs_diskcache MVFS_DISKCACHE;
+
+/* open (or create) the cache in dir - NULL if it's not usable, eg. locked by another process */
+MVFS_DISKCACHE* mvfs_diskcache_open  (const char* dir, size_t blocksize, uint64_t max_bytes);
+/* close the cache - the on-disk data stays */
+void            mvfs_diskcache_close (MVFS_DISKCACHE* dc);
+/* get the id of an file version (path + mtime + size), adding it if unknown - 0 on error */
+uint64_t        mvfs_diskcache_file  (MVFS_DISKCACHE* dc, const char* path, time_t mtime, long size);
+/* forget the cached versions of an file, eg. after writing to it */
+void            mvfs_diskcache_drop  (MVFS_DISKCACHE* dc, const char* path);
+/* read an cached block into buf (blocksize bytes) - returns its length or -1 if not cached */
+ssize_t         mvfs_diskcache_read  (MVFS_DISKCACHE* dc, uint64_t file, uint64_t index, void* buf);
+/* store an block */
+int             mvfs_diskcache_write (MVFS_DISKCACHE* dc, uint64_t file, uint64_t index, const void* data, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
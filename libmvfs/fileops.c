@@ -40,6 +40,28 @@ ssize_t mvfs_file_read    (MVFS_FILE* fp, void* buf, size_t count)
     return fp->ops.read(fp, buf, count);
 }
 
+ssize_t mvfs_file_read_into (MVFS_FILE* fp, const void** data, size_t count)
+{
+    if (fp==NULL)
+	return (ssize_t) -EFAULT;
+    if (fp->ops.read_into == NULL)
+	return mvfs_default_fileops_read_into(fp, data, count);
+
+    return fp->ops.read_into(fp, data, count);
+}
+
+int mvfs_file_release (MVFS_FILE* fp, const void* data)
+{
+    if (fp==NULL)
+	return -EFAULT;
+    if (data==NULL)
+	return 0;
+    if (fp->ops.release == NULL)
+	return mvfs_default_fileops_release(fp, data);
+
+    return fp->ops.release(fp, data);
+}
+
 ssize_t mvfs_file_write   (MVFS_FILE* fp, const void* buf, size_t count)
 {
     if (fp==NULL)
@@ -54,7 +76,7 @@ ssize_t mvfs_file_pread    (MVFS_FILE* fp, void* buf, size_t count, off64_t offs
 {
     if (fp==NULL)
 	return (ssize_t) -EFAULT;
-    if (fp->ops.read == NULL)
+    if (fp->ops.pread == NULL)
 	return mvfs_default_fileops_pread(fp, buf, count, offset);
 
     return fp->ops.pread(fp, buf, count, offset);
@@ -64,62 +86,90 @@ ssize_t mvfs_file_pwrite  (MVFS_FILE* fp, const void* buf, size_t count, off64_t
 {
     if (fp==NULL)
 	return (ssize_t) -EFAULT;
-    if (fp->ops.write == NULL)
+    if (fp->ops.pwrite == NULL)
 	return mvfs_default_fileops_pwrite(fp, buf, count, offset);
     
     return fp->ops.pwrite(fp, buf, count, offset);
 }
 
-int mvfs_file_setflag (MVFS_FILE* fp, MVFS_FILE_FLAG flag, long value)
+ssize_t mvfs_file_readv   (MVFS_FILE* fp, const struct iovec* iov, int iovcnt)
 {
     if (fp==NULL)
-	return -EFAULT;
-    if (fp->ops.setflag == NULL)
-	return mvfs_default_fileops_setflag(fp, flag, value);
-    return fp->ops.setflag(fp, flag, value);
+	return (ssize_t) -EFAULT;
+    if (fp->ops.readv == NULL)
+	return mvfs_default_fileops_readv(fp, iov, iovcnt);
+
+    return fp->ops.readv(fp, iov, iovcnt);
 }
 
-int mvfs_file_getflag (MVFS_FILE* fp, MVFS_FILE_FLAG flag, long* value)
+ssize_t mvfs_file_writev  (MVFS_FILE* fp, const struct iovec* iov, int iovcnt)
 {
     if (fp==NULL)
-	return -EFAULT;
-    if (fp->ops.getflag == NULL)
-	return mvfs_default_fileops_getflag(fp, flag, value);
-    return fp->ops.getflag(fp, flag, value);
+	return (ssize_t) -EFAULT;
+    if (fp->ops.writev == NULL)
+	return mvfs_default_fileops_writev(fp, iov, iovcnt);
+
+    return fp->ops.writev(fp, iov, iovcnt);
 }
 
-int mvfs_stat_free(MVFS_STAT*st)
+ssize_t mvfs_file_preadv  (MVFS_FILE* fp, const struct iovec* iov, int iovcnt, off64_t offset)
 {
-    if (st == NULL)
-	return -EFAULT;
-    if (st->name)	free((char*)st->name);
-    if (st->uid)	free((char*)st->uid);
-    if (st->gid)	free((char*)st->gid);
-    free(st);
-    return 0;
+    if (fp==NULL)
+	return (ssize_t) -EFAULT;
+    if (fp->ops.preadv == NULL)
+	return mvfs_default_fileops_preadv(fp, iov, iovcnt, offset);
+
+    return fp->ops.preadv(fp, iov, iovcnt, offset);
+}
+
+ssize_t mvfs_file_pwritev (MVFS_FILE* fp, const struct iovec* iov, int iovcnt, off64_t offset)
+{
+    if (fp==NULL)
+	return (ssize_t) -EFAULT;
+    if (fp->ops.pwritev == NULL)
+	return mvfs_default_fileops_pwritev(fp, iov, iovcnt, offset);
+
+    return fp->ops.pwritev(fp, iov, iovcnt, offset);
 }
 
-MVFS_STAT* mvfs_stat_dup(MVFS_STAT* oldst)
+void* mvfs_file_map (MVFS_FILE* fp, off64_t offset, size_t len, int prot)
 {
-    if (oldst == NULL)
+    if (fp==NULL)
 	return NULL;
+    if (fp->ops.mmap == NULL)
+	return mvfs_default_fileops_mmap(fp, offset, len, prot);
 
-    MVFS_STAT* newst = mvfs_stat_alloc(oldst->name, oldst->uid, oldst->gid);
-    newst->mode  = oldst->mode;
-    newst->size  = oldst->size;
-    newst->atime = oldst->atime;
-    newst->mtime = oldst->mtime;
-    newst->ctime = oldst->ctime;
-    return newst;
+    return fp->ops.mmap(fp, offset, len, prot);
+}
+
+int mvfs_file_unmap (MVFS_FILE* fp, void* addr, size_t len)
+{
+    if (fp==NULL)
+	return -EFAULT;
+    if (addr==NULL)
+	return 0;
+    if (fp->ops.munmap == NULL)
+	return mvfs_default_fileops_munmap(fp, addr, len);
+
+    return fp->ops.munmap(fp, addr, len);
+}
+
+int mvfs_file_setflag (MVFS_FILE* fp, MVFS_FILE_FLAG flag, long value)
+{
+    if (fp==NULL)
+	return -EFAULT;
+    if (fp->ops.setflag == NULL)
+	return mvfs_default_fileops_setflag(fp, flag, value);
+    return fp->ops.setflag(fp, flag, value);
 }
 
-MVFS_STAT* mvfs_stat_alloc(const char* name, const char* uid, const char* gid)
+int mvfs_file_getflag (MVFS_FILE* fp, MVFS_FILE_FLAG flag, long* value)
 {
-    MVFS_STAT* stat = (MVFS_STAT*)calloc(1,sizeof(MVFS_STAT));
-    stat->name = strdup(name ? name : "");
-    stat->uid  = strdup(uid  ? uid : "");	
-    stat->gid  = strdup(gid  ? gid : "");
-    return stat;
+    if (fp==NULL)
+	return -EFAULT;
+    if (fp->ops.getflag == NULL)
+	return mvfs_default_fileops_getflag(fp, flag, value);
+    return fp->ops.getflag(fp, flag, value);
 }
 
 MVFS_STAT* mvfs_file_stat(MVFS_FILE* fp)
@@ -225,3 +275,18 @@ int mvfs_file_reset(MVFS_FILE* file)
 
     return file->ops.reset(file);
 }
+
+/*
+   fill stats with up to max next dir entries - the caller has to free
+   them. returns their count, 0 at the end of the directory.
+*/
+ssize_t mvfs_file_scan_batch(MVFS_FILE* file, MVFS_STAT** stats, size_t max)
+{
+    if ((file==NULL) || (stats==NULL))
+	return -EFAULT;
+
+    if (file->ops.scan_batch == NULL)
+	return mvfs_default_fileops_scan_batch(file, stats, max);
+
+    return file->ops.scan_batch(file, stats, max);
+}
@@ -64,23 +64,24 @@ int mvfs_fs_unlink(MVFS_FILESYSTEM* fs, const char* filename)
 int mvfs_fs_ref(MVFS_FILESYSTEM* fs)
 {
     __CHECK_FS(-EFAULT);
-    fs->refcount++;
-    return fs->refcount;
+    return __sync_add_and_fetch(&fs->refcount, 1);
 }
 
 int mvfs_fs_unref(MVFS_FILESYSTEM* fs)
 {
     __CHECK_FS(-EFAULT);
 
-    fs->refcount--;
-    if (fs->refcount>0)
-	return fs->refcount;
+    // files may be opened/closed from several threads
+    int refcount = __sync_sub_and_fetch(&fs->refcount, 1);
+    if (refcount>0)
+	return refcount;
 
     DEBUGMSG("Free'ing filesystem");
 
     if (!(fs->ops.free == NULL))
 	fs->ops.free(fs);
 	
+    free(fs->magic);
     free(fs);
     return 0;
 }
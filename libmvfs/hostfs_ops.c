@@ -11,8 +11,23 @@
     FD private data layout:
 
     id		fd
-    name	filename
+    name	full path (also for files opened via lookup)
     ptr		DIR* pointer
+    status	PRIV_EOF, PRIV_NAMES_ONLY
+    pos		file position while read-ahead or write-behind is active
+
+    uid/gid names are looked up via an process-wide cache, refreshed
+    after idcache_ttl seconds - NSS lookups can be slow (LDAP etc).
+
+    With dirfd_cache set, path operations work relative to an cached fd
+    of the parent directory (openat(), fstatat() etc), so the kernel
+    doesn't walk the whole path again each time. Parent fds are opened
+    relative to their own parents, LRU-evicted beyond dirfd_cache entries.
+    A cached directory removed meanwhile is noticed (and the call retried
+    by full path), but one renamed or swapped (eg. via symlink) by someone
+    else is still used until evicted - so creates, mkdir, unlink etc could
+    silently hit the old directory. That's why it's off by default, only
+    enable it for trees nobody else moves around.
 */
 
 #include "mvfs-internal.h"
@@ -22,6 +37,10 @@
 #define PRIV_FD(file)			(file->priv.id)
 #define PRIV_NAME(file)			(file->priv.name)
 #define PRIV_DIRP(file)			((DIR*)(file->priv.ptr))
+#define PRIV_POSITIONAL(file)		((file->readahead) || (file->writebehind))
+
+#define PRIV_EOF			1
+#define PRIV_NAMES_ONLY			2	// SCAN_NAMES_ONLY set
 
 #define PRIV_SET_FD(file,fd)	 	file->priv.id = fd;
 #define PRIV_SET_NAME(file,name)	file->priv.name = strdup(name)
@@ -32,8 +51,13 @@
 #include <mvfs/hostfs.h>
 #include <mvfs/_utils.h>
 
+#include "readahead.h"
+#include "writebehind.h"
+
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <stdio.h>
@@ -43,15 +67,82 @@
 #include <string.h>
 #include <pwd.h>
 #include <grp.h>
+#include <time.h>
+#include <malloc.h>
+#include <stdlib.h>
+#include <pthread.h>
 
 #define FS_MAGIC 	"hostfs"
 
+// buffer size for write-behind
+#define HOSTFS_WB_BUFSIZE	65536
+
+// default refresh interval for cached uid/gid names (seconds)
+#define HOSTFS_IDCACHE_TTL	300
+#define HOSTFS_IDCACHE_BUCKETS	256	// must be an power of 2
+
+// default number of cached directory fds - off, see above
+#define HOSTFS_DIRFD_MAX	0
+#define HOSTFS_DIRFD_BUCKETS	64	// must be an power of 2
+
+typedef struct __hostfs_dirfd HOSTFS_DIRFD;
+
+struct __hostfs_dirfd
+{
+    HOSTFS_DIRFD* next;			// hash chain
+    HOSTFS_DIRFD* newer;		// LRU list
+    HOSTFS_DIRFD* older;
+    unsigned      hash;
+    int           fd;
+    int           users;		// not closed while in use
+    int           dead;			// dropped from the cache, close when unused
+    char          path[];
+};
+
+typedef struct
+{
+    long            idcache_ttl;	// 0 = don't cache
+    int             dirfd_max;		// 0 = don't cache directory fds
+    int             dirfd_count;
+    pthread_mutex_t dirfd_lock;
+    HOSTFS_DIRFD*   dirfd_newest;
+    HOSTFS_DIRFD*   dirfd_oldest;
+    HOSTFS_DIRFD*   dirfd_buckets[HOSTFS_DIRFD_BUCKETS];
+} HOSTFS_FS_PRIV;
+
+typedef struct __hostfs_idname HOSTFS_IDNAME;
+
+struct __hostfs_idname
+{
+    unsigned       id;
+    const char*    name;		// pooled, never freed
+    time_t         fetched;
+    HOSTFS_IDNAME* next;
+};
+
+typedef struct
+{
+    pthread_rwlock_t lock;
+    HOSTFS_IDNAME*   buckets[HOSTFS_IDCACHE_BUCKETS];
+} HOSTFS_IDCACHE;
+
+static HOSTFS_IDCACHE _users  = { .lock = PTHREAD_RWLOCK_INITIALIZER };
+static HOSTFS_IDCACHE _groups = { .lock = PTHREAD_RWLOCK_INITIALIZER };
+
 static int        mvfs_hostfs_fileops_open    (MVFS_FILE* file, mode_t mode);
 static off64_t    mvfs_hostfs_fileops_seek    (MVFS_FILE* file, off64_t offset, int whence);
 static ssize_t    mvfs_hostfs_fileops_read    (MVFS_FILE* file, void* buf, size_t count);
 static ssize_t    mvfs_hostfs_fileops_write   (MVFS_FILE* file, const void* buf, size_t count);
+static ssize_t    mvfs_hostfs_fileops_read_into (MVFS_FILE* file, const void** data, size_t count);
+static int        mvfs_hostfs_fileops_release (MVFS_FILE* file, const void* data);
 static ssize_t    mvfs_hostfs_fileops_pread   (MVFS_FILE* file, void* buf, size_t count, off64_t offset);
 static ssize_t    mvfs_hostfs_fileops_pwrite  (MVFS_FILE* file, const void* buf, size_t count, off64_t offset);
+static ssize_t    mvfs_hostfs_fileops_readv   (MVFS_FILE* file, const struct iovec* iov, int iovcnt);
+static ssize_t    mvfs_hostfs_fileops_writev  (MVFS_FILE* file, const struct iovec* iov, int iovcnt);
+static ssize_t    mvfs_hostfs_fileops_preadv  (MVFS_FILE* file, const struct iovec* iov, int iovcnt, off64_t offset);
+static ssize_t    mvfs_hostfs_fileops_pwritev (MVFS_FILE* file, const struct iovec* iov, int iovcnt, off64_t offset);
+static void*      mvfs_hostfs_fileops_mmap    (MVFS_FILE* file, off64_t offset, size_t len, int prot);
+static int        mvfs_hostfs_fileops_munmap  (MVFS_FILE* file, void* addr, size_t len);
 static int        mvfs_hostfs_fileops_setflag (MVFS_FILE* file, MVFS_FILE_FLAG flag, long value);
 static int        mvfs_hostfs_fileops_getflag (MVFS_FILE* file, MVFS_FILE_FLAG flag, long* value);
 static MVFS_STAT* mvfs_hostfs_fileops_stat    (MVFS_FILE* file);
@@ -59,6 +150,7 @@ static int        mvfs_hostfs_fileops_close   (MVFS_FILE* file);
 static int        mvfs_hostfs_fileops_eof     (MVFS_FILE* file);
 static MVFS_FILE* mvfs_hostfs_fileops_lookup  (MVFS_FILE* file, const char* name);
 static MVFS_STAT* mvfs_hostfs_fileops_scan    (MVFS_FILE* file);
+static ssize_t    mvfs_hostfs_fileops_scan_batch (MVFS_FILE* file, MVFS_STAT** stats, size_t max);
 static int        mvfs_hostfs_fileops_reset   (MVFS_FILE* file);
 
 static MVFS_FILE_OPS hostfs_fileops = 
@@ -67,12 +159,23 @@ static MVFS_FILE_OPS hostfs_fileops =
     .read	= mvfs_hostfs_fileops_read,
     .write	= mvfs_hostfs_fileops_write,
     .pread	= mvfs_hostfs_fileops_pread,
+    .read_into	= mvfs_hostfs_fileops_read_into,
+    .release	= mvfs_hostfs_fileops_release,
     .pwrite	= mvfs_hostfs_fileops_pwrite,
+    .readv	= mvfs_hostfs_fileops_readv,
+    .writev	= mvfs_hostfs_fileops_writev,
+    .preadv	= mvfs_hostfs_fileops_preadv,
+    .pwritev	= mvfs_hostfs_fileops_pwritev,
+    .mmap	= mvfs_hostfs_fileops_mmap,
+    .munmap	= mvfs_hostfs_fileops_munmap,
+    .setflag	= mvfs_hostfs_fileops_setflag,
+    .getflag	= mvfs_hostfs_fileops_getflag,
     .close	= mvfs_hostfs_fileops_close,
     .eof        = mvfs_hostfs_fileops_eof,
     .lookup     = mvfs_hostfs_fileops_lookup,
     .reset      = mvfs_hostfs_fileops_reset,
     .scan       = mvfs_hostfs_fileops_scan,
+    .scan_batch = mvfs_hostfs_fileops_scan_batch,
     .stat	= mvfs_hostfs_fileops_stat
 };
 
@@ -91,34 +194,133 @@ static MVFS_FILESYSTEM_OPS hostfs_fsops =
     .stat     = mvfs_hostfs_fsops_stat,
     .mkdir    = mvfs_hostfs_fsops_mkdir,
     .chmod    = mvfs_hostfs_fsops_chmod,
-    .readlink = mvfs_hostfs_fsops_readlink
+    .readlink = mvfs_hostfs_fsops_readlink,
+    .free     = mvfs_hostfs_fsops_free
 };
 
 static off64_t mvfs_hostfs_fileops_seek (MVFS_FILE* file, off64_t offset, int whence)
 {
+    if (PRIV_POSITIONAL(file))
+    {
+	if ((whence == SEEK_END) && (mvfs_writebehind_barrier(file, file->priv.pos) < 0))
+	    return (off64_t)-1;
+	if (whence == SEEK_CUR)
+	{
+	    offset += file->priv.pos;
+	    whence  = SEEK_SET;
+	}
+    }
+
     off_t ret = lseek(PRIV_FD(file), offset, whence);
     file->errcode = errno;
+    if (ret >= 0)
+	file->priv.pos = ret;
     return ret;
 }
 
+// fetch handler for the read-ahead engine - must not touch the fd position
+static ssize_t mvfs_hostfs_readahead_fetch (MVFS_FILE* file, void* buf, size_t count, off64_t offset)
+{
+    return pread64(PRIV_FD(file), buf, count, offset);
+}
+
+// flush handler for the write-behind engine - must not touch the fd position
+static ssize_t mvfs_hostfs_writebehind_flush (MVFS_FILE* file, const void* buf, size_t count, off64_t offset)
+{
+    return pwrite64(PRIV_FD(file), buf, count, offset);
+}
+
+static ssize_t mvfs_hostfs_positional_pread (MVFS_FILE* file, void* buf, size_t count, off64_t offset)
+{
+    if (mvfs_writebehind_barrier(file, file->priv.pos) < 0)
+	return -1;
+
+    if (file->readahead)
+	return mvfs_readahead_pread(file, buf, count, offset);
+
+    ssize_t s = pread64(PRIV_FD(file), buf, count, offset);
+    file->errcode = errno;
+    return s;
+}
+
+static ssize_t mvfs_hostfs_positional_pwrite (MVFS_FILE* file, const void* buf, size_t count, off64_t offset)
+{
+    if (file->writebehind)
+	return mvfs_writebehind_pwrite(file, buf, count, offset);
+
+    ssize_t s = pwrite64(PRIV_FD(file), buf, count, offset);
+    file->errcode = errno;
+    mvfs_readahead_invalidate(file, file->priv.pos);
+    return s;
+}
+
 static ssize_t mvfs_hostfs_fileops_read (MVFS_FILE* file, void* buf, size_t count)
 {
-    memset(buf, 0, count);
+    if (PRIV_POSITIONAL(file))
+    {
+	ssize_t s = mvfs_hostfs_positional_pread(file, buf, count, file->priv.pos);
+	if (s>0)
+	    file->priv.pos += s;
+	else if (s==0)
+	    file->priv.status |= PRIV_EOF;
+	return s;
+    }
+
     ssize_t s = read(PRIV_FD(file), buf, count);
     file->errcode = errno;
     if (s==0)
-	file->priv.status = 1;
+	file->priv.status |= PRIV_EOF;
+    return s;
+}
+
+// we can only lend from the read-ahead window
+static ssize_t mvfs_hostfs_fileops_read_into (MVFS_FILE* file, const void** data, size_t count)
+{
+    if (file->readahead == NULL)
+	return mvfs_default_fileops_read_into(file, data, count);
+
+    if (mvfs_writebehind_barrier(file, file->priv.pos) < 0)
+	return -1;
+
+    ssize_t s = mvfs_readahead_lend(file, data, count, file->priv.pos);
+    if (s>0)
+	file->priv.pos += s;
+    else if (s==0)
+	file->priv.status |= PRIV_EOF;
     return s;
 }
 
+static int mvfs_hostfs_fileops_release (MVFS_FILE* file, const void* data)
+{
+    if (mvfs_readahead_release(file, data))
+	return 0;
+    return mvfs_default_fileops_release(file, data);
+}
+
 static ssize_t mvfs_hostfs_fileops_pread (MVFS_FILE* file, void* buf, size_t count, off64_t offset)
 {
-    mvfs_hostfs_fileops_seek(file, offset, SEEK_SET);
-    return mvfs_hostfs_fileops_read(file, buf, count);
+    if (PRIV_POSITIONAL(file))
+	return mvfs_hostfs_positional_pread(file, buf, count, offset);
+
+    // leaves the fd position alone, so parallel callers on the same
+    // file don't get in each others way - errcode is only touched on
+    // failure for the same reason
+    ssize_t s = pread64(PRIV_FD(file), buf, count, offset);
+    if (s<0)
+	file->errcode = errno;
+    return s;
 }
 
 static ssize_t mvfs_hostfs_fileops_write (MVFS_FILE* file, const void* buf, size_t count)
 {
+    if (PRIV_POSITIONAL(file))
+    {
+	ssize_t s = mvfs_hostfs_positional_pwrite(file, buf, count, file->priv.pos);
+	if (s>0)
+	    file->priv.pos += s;
+	return s;
+    }
+
     ssize_t s = write(PRIV_FD(file), buf, count);
     file->errcode = errno;
     return s;
@@ -126,8 +328,99 @@ static ssize_t mvfs_hostfs_fileops_write (MVFS_FILE* file, const void* buf, size
 
 static ssize_t mvfs_hostfs_fileops_pwrite (MVFS_FILE* file, const void* buf, size_t count, off64_t offset)
 {
-    mvfs_hostfs_fileops_seek(file,offset,SEEK_SET);
-    return mvfs_hostfs_fileops_write(file,buf,count);
+    if (PRIV_POSITIONAL(file))
+	return mvfs_hostfs_positional_pwrite(file, buf, count, offset);
+
+    ssize_t s = pwrite64(PRIV_FD(file), buf, count, offset);
+    if (s<0)
+	file->errcode = errno;
+    return s;
+}
+
+// with read-ahead or write-behind active, the vector gets split up
+// and goes through the engines via the default handlers
+
+static ssize_t mvfs_hostfs_fileops_readv (MVFS_FILE* file, const struct iovec* iov, int iovcnt)
+{
+    if (PRIV_POSITIONAL(file))
+	return mvfs_default_fileops_readv(file, iov, iovcnt);
+
+    ssize_t s = readv(PRIV_FD(file), iov, iovcnt);
+    file->errcode = errno;
+    if ((s==0) && (iovcnt > 0))
+	file->priv.status |= PRIV_EOF;
+    return s;
+}
+
+static ssize_t mvfs_hostfs_fileops_writev (MVFS_FILE* file, const struct iovec* iov, int iovcnt)
+{
+    if (PRIV_POSITIONAL(file))
+	return mvfs_default_fileops_writev(file, iov, iovcnt);
+
+    ssize_t s = writev(PRIV_FD(file), iov, iovcnt);
+    file->errcode = errno;
+    return s;
+}
+
+static ssize_t mvfs_hostfs_fileops_preadv (MVFS_FILE* file, const struct iovec* iov, int iovcnt, off64_t offset)
+{
+    if (PRIV_POSITIONAL(file))
+	return mvfs_default_fileops_preadv(file, iov, iovcnt, offset);
+
+    ssize_t s = preadv64(PRIV_FD(file), iov, iovcnt, offset);
+    if (s<0)
+	file->errcode = errno;
+    return s;
+}
+
+static ssize_t mvfs_hostfs_fileops_pwritev (MVFS_FILE* file, const struct iovec* iov, int iovcnt, off64_t offset)
+{
+    if (PRIV_POSITIONAL(file))
+	return mvfs_default_fileops_pwritev(file, iov, iovcnt, offset);
+
+    ssize_t s = pwritev64(PRIV_FD(file), iov, iovcnt, offset);
+    if (s<0)
+	file->errcode = errno;
+    return s;
+}
+
+// mmap(2) wants an page aligned offset - map from the page start and
+// hand out an pointer into it, munmap() rounds back down
+static void* mvfs_hostfs_fileops_mmap (MVFS_FILE* file, off64_t offset, size_t len, int prot)
+{
+    size_t page  = sysconf(_SC_PAGESIZE);
+    size_t delta = offset % page;
+
+    // pending writes have to reach the file first
+    if (mvfs_writebehind_barrier(file, file->priv.pos) < 0)
+	return NULL;
+
+    char* base = mmap64(NULL, len+delta, prot, MAP_SHARED, PRIV_FD(file), offset-delta);
+    if (base == MAP_FAILED)
+    {
+	file->errcode = errno;
+	return NULL;
+    }
+
+    // we're mostly used for scanning through files
+    madvise(base, len+delta, MADV_SEQUENTIAL);
+    return base+delta;
+}
+
+static int mvfs_hostfs_fileops_munmap (MVFS_FILE* file, void* addr, size_t len)
+{
+    size_t page  = sysconf(_SC_PAGESIZE);
+    size_t delta = (uintptr_t)addr % page;
+
+    if (munmap((char*)addr-delta, len+delta) < 0)
+    {
+	file->errcode = errno;
+	return -1;
+    }
+
+    // read-ahead window might be stale now
+    mvfs_readahead_invalidate(file, file->priv.pos);
+    return 0;
 }
 
 static inline const char* __mvfs_flag2str(MVFS_FILE_FLAG f)
@@ -139,38 +432,200 @@ static inline const char* __mvfs_flag2str(MVFS_FILE_FLAG f)
 	case WRITE_TIMEOUT:	return "WRITE_TIMEOUT";
 	case READ_AHEAD:	return "READ_AHEAD";
 	case WRITE_ASYNC:	return "WRITE_ASYNNC";
+	case READ_AHEAD_HITS:	return "READ_AHEAD_HITS";
+	case READ_AHEAD_MISSES:	return "READ_AHEAD_MISSES";
+	case READ_PIPELINE:	return "READ_PIPELINE";
+	case SCAN_NAMES_ONLY:	return "SCAN_NAMES_ONLY";
 	default:		return "UNKNOWN";
     }
 }
 
+// take over the position from the fd before the first engine is started
+static int mvfs_hostfs_enter_positional(MVFS_FILE* fp)
+{
+    if (PRIV_POSITIONAL(fp))
+	return 0;
+
+    off_t pos = lseek(PRIV_FD(fp), 0, SEEK_CUR);
+    if (pos < 0)
+    {
+	fp->errcode = errno;
+	return -1;
+    }
+    fp->priv.pos = pos;
+    return 0;
+}
+
+// hand the position back to the fd after the last engine has been stopped
+static void mvfs_hostfs_leave_positional(MVFS_FILE* fp)
+{
+    if (!PRIV_POSITIONAL(fp))
+	lseek(PRIV_FD(fp), fp->priv.pos, SEEK_SET);
+}
+
 static int mvfs_hostfs_fileops_setflag (MVFS_FILE* fp, MVFS_FILE_FLAG flag, long value)
 {
-    ERRMSG("%s not supported", __mvfs_flag2str(flag));
-    fp->errcode = EINVAL;
-    return -1;
+    int ret;
+
+    switch (flag)
+    {
+	case READ_AHEAD:
+	    if (value <= 0)
+	    {
+		if (fp->readahead == NULL)
+		    return 0;
+		mvfs_readahead_stop(fp);
+		mvfs_hostfs_leave_positional(fp);
+		return 0;
+	    }
+	    if (mvfs_hostfs_enter_positional(fp) < 0)
+		return -1;
+	    ret = mvfs_readahead_start(fp, mvfs_hostfs_readahead_fetch, value, fp->priv.pos);
+	break;
+
+	case WRITE_ASYNC:
+	    if (value <= 0)
+	    {
+		if (fp->writebehind == NULL)
+		    return 0;
+		ret = mvfs_writebehind_stop(fp);
+		mvfs_hostfs_leave_positional(fp);
+		return ret;
+	    }
+	    if (mvfs_hostfs_enter_positional(fp) < 0)
+		return -1;
+	    ret = mvfs_writebehind_start(fp, mvfs_hostfs_writebehind_flush, HOSTFS_WB_BUFSIZE, value);
+	break;
+
+	case SCAN_NAMES_ONLY:
+	    if (value > 0)
+		fp->priv.status |= PRIV_NAMES_ONLY;
+	    else
+		fp->priv.status &= ~PRIV_NAMES_ONLY;
+	    return 0;
+
+	default:
+	    ERRMSG("%s not supported", __mvfs_flag2str(flag));
+	    fp->errcode = EINVAL;
+	    return -1;
+    }
+
+    if (ret < 0)
+    {
+	fp->errcode = -ret;
+	return -1;
+    }
+    return 0;
 }
 
 static int mvfs_hostfs_fileops_getflag (MVFS_FILE* fp, MVFS_FILE_FLAG flag, long* value)
 {
+    if (mvfs_readahead_getflag(fp, flag, value))
+	return 0;
+    if (mvfs_writebehind_getflag(fp, flag, value))
+	return 0;
+    if (flag == SCAN_NAMES_ONLY)
+    {
+	if (value)
+	    *value = ((fp->priv.status & PRIV_NAMES_ONLY) ? 1 : 0);
+	return 0;
+    }
+
     ERRMSG("%s not supported", __mvfs_flag2str(flag));
     fp->errcode = EINVAL;
     return -1;
 }
 
-static MVFS_STAT* mvfs_stat_from_unix(const char* name, struct stat s)
+// ask NSS for an user or group name - reentrant, unlike getpwuid()
+static const char* _idcache_fetch(HOSTFS_IDCACHE* cache, unsigned id)
+{
+    long bufsize = sysconf((cache == &_users) ? _SC_GETPW_R_SIZE_MAX : _SC_GETGR_R_SIZE_MAX);
+    if (bufsize <= 0)
+	bufsize = 1024;
+
+    const char* name = NULL;
+    while (1)
+    {
+	char* buf = malloc(bufsize);
+	if (buf == NULL)
+	    return "???";
+
+	int ret;
+	if (cache == &_users)
+	{
+	    struct passwd pw, *res = NULL;
+	    if (((ret = getpwuid_r(id, &pw, buf, bufsize, &res)) == 0) && (res))
+		name = mvfs_stat_intern(pw.pw_name);
+	}
+	else
+	{
+	    struct group gr, *res = NULL;
+	    if (((ret = getgrgid_r(id, &gr, buf, bufsize, &res)) == 0) && (res))
+		name = mvfs_stat_intern(gr.gr_name);
+	}
+	free(buf);
+
+	if ((ret == ERANGE) && (bufsize < 1024*1024))
+	    bufsize *= 2;
+	else
+	    break;
+    }
+
+    return (name ? name : "???");
+}
+
+static const char* _idcache_get(HOSTFS_IDCACHE* cache, unsigned id, long ttl)
 {
-    struct passwd* pw = getpwuid(s.st_uid);
-    struct group*  gr = getgrgid(s.st_gid);
+    if (ttl <= 0)
+	return _idcache_fetch(cache, id);
+
+    time_t now = time(NULL);
+    HOSTFS_IDNAME* ent;
+    const char* name = NULL;
+
+    pthread_rwlock_rdlock(&cache->lock);
+    for (ent=cache->buckets[id & (HOSTFS_IDCACHE_BUCKETS-1)]; ent; ent=ent->next)
+	if (ent->id == id)
+	    break;
+    if ((ent) && (now - ent->fetched < ttl))
+	name = ent->name;
+    pthread_rwlock_unlock(&cache->lock);
+    if (name)
+	return name;
 
-    const char* uid="???";
-    const char* gid="???";
+    // unknown or outdated - the lookup may be slow, so no lock held
+    name = _idcache_fetch(cache, id);
 
-    if (pw)
-	uid = pw->pw_name;
-    if (gr)
-	gid = gr->gr_name;
+    pthread_rwlock_wrlock(&cache->lock);
+    for (ent=cache->buckets[id & (HOSTFS_IDCACHE_BUCKETS-1)]; ent; ent=ent->next)
+	if (ent->id == id)
+	    break;
+    if ((ent == NULL) && ((ent = malloc(sizeof(HOSTFS_IDNAME)))))
+    {
+	ent->id   = id;
+	ent->next = cache->buckets[id & (HOSTFS_IDCACHE_BUCKETS-1)];
+	cache->buckets[id & (HOSTFS_IDCACHE_BUCKETS-1)] = ent;
+    }
+    if (ent)
+    {
+	ent->name    = name;
+	ent->fetched = now;
+    }
+    pthread_rwlock_unlock(&cache->lock);
+    return name;
+}
+
+static MVFS_STAT* mvfs_stat_from_unix(MVFS_FILESYSTEM* fs, const char* name, struct stat s)
+{
+    HOSTFS_FS_PRIV* fspriv = (HOSTFS_FS_PRIV*)(fs->priv.ptr);
+    long ttl = (fspriv ? fspriv->idcache_ttl : HOSTFS_IDCACHE_TTL);
+
+    const char* uid = _idcache_get(&_users,  s.st_uid, ttl);
+    const char* gid = _idcache_get(&_groups, s.st_gid, ttl);
 
     MVFS_STAT* mstat = mvfs_stat_alloc(name, uid, gid);
+    if (mstat == NULL)
+	return NULL;
     mstat->mode  = s.st_mode;
     mstat->size  = s.st_size;
     mstat->atime = s.st_atime;
@@ -182,6 +637,9 @@ static MVFS_STAT* mvfs_stat_from_unix(const char* name, struct stat s)
 
 static MVFS_STAT* mvfs_hostfs_fileops_stat(MVFS_FILE* fp)
 {
+    if (mvfs_writebehind_flush(fp) < 0)
+	return NULL;
+
     struct stat ust;
     int ret = fstat(PRIV_FD(fp), &ust);
 
@@ -191,12 +649,238 @@ static MVFS_STAT* mvfs_hostfs_fileops_stat(MVFS_FILE* fp)
 	return NULL;
     }
 
-    return mvfs_stat_from_unix(PRIV_NAME(fp), ust);
+    return mvfs_stat_from_unix(fp->fs, PRIV_NAME(fp), ust);
+}
+
+static unsigned _dirfd_hash(const char* path, size_t len)
+{
+    unsigned h = 2166136261u;
+    while (len--)
+	h = (h ^ (unsigned char)*path++) * 16777619u;
+    return h;
+}
+
+// lock held for all the _dirfd_*() helpers below, unless noted
+static HOSTFS_DIRFD* _dirfd_find(HOSTFS_FS_PRIV* fspriv, const char* path, size_t len, unsigned hash)
+{
+    HOSTFS_DIRFD* ent;
+    for (ent=fspriv->dirfd_buckets[hash & (HOSTFS_DIRFD_BUCKETS-1)]; ent; ent=ent->next)
+	if ((ent->hash == hash) && (!strncmp(ent->path, path, len)) && (ent->path[len] == 0))
+	    return ent;
+    return NULL;
+}
+
+static void _dirfd_lru_remove(HOSTFS_FS_PRIV* fspriv, HOSTFS_DIRFD* ent)
+{
+    if (ent->newer)
+	ent->newer->older = ent->older;
+    else
+	fspriv->dirfd_newest = ent->older;
+    if (ent->older)
+	ent->older->newer = ent->newer;
+    else
+	fspriv->dirfd_oldest = ent->newer;
+    ent->newer = ent->older = NULL;
+}
+
+static void _dirfd_lru_push(HOSTFS_FS_PRIV* fspriv, HOSTFS_DIRFD* ent)
+{
+    ent->newer = NULL;
+    ent->older = fspriv->dirfd_newest;
+    if (ent->older)
+	ent->older->newer = ent;
+    else
+	fspriv->dirfd_oldest = ent;
+    fspriv->dirfd_newest = ent;
+}
+
+// drop an entry from the cache - closed now or by the last user
+static void _dirfd_kill(HOSTFS_FS_PRIV* fspriv, HOSTFS_DIRFD* ent)
+{
+    HOSTFS_DIRFD** p;
+    for (p=&fspriv->dirfd_buckets[ent->hash & (HOSTFS_DIRFD_BUCKETS-1)]; *p; p=&((*p)->next))
+	if (*p == ent)
+	{
+	    *p = ent->next;
+	    break;
+	}
+    _dirfd_lru_remove(fspriv, ent);
+    fspriv->dirfd_count--;
+
+    if (ent->users)
+    {
+	ent->dead = 1;
+	return;
+    }
+    close(ent->fd);
+    free(ent);
+}
+
+// close unused entries beyond the limit, least recently used first
+static void _dirfd_evict(HOSTFS_FS_PRIV* fspriv)
+{
+    HOSTFS_DIRFD* ent = fspriv->dirfd_oldest;
+    while ((ent) && (fspriv->dirfd_count > fspriv->dirfd_max))
+    {
+	HOSTFS_DIRFD* newer = ent->newer;
+	if (ent->users == 0)
+	    _dirfd_kill(fspriv, ent);
+	ent = newer;
+    }
+}
+
+// no lock held
+static void _dirfd_put(HOSTFS_FS_PRIV* fspriv, HOSTFS_DIRFD* ent)
+{
+    if (ent == NULL)
+	return;
+
+    pthread_mutex_lock(&fspriv->dirfd_lock);
+    if ((--ent->users == 0) && (ent->dead))
+    {
+	close(ent->fd);
+	free(ent);
+    }
+    else
+	_dirfd_evict(fspriv);
+    pthread_mutex_unlock(&fspriv->dirfd_lock);
+}
+
+static HOSTFS_DIRFD* _dirfd_split(HOSTFS_FS_PRIV* fspriv, const char* path, const char** base);
+
+// no lock held - an fd for the directory path[0..len), to be put back
+static HOSTFS_DIRFD* _dirfd_get(HOSTFS_FS_PRIV* fspriv, const char* path, size_t len)
+{
+    unsigned hash = _dirfd_hash(path, len);
+
+    pthread_mutex_lock(&fspriv->dirfd_lock);
+    HOSTFS_DIRFD* ent = _dirfd_find(fspriv, path, len, hash);
+    if (ent)
+    {
+	ent->users++;
+	_dirfd_lru_remove(fspriv, ent);
+	_dirfd_lru_push(fspriv, ent);
+    }
+    pthread_mutex_unlock(&fspriv->dirfd_lock);
+    if (ent)
+	return ent;
+
+    // not cached yet - open it relative to its parent, which gets cached too
+    if ((ent = malloc(sizeof(HOSTFS_DIRFD)+len+1)) == NULL)
+	return NULL;
+    memcpy(ent->path, path, len);
+    ent->path[len] = 0;
+
+    const char* base;
+    HOSTFS_DIRFD* parent = _dirfd_split(fspriv, ent->path, &base);
+    ent->fd = openat((parent ? parent->fd : AT_FDCWD), base, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    _dirfd_put(fspriv, parent);
+    if (ent->fd < 0)
+    {
+	free(ent);
+	return NULL;
+    }
+    ent->hash  = hash;
+    ent->users = 1;
+    ent->dead  = 0;
+
+    // someone else might have been faster
+    pthread_mutex_lock(&fspriv->dirfd_lock);
+    HOSTFS_DIRFD* found = _dirfd_find(fspriv, path, len, hash);
+    if (found)
+	found->users++;
+    else
+    {
+	ent->next = fspriv->dirfd_buckets[hash & (HOSTFS_DIRFD_BUCKETS-1)];
+	fspriv->dirfd_buckets[hash & (HOSTFS_DIRFD_BUCKETS-1)] = ent;
+	_dirfd_lru_push(fspriv, ent);
+	fspriv->dirfd_count++;
+	_dirfd_evict(fspriv);
+    }
+    pthread_mutex_unlock(&fspriv->dirfd_lock);
+
+    if (found)
+    {
+	close(ent->fd);
+	free(ent);
+	return found;
+    }
+    return ent;
 }
 
+/*
+   no lock held - split path into an cached fd of its parent directory
+   and the name within it. returns NULL (use AT_FDCWD and the whole
+   path) for relative paths, paths ending with an slash, or if there's
+   no parent fd to be had.
+*/
+static HOSTFS_DIRFD* _dirfd_split(HOSTFS_FS_PRIV* fspriv, const char* path, const char** base)
+{
+    *base = path;
+    if ((fspriv == NULL) || (fspriv->dirfd_max <= 0) || (path[0] != '/'))
+	return NULL;
+
+    const char* slash = strrchr(path, '/');
+    if (slash[1] == 0)
+	return NULL;
+
+    HOSTFS_DIRFD* parent = _dirfd_get(fspriv, path, ((slash == path) ? 1 : slash-path));
+    if (parent)
+	*base = slash+1;
+    return parent;
+}
+
+// no lock held - an *at() call failed: retry by path if the parent has been removed meanwhile
+static int _dirfd_stale(HOSTFS_FS_PRIV* fspriv, HOSTFS_DIRFD* ent)
+{
+    int err = errno;
+    struct stat st;
+
+    if ((ent == NULL) || (err != ENOENT) || (fstat(ent->fd, &st) != 0) || (st.st_nlink))
+    {
+	errno = err;
+	return 0;
+    }
+
+    pthread_mutex_lock(&fspriv->dirfd_lock);
+    if (!ent->dead)
+	_dirfd_kill(fspriv, ent);
+    pthread_mutex_unlock(&fspriv->dirfd_lock);
+    return 1;
+}
+
+// no lock held - an directory has been removed: drop it and everything below
+static void _dirfd_drop(HOSTFS_FS_PRIV* fspriv, const char* path)
+{
+    if ((fspriv == NULL) || (fspriv->dirfd_max <= 0))
+	return;
+
+    size_t len = strlen(path);
+    pthread_mutex_lock(&fspriv->dirfd_lock);
+    HOSTFS_DIRFD* ent = fspriv->dirfd_oldest;
+    while (ent)
+    {
+	HOSTFS_DIRFD* newer = ent->newer;
+	if ((!strncmp(ent->path, path, len)) && ((ent->path[len] == 0) || (ent->path[len] == '/')))
+	    _dirfd_kill(fspriv, ent);
+	ent = newer;
+    }
+    pthread_mutex_unlock(&fspriv->dirfd_lock);
+}
+
+#define DIRFD_FD(ent)	((ent) ? (ent)->fd : AT_FDCWD)
+
 static MVFS_FILE* mvfs_hostfs_fsops_open(MVFS_FILESYSTEM* fs, const char* name, mode_t mode)
 {
-    int fd = open(name, mode);
+    HOSTFS_FS_PRIV* fspriv = (HOSTFS_FS_PRIV*)(fs->priv.ptr);
+    const char* base;
+    HOSTFS_DIRFD* parent = _dirfd_split(fspriv, name, &base);
+
+    int fd = openat(DIRFD_FD(parent), base, mode);
+    if ((fd<0) && (_dirfd_stale(fspriv, parent)))
+	fd = open(name, mode);
+    _dirfd_put(fspriv, parent);
+
     if (fd<0)
     {
 	fs->errcode = errno;
@@ -226,8 +910,15 @@ static MVFS_STAT* mvfs_hostfs_fsops_stat(MVFS_FILESYSTEM* fs, const char* name)
 	return NULL;
     }
 
+    HOSTFS_FS_PRIV* fspriv = (HOSTFS_FS_PRIV*)(fs->priv.ptr);
+    const char* base;
+    HOSTFS_DIRFD* parent = _dirfd_split(fspriv, name, &base);
+
     struct stat ust;
-    int ret = lstat(name, &ust);
+    int ret = fstatat(DIRFD_FD(parent), base, &ust, AT_SYMLINK_NOFOLLOW);
+    if ((ret!=0) && (_dirfd_stale(fspriv, parent)))
+	ret = lstat(name, &ust);
+    _dirfd_put(fspriv, parent);
 
     if (ret!=0)
     {
@@ -235,16 +926,31 @@ static MVFS_STAT* mvfs_hostfs_fsops_stat(MVFS_FILESYSTEM* fs, const char* name)
 	return NULL;
     }
 
-    return mvfs_stat_from_unix(name, ust);
+    return mvfs_stat_from_unix(fs, name, ust);
 }
 
 static int mvfs_hostfs_fsops_unlink(MVFS_FILESYSTEM* fs, const char* name)
 {
-    int ret = unlink(name);
-    
-    if ((ret != 0) && (errno == EISDIR))
-	ret = rmdir(name);
-	
+    HOSTFS_FS_PRIV* fspriv = (HOSTFS_FS_PRIV*)(fs->priv.ptr);
+    const char* base;
+    HOSTFS_DIRFD* parent = _dirfd_split(fspriv, name, &base);
+
+    int ret = unlinkat(DIRFD_FD(parent), base, 0);
+    if ((ret != 0) && (_dirfd_stale(fspriv, parent)))
+    {
+	_dirfd_put(fspriv, parent);
+	parent = NULL;
+	base = name;
+	ret = unlink(name);
+    }
+
+    int isdir = ((ret != 0) && (errno == EISDIR));
+    if (isdir)
+	ret = unlinkat(DIRFD_FD(parent), base, AT_REMOVEDIR);
+    _dirfd_put(fspriv, parent);
+
+    if ((ret == 0) && (isdir))
+	_dirfd_drop(fspriv, name);
     if (ret == 0)
 	return 0;
 
@@ -255,16 +961,65 @@ static int mvfs_hostfs_fsops_unlink(MVFS_FILESYSTEM* fs, const char* name)
 static int mvfs_hostfs_fsops_mkdir(MVFS_FILESYSTEM* fs, const char* fn, mode_t mode)
 {
     DEBUGMSG("fn=\"%s\"", fn);
-    return mkdir(fn,mode);
+
+    HOSTFS_FS_PRIV* fspriv = (HOSTFS_FS_PRIV*)(fs->priv.ptr);
+    const char* base;
+    HOSTFS_DIRFD* parent = _dirfd_split(fspriv, fn, &base);
+
+    int ret = mkdirat(DIRFD_FD(parent), base, mode);
+    if ((ret != 0) && (_dirfd_stale(fspriv, parent)))
+	ret = mkdir(fn, mode);
+    _dirfd_put(fspriv, parent);
+    return ret;
+}
+
+static int mvfs_hostfs_fsops_free(MVFS_FILESYSTEM* fs)
+{
+    HOSTFS_FS_PRIV* fspriv = (HOSTFS_FS_PRIV*)(fs->priv.ptr);
+    if (fspriv == NULL)
+	return 0;
+
+    // all files are closed by now, so nothing is in use anymore
+    while (fspriv->dirfd_oldest)
+	_dirfd_kill(fspriv, fspriv->dirfd_oldest);
+    pthread_mutex_destroy(&fspriv->dirfd_lock);
+
+    free(fspriv);
+    fs->priv.ptr = NULL;
+    return 0;
+}
+
+static MVFS_FILESYSTEM* _hostfs_create(long idcache_ttl, int dirfd_max)
+{
+    HOSTFS_FS_PRIV* fspriv = calloc(1,sizeof(HOSTFS_FS_PRIV));
+    if (fspriv == NULL)
+    {
+	ERRMSG("out of memory");
+	return NULL;
+    }
+    fspriv->idcache_ttl = idcache_ttl;
+    fspriv->dirfd_max   = dirfd_max;
+    pthread_mutex_init(&fspriv->dirfd_lock, NULL);
+
+    MVFS_FILESYSTEM* fs = mvfs_fs_alloc(hostfs_fsops, FS_MAGIC);
+    fs->priv.ptr = fspriv;
+    return fs;
 }
 
 MVFS_FILESYSTEM* mvfs_hostfs_create(MVFS_HOSTFS_PARAM par)
 {
     DEBUGMSG("params currently ignored !");
-    MVFS_FILESYSTEM* fs = mvfs_fs_alloc(hostfs_fsops,FS_MAGIC);
-    return fs;
+    return _hostfs_create(HOSTFS_IDCACHE_TTL, HOSTFS_DIRFD_MAX);
 }
 
+/*
+   args (may be NULL):
+
+     chroot      - not supported yet
+     idcache_ttl - seconds until cached uid/gid names are looked up again (0 = always)
+     dirfd_cache - number of directory fds kept open for relative lookups (default 0 = none)
+                   only safe if no one else renames directories or swaps symlinks within the tree
+*/
 MVFS_FILESYSTEM* mvfs_hostfs_create_args(MVFS_ARGS* args)
 {
     const char* chroot = mvfs_args_get(args,"chroot");
@@ -273,21 +1028,36 @@ MVFS_FILESYSTEM* mvfs_hostfs_create_args(MVFS_ARGS* args)
 	ERRMSG("chroot not supported yet!");
 	return NULL;
     }
-    
-    MVFS_FILESYSTEM* fs = mvfs_fs_alloc(hostfs_fsops, FS_MAGIC);
-    return fs;
+
+    long ttl = HOSTFS_IDCACHE_TTL;
+    const char* val = mvfs_args_get(args,"idcache_ttl");
+    if (val)
+	ttl = strtol(val, NULL, 10);
+
+    int dirfd_max = HOSTFS_DIRFD_MAX;
+    if ((val = mvfs_args_get(args,"dirfd_cache")))
+	dirfd_max = atoi(val);
+
+    return _hostfs_create(ttl, dirfd_max);
 }
 
 static int mvfs_hostfs_fileops_close(MVFS_FILE* file)
 {
+    int wret = mvfs_writebehind_stop(file);
+    mvfs_readahead_stop(file);
+    if (PRIV_DIRP(file))
+	closedir(PRIV_DIRP(file));
+    PRIV_SET_DIRP(file,NULL);
     int ret = close(PRIV_FD(file));
     file->priv.id = -1;
-    return ret;
+    free((char*)PRIV_NAME(file));
+    file->priv.name = NULL;
+    return ((wret < 0) ? -1 : ret);
 }
 
 static int mvfs_hostfs_fileops_eof(MVFS_FILE* file)
 {
-    return ((file->priv.status) ? 1 : 0);
+    return ((file->priv.status & PRIV_EOF) ? 1 : 0);
 }
 
 static MVFS_FILE* mvfs_hostfs_fileops_lookup  (MVFS_FILE* file, const char* name)
@@ -297,9 +1067,16 @@ static MVFS_FILE* mvfs_hostfs_fileops_lookup  (MVFS_FILE* file, const char* name
 	return NULL;
 
     MVFS_FILE* f2 = mvfs_file_alloc(file->fs,hostfs_fileops);
-    f2->priv.name = strdup(name);
     f2->priv.id   = fd;
 
+    // the full path, as if opened by name
+    const char* dirname = (PRIV_NAME(file) ? PRIV_NAME(file) : "");
+    size_t len = strlen(dirname);
+    char* path = malloc(len+strlen(name)+2);
+    if (path)
+	sprintf(path, (((len) && (dirname[len-1] != '/')) ? "%s/%s" : "%s%s"), dirname, name);
+    f2->priv.name = path;
+
     return f2;
 }
 
@@ -308,39 +1085,97 @@ static DIR* mvfs_hostfs_fileops_init_dir(MVFS_FILE* file)
     DIR* dir = PRIV_DIRP(file);
     if (dir != NULL)
 	return dir;
-    
-    dup(PRIV_FD(file));
 
-    dir = fdopendir(1);
+    // the DIR takes over its fd - closedir() must not close ours
+    int fd = dup(PRIV_FD(file));
+    if (fd < 0)
+	return NULL;
+    if ((dir = fdopendir(fd)) == NULL)
+    {
+	close(fd);
+	return NULL;
+    }
 
-    dir = fdopendir(dup(PRIV_FD(file)));
     PRIV_SET_DIRP(file,dir);
     return dir;
 }
 
+/*
+   next dir entry - NULL at the end. entries are stat'ed relative to the
+   directory, or if only names are asked for, just typed by d_type.
+*/
+static MVFS_STAT* mvfs_hostfs_scan_next(MVFS_FILE* file, DIR* dir)
+{
+    struct dirent* ent;
+    struct stat st;
+
+    // readdir() only tells errors from the end by errno
+    file->errcode = 0;
+    errno = 0;
+    while ((ent = readdir(dir)))
+    {
+	if ((ent->d_name[0] == '.') && ((ent->d_name[1] == 0) ||
+	    ((ent->d_name[1] == '.') && (ent->d_name[2] == 0))))
+	    continue;
+
+	if ((file->priv.status & PRIV_NAMES_ONLY) && (ent->d_type != DT_UNKNOWN))
+	{
+	    MVFS_STAT* s = mvfs_stat_alloc(ent->d_name, NULL, NULL);
+	    if (s)
+		s->mode = DTTOIF(ent->d_type);
+	    return s;
+	}
+
+	// vanished meanwhile
+	if (fstatat(dirfd(dir), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+	{
+	    errno = 0;
+	    continue;
+	}
+
+	return mvfs_stat_from_unix(file->fs, ent->d_name, st);
+    }
+
+    file->errcode = errno;
+    return NULL;
+}
+
 static MVFS_STAT* mvfs_hostfs_fileops_scan(MVFS_FILE* file)
 {
     DIR* dir = mvfs_hostfs_fileops_init_dir(file);
     if (dir==NULL)
     {
 	ERRMSG("cannot get DIR* ptr");
+	file->errcode = EBADF;
 	return NULL;
     }
 
-    struct dirent * ent = readdir(dir);
-    if (ent == NULL)
-	return 0;
+    return mvfs_hostfs_scan_next(file, dir);
+}
 
-    if ((strcmp(ent->d_name,".")==0) || (strcmp(ent->d_name,"..")==0))
-	return mvfs_hostfs_fileops_scan(file);
+// readdir() already fetches many entries per getdents64() call
+static ssize_t mvfs_hostfs_fileops_scan_batch(MVFS_FILE* file, MVFS_STAT** stats, size_t max)
+{
+    DIR* dir = mvfs_hostfs_fileops_init_dir(file);
+    if (dir==NULL)
+    {
+	ERRMSG("cannot get DIR* ptr");
+	file->errcode = EBADF;
+	return -1;
+    }
 
-    struct stat st;
-    char buffer[4096];
-    memset(buffer,0,sizeof(buffer));
-    snprintf(buffer,sizeof(buffer)-1,"%s/%s", PRIV_NAME(file),ent->d_name);
-    lstat(buffer,&st);
+    size_t count = 0;
+    MVFS_STAT* s;
+    while ((count < max) && ((s = mvfs_hostfs_scan_next(file, dir))))
+	stats[count++] = s;
 
-    return mvfs_stat_from_unix(ent->d_name, st);
+    if ((count < max) && (file->errcode))
+    {
+	while (count)
+	    mvfs_stat_free(stats[--count]);
+	return -1;
+    }
+    return count;
 }
 
 static int mvfs_hostfs_fileops_reset(MVFS_FILE* file)
@@ -358,15 +1193,39 @@ static int mvfs_hostfs_fileops_reset(MVFS_FILE* file)
 
 static int mvfs_hostfs_fsops_chmod(MVFS_FILESYSTEM* fs, const char* name, mode_t mode)
 {
-    return chmod(name, mode);
+    HOSTFS_FS_PRIV* fspriv = (HOSTFS_FS_PRIV*)(fs->priv.ptr);
+    const char* base;
+    HOSTFS_DIRFD* parent = _dirfd_split(fspriv, name, &base);
+
+    int ret = fchmodat(DIRFD_FD(parent), base, mode, 0);
+    if ((ret != 0) && (_dirfd_stale(fspriv, parent)))
+	ret = chmod(name, mode);
+    _dirfd_put(fspriv, parent);
+    return ret;
 }
 
 static MVFS_SYMLINK mvfs_hostfs_fsops_readlink(MVFS_FILESYSTEM* fs, const char* path)
 {
+    HOSTFS_FS_PRIV* fspriv = (HOSTFS_FS_PRIV*)(fs->priv.ptr);
+    const char* base;
+    HOSTFS_DIRFD* parent = _dirfd_split(fspriv, path, &base);
+
     MVFS_SYMLINK link;
-    if (readlink(path, (char*)&link.target, sizeof(link.target)) == -1)
+    // readlink() doesn't terminate the string
+    ssize_t len = readlinkat(DIRFD_FD(parent), base, link.target, sizeof(link.target)-1);
+    if ((len == -1) && (_dirfd_stale(fspriv, parent)))
+	len = readlink(path, link.target, sizeof(link.target)-1);
+    _dirfd_put(fspriv, parent);
+
+    if (len == -1)
+    {
 	link.errcode = errno;
+	link.target[0] = 0;
+    }
     else
+    {
 	link.errcode = 0;
+	link.target[len] = 0;
+    }
     return link;
 }
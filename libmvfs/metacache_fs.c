@@ -3,6 +3,32 @@
 
     Filesystem driver: metadata-caching fs
 
+    Stat records expire after an TTL (monotonic clock), configurable
+    per fs and per path prefix. Lookups of nonexisting files (ENOENT)
+    are cached too, with their own (usually shorter) TTL.
+
+    The cache is bounded by an maximum number of entries and bytes,
+    least recently used records are evicted first (CLOCK style: hits
+    just mark an record, the evictor gives marked ones another round).
+
+    Records are spread over several shards by path hash, each with its
+    own rwlock, so parallel lookups only share an read lock. Concurrent
+    misses on the same path are coalesced into one backend stat.
+
+    Complete directory scans are cached as listings: rescanning replays
+    from memory (the backend file isn't even opened), and stats of the
+    directory's children are answered from the listing - including
+    ENOENT for names not in there.
+
+    readlink() results (and failures like ENOENT/EINVAL) are kept in
+    the same records, with the same TTLs and invalidation.
+
+    All mutating operations are passed through to the backend first,
+    then the affected records (the path, its parent's listing, an
+    rename target and subtree) are dropped - so stats racing with the
+    operation can't put back stale data. Writes just patch size and
+    mtime of the cached stat.
+
     Copyright (C) 2008 Enrico Weigelt, metux IT service <weigelt@metux.de>
     This code is published under the terms of the GNU Public License 2.0
 */
@@ -18,12 +44,16 @@
 #include <errno.h>
 #include <string.h>
 #include <malloc.h>
-#include <hash.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 #include <mvfs/mvfs.h>
 #include <mvfs/stat.h>
 #include <mvfs/default_ops.h>
 #include <mvfs/mixpfs.h>
+#include <mvfs/metacache_ops.h>
 #include <mvfs/_utils.h>
 
 #define	FS_MAGIC	"metux/metacache-fs-1"
@@ -33,6 +63,16 @@ static ssize_t    _mvfs_metacache_fileoppread  (MVFS_FILE* file, void* buf, size
 static ssize_t    _mvfs_metacache_fileoppwrite (MVFS_FILE* file, const void* buf, size_t count, off64_t offset);
 static ssize_t    _mvfs_metacache_fileopread   (MVFS_FILE* file, void* buf, size_t count);
 static ssize_t    _mvfs_metacache_fileopwrite  (MVFS_FILE* file, const void* buf, size_t count);
+static ssize_t    _mvfs_metacache_fileopread_into (MVFS_FILE* file, const void** data, size_t count);
+static int        _mvfs_metacache_fileoprelease(MVFS_FILE* file, const void* data);
+static ssize_t    _mvfs_metacache_fileopreadv  (MVFS_FILE* file, const struct iovec* iov, int iovcnt);
+static ssize_t    _mvfs_metacache_fileopwritev (MVFS_FILE* file, const struct iovec* iov, int iovcnt);
+static ssize_t    _mvfs_metacache_fileoppreadv (MVFS_FILE* file, const struct iovec* iov, int iovcnt, off64_t offset);
+static ssize_t    _mvfs_metacache_fileoppwritev(MVFS_FILE* file, const struct iovec* iov, int iovcnt, off64_t offset);
+static void*      _mvfs_metacache_fileopmmap   (MVFS_FILE* file, off64_t offset, size_t len, int prot);
+static int        _mvfs_metacache_fileopmunmap (MVFS_FILE* file, void* addr, size_t len);
+static int        _mvfs_metacache_fileopsetflag(MVFS_FILE* file, MVFS_FILE_FLAG flag, long value);
+static int        _mvfs_metacache_fileopgetflag(MVFS_FILE* file, MVFS_FILE_FLAG flag, long* value);
 static int        _mvfs_metacache_fileopclose  (MVFS_FILE* file);
 static int        _mvfs_metacache_fileopfree   (MVFS_FILE* file);
 static int        _mvfs_metacache_fileopeof    (MVFS_FILE* file);
@@ -40,6 +80,7 @@ static MVFS_STAT* _mvfs_metacache_fileopstat   (MVFS_FILE* file);
 static MVFS_FILE* _mvfs_metacache_fileoplookup (MVFS_FILE* file, const char* name);
 static MVFS_STAT* _mvfs_metacache_fileopscan   (MVFS_FILE* file);
 static int        _mvfs_metacache_fileopreset  (MVFS_FILE* file);
+static ssize_t    _mvfs_metacache_fileopscanbatch(MVFS_FILE* file, MVFS_STAT** stats, size_t max);
 
 static MVFS_FILE_OPS _fileops = 
 {
@@ -47,13 +88,24 @@ static MVFS_FILE_OPS _fileops =
     .read       = _mvfs_metacache_fileopread,
     .write      = _mvfs_metacache_fileopwrite,
     .pread	= _mvfs_metacache_fileoppread,
+    .read_into	= _mvfs_metacache_fileopread_into,
+    .release	= _mvfs_metacache_fileoprelease,
     .pwrite	= _mvfs_metacache_fileoppwrite,
+    .readv	= _mvfs_metacache_fileopreadv,
+    .writev	= _mvfs_metacache_fileopwritev,
+    .preadv	= _mvfs_metacache_fileoppreadv,
+    .pwritev	= _mvfs_metacache_fileoppwritev,
+    .mmap	= _mvfs_metacache_fileopmmap,
+    .munmap	= _mvfs_metacache_fileopmunmap,
+    .setflag	= _mvfs_metacache_fileopsetflag,
+    .getflag	= _mvfs_metacache_fileopgetflag,
     .close	= _mvfs_metacache_fileopclose,
     .free	= _mvfs_metacache_fileopfree,
     .eof        = _mvfs_metacache_fileopeof,
     .lookup     = _mvfs_metacache_fileoplookup,
     .scan       = _mvfs_metacache_fileopscan,
     .reset      = _mvfs_metacache_fileopreset,
+    .scan_batch = _mvfs_metacache_fileopscanbatch,
     .stat       = _mvfs_metacache_fileopstat
 };
 
@@ -62,6 +114,11 @@ static MVFS_FILE*   _mvfs_metacache_fsop_open     (MVFS_FILESYSTEM* fs, const ch
 static int          _mvfs_metacache_fsop_unlink   (MVFS_FILESYSTEM* fs, const char* name);
 static int          _mvfs_metacache_fsop_chmod    (MVFS_FILESYSTEM* fs, const char* name, mode_t mode);
 static MVFS_SYMLINK _mvfs_metacache_fsop_readlink (MVFS_FILESYSTEM* fs, const char* name);
+static int          _mvfs_metacache_fsop_free     (MVFS_FILESYSTEM* fs);
+static int          _mvfs_metacache_fsop_symlink  (MVFS_FILESYSTEM* fs, const char* n1, const char* n2);
+static int          _mvfs_metacache_fsop_rename   (MVFS_FILESYSTEM* fs, const char* n1, const char* n2);
+static int          _mvfs_metacache_fsop_chown    (MVFS_FILESYSTEM* fs, const char* name, const char* uid, const char* gid);
+static int          _mvfs_metacache_fsop_mkdir    (MVFS_FILESYSTEM* fs, const char* name, mode_t mode);
 
 static MVFS_FILESYSTEM_OPS _fsops = 
 {
@@ -69,26 +126,115 @@ static MVFS_FILESYSTEM_OPS _fsops =
     .unlink	= _mvfs_metacache_fsop_unlink,
     .stat       = _mvfs_metacache_fsop_stat,
     .chmod      = _mvfs_metacache_fsop_chmod,
-    .readlink   = _mvfs_metacache_fsop_readlink
+    .readlink   = _mvfs_metacache_fsop_readlink,
+    .symlink    = _mvfs_metacache_fsop_symlink,
+    .rename     = _mvfs_metacache_fsop_rename,
+    .chown      = _mvfs_metacache_fsop_chown,
+    .mkdir      = _mvfs_metacache_fsop_mkdir,
+    .free       = _mvfs_metacache_fsop_free
+};
+
+// directory listing - shared between the cache and replaying files
+typedef struct
+{
+    int               refs;
+    int               count;
+    int               alloc;
+    size_t            size;		// accounted bytes
+    MVFS_STAT**       entries;		// in backend order
+    int*              sorted;		// entry indices, sorted by name
+} METACACHE_DIR;
+
+typedef struct __metacache_record METACACHE_RECORD;
+
+struct __metacache_record
+{
+    MVFS_STAT*        stat;
+    int               errcode;		// !=0: negative record (file doesn't exist)
+    uint64_t          expires;		// monotonic time in microseconds
+    METACACHE_DIR*    dir;		// complete listing, if it's an directory
+    uint64_t          dir_expires;
+    char*             link_target;	// readlink() result, if cached
+    int               link_errcode;
+    uint64_t          link_expires;
+    unsigned          hash;
+    size_t            size;		// accounted bytes, including the stat
+    int               referenced;	// hit since last seen by the evictor
+    METACACHE_RECORD* next;		// hash chain
+    METACACHE_RECORD* newer;		// LRU list
+    METACACHE_RECORD* older;
+    char              filename[];
+};
+
+typedef struct
+{
+    METACACHE_RECORD** buckets;
+    unsigned           nbuckets;	// always an power of 2
+    METACACHE_RECORD*  newest;
+    METACACHE_RECORD*  oldest;
+    unsigned long      entries;
+    size_t             bytes;		// records only, not the bucket array
+} METACACHE_TABLE;
+
+typedef struct __metacache_pending METACACHE_PENDING;
+
+// an backend stat in flight - other threads missing the same path wait for it
+struct __metacache_pending
+{
+    const char*        filename;
+    unsigned           hash;
+    int                refs;
+    int                done;
+    MVFS_STAT*         stat;
+    int                errcode;
+    METACACHE_PENDING* next;
 };
 
 typedef struct
 {
-    MVFS_STAT* stat;
-    uint64_t   mtime;
-    char*      filename;
-} METACACHE_RECORD;
+    pthread_rwlock_t     lock;		// protects table and generation
+    METACACHE_TABLE      table;
+    unsigned long        generation;	// bumped on invalidation
+    pthread_mutex_t      pending_lock;
+    pthread_cond_t       pending_cond;
+    METACACHE_PENDING*   pending;
+    MVFS_METACACHE_STATS stats;		// counters, updated atomically
+} METACACHE_SHARD;
+
+#define CACHE_SHARDS		16	// must be an power of 2
+
+typedef struct
+{
+    char*      prefix;
+    size_t     len;
+    uint64_t   ttl;
+    uint64_t   neg_ttl;
+} METACACHE_TTL;
 
 typedef struct 
 {
-    MVFS_FILE*   cfid;
-    char*        pathname;
+    MVFS_FILE*     cfid;		// opened on demand if replaying
+    char*          pathname;
+    mode_t         mode;
+    METACACHE_DIR* replay;		// cached listing we're scanning
+    int            replay_pos;
+    METACACHE_DIR* building;		// listing collected from backend scans
+    unsigned long  building_gen;
+    int            scanning;		// scanned since open / last reset
+    int            names_only;		// backend scans give incomplete stats
+    int            mapped_rw;		// has been mapped writable
 } METACACHE_FILE_PRIV;
 
 typedef struct
 {
     MVFS_FILESYSTEM*	fs;    
-    hash		cache;
+    METACACHE_SHARD	shards[CACHE_SHARDS];
+    unsigned long	max_entries;	// per shard, 0 = unlimited
+    size_t		max_bytes;	// per shard, 0 = unlimited
+    uint64_t		ttl;
+    uint64_t		neg_ttl;
+    METACACHE_TTL*	ttls;		// per-prefix overrides
+    int			nttls;
 } METACACHE_FS_PRIV;
 
 #ifdef _MVFS_SANITY_CHECKS
@@ -146,105 +292,957 @@ typedef struct
 
 #endif
 
-// default cache timeout is 5sec (1^6 microseconds)
-#define CACHE_TIMEOUT	(5000000)
+static int _open_backend(MVFS_FILE* file);
+
+// files replaying an cached listing open the backend file on demand
+#define __FILEOPS_CFID(err);					\
+	if ((priv->cfid == NULL) && (_open_backend(file) < 0))	\
+	    return err;
 
+// default TTLs: 5sec for stat records, 1sec for nonexisting files
+#define CACHE_TIMEOUT		(5000000)
+#define CACHE_NEG_TIMEOUT	(1000000)
+
+// monotonic time in microseconds - not affected by wallclock jumps
 static inline uint64_t _curtime()
 {
-    uint64_t t;
-    struct timeval tv;
-    tv.tv_sec  = 0;
-    tv.tv_usec = 0;
-    t = tv.tv_sec*1000000+tv.tv_usec;
-    return t;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec)*1000000+ts.tv_nsec/1000;
 }
 
-static METACACHE_RECORD* _cache_lookup(METACACHE_FS_PRIV* fspriv, const char* filename)
+// TTL for given filename - the longest matching prefix wins
+static uint64_t _cache_ttl(METACACHE_FS_PRIV* fspriv, const char* filename, int negative)
 {
-    METACACHE_RECORD* rec;
-    
-    // FIXME: do a lookup
-    if ((hash_retrieve(&(fspriv->cache), (char*)filename, (void**)&rec)) && (rec!=NULL))
+    METACACHE_TTL* match = NULL;
+    int x;
+
+    for (x=0; x<fspriv->nttls; x++)
+    {
+	METACACHE_TTL* t = &fspriv->ttls[x];
+	if ((match) && (t->len <= match->len))
+	    continue;
+	if (strncmp(filename, t->prefix, t->len))
+	    continue;
+	// only match at path component boundaries
+	if ((filename[t->len] != 0) && (filename[t->len] != '/') && (t->prefix[t->len-1] != '/'))
+	    continue;
+	match = t;
+    }
+
+    if (match)
+	return (negative ? match->neg_ttl : match->ttl);
+    return (negative ? fspriv->neg_ttl : fspriv->ttl);
+}
+
+#define CACHE_INITIAL_BUCKETS	64
+#define CACHE_MAX_ENTRIES	65536
+#define CACHE_MAX_BYTES		(16*1024*1024)
+
+// FNV-1a
+static unsigned _hash_name(const char* name)
+{
+    unsigned h = 2166136261U;
+    for (; *name; name++)
+	h = (h ^ (unsigned char)*name) * 16777619U;
+    return h;
+}
+
+static inline size_t _stat_size(MVFS_STAT* st)
+{
+    if (st == NULL)
+	return 0;
+    // uid and gid are pooled
+    return sizeof(MVFS_STAT) + strlen(st->name)+1;
+}
+
+static char* _child_path(const char* dir, const char* name)
+{
+    size_t len = strlen(dir);
+    char* fn = malloc(len+strlen(name)+2);
+    if (fn == NULL)
+	return NULL;
+    if ((len) && (dir[len-1] == '/'))
+	sprintf(fn, "%s%s", dir, name);
+    else
+	sprintf(fn, "%s/%s", dir, name);
+    return fn;
+}
+
+// split path into parent directory and last component - returns 0 if it has no parent
+static int _split_path(const char* path, char* parent, size_t size, const char** name)
+{
+    const char* slash = strrchr(path, '/');
+    if ((slash == NULL) || (slash[1] == 0))
+	return 0;
+
+    size_t len = ((slash == path) ? 1 : slash-path);
+    if (len >= size)
+	return 0;
+    memcpy(parent, path, len);
+    parent[len] = 0;
+    *name = slash+1;
+    return 1;
+}
+
+static METACACHE_DIR* _dir_alloc()
+{
+    METACACHE_DIR* dir = calloc(1,sizeof(METACACHE_DIR));
+    if (dir)
+	dir->refs = 1;
+    return dir;
+}
+
+static inline void _dir_get(METACACHE_DIR* dir)
+{
+    __sync_add_and_fetch(&dir->refs, 1);
+}
+
+static void _dir_put(METACACHE_DIR* dir)
+{
+    if ((dir == NULL) || (__sync_sub_and_fetch(&dir->refs, 1)))
+	return;
+
+    int x;
+    for (x=0; x<dir->count; x++)
+	mvfs_stat_free(dir->entries[x]);
+    free(dir->entries);
+    free(dir->sorted);
+    free(dir);
+}
+
+static int _dir_add(METACACHE_DIR* dir, MVFS_STAT* st)
+{
+    if (dir->count == dir->alloc)
+    {
+	int alloc = (dir->alloc ? dir->alloc*2 : 32);
+	MVFS_STAT** entries = realloc(dir->entries, alloc*sizeof(MVFS_STAT*));
+	if (entries == NULL)
+	    return -ENOMEM;
+	dir->entries = entries;
+	dir->alloc   = alloc;
+    }
+
+    if ((dir->entries[dir->count] = mvfs_stat_dup(st)) == NULL)
+	return -ENOMEM;
+    dir->size += sizeof(MVFS_STAT*) + sizeof(int) + _stat_size(st);
+    dir->count++;
+    return 0;
+}
+
+static int _dir_cmp(const void* a, const void* b, void* arg)
+{
+    MVFS_STAT** entries = (MVFS_STAT**)arg;
+    return strcmp(entries[*(const int*)a]->name, entries[*(const int*)b]->name);
+}
+
+// listing is complete - build the name index
+static int _dir_finish(METACACHE_DIR* dir)
+{
+    int x;
+    if ((dir->sorted = malloc((dir->count+1)*sizeof(int))) == NULL)
+	return -ENOMEM;
+    for (x=0; x<dir->count; x++)
+	dir->sorted[x] = x;
+    qsort_r(dir->sorted, dir->count, sizeof(int), _dir_cmp, dir->entries);
+    dir->size += sizeof(METACACHE_DIR);
+    return 0;
+}
+
+static MVFS_STAT* _dir_find(METACACHE_DIR* dir, const char* name)
+{
+    int lo = 0, hi = dir->count-1;
+    while (lo <= hi)
+    {
+	int mid = (lo+hi)/2;
+	MVFS_STAT* st = dir->entries[dir->sorted[mid]];
+	int cmp = strcmp(name, st->name);
+	if (cmp == 0)
+	    return st;
+	if (cmp < 0)
+	    hi = mid-1;
+	else
+	    lo = mid+1;
+    }
+    return NULL;
+}
+
+static void _lru_unlink(METACACHE_TABLE* t, METACACHE_RECORD* rec)
+{
+    if (rec->newer)
+	rec->newer->older = rec->older;
+    else
+	t->newest = rec->older;
+    if (rec->older)
+	rec->older->newer = rec->newer;
+    else
+	t->oldest = rec->newer;
+    rec->newer = rec->older = NULL;
+}
+
+static void _lru_push(METACACHE_TABLE* t, METACACHE_RECORD* rec)
+{
+    rec->older = t->newest;
+    rec->newer = NULL;
+    if (t->newest)
+	t->newest->newer = rec;
+    else
+	t->oldest = rec;
+    t->newest = rec;
+}
+
+static void _table_grow(METACACHE_TABLE* t)
+{
+    unsigned nbuckets = t->nbuckets*2;
+    METACACHE_RECORD** buckets = calloc(nbuckets, sizeof(METACACHE_RECORD*));
+    if (buckets == NULL)
+	return;
+
+    unsigned x;
+    for (x=0; x<t->nbuckets; x++)
     {
-	if ((rec->mtime+CACHE_TIMEOUT) > _curtime()) 
+	METACACHE_RECORD* rec = t->buckets[x];
+	while (rec)
 	{
-	    DEBUGMSG("cached: %s", filename);
-	    return rec;
+	    METACACHE_RECORD* next = rec->next;
+	    rec->next = buckets[rec->hash & (nbuckets-1)];
+	    buckets[rec->hash & (nbuckets-1)] = rec;
+	    rec = next;
 	}
-	
-	DEBUGMSG("purging old cache record for %s", filename);
+    }
+
+    free(t->buckets);
+    t->buckets  = buckets;
+    t->nbuckets = nbuckets;
+}
+
+static int _table_init(METACACHE_TABLE* t)
+{
+    memset(t, 0, sizeof(METACACHE_TABLE));
+    if ((t->buckets = calloc(CACHE_INITIAL_BUCKETS, sizeof(METACACHE_RECORD*))) == NULL)
+	return -ENOMEM;
+    t->nbuckets = CACHE_INITIAL_BUCKETS;
+    return 0;
+}
+
+static void _table_free(METACACHE_TABLE* t)
+{
+    METACACHE_RECORD* rec = t->newest;
+    while (rec)
+    {
+	METACACHE_RECORD* older = rec->older;
 	mvfs_stat_free(rec->stat);
-	rec->stat = NULL;
-	return rec;
+	_dir_put(rec->dir);
+	free(rec->link_target);
+	free(rec);
+	rec = older;
     }
+    free(t->buckets);
+    memset(t, 0, sizeof(METACACHE_TABLE));
+}
 
-    // ... lookup failed - no record yet
-    rec = calloc(1,sizeof(METACACHE_RECORD));
-    rec->filename = strdup(filename);
-    
-    // now insert
-    hash_insert(&(fspriv->cache),rec->filename,rec);
-    return rec;
+static METACACHE_RECORD* _table_find(METACACHE_TABLE* t, const char* filename, unsigned hash)
+{
+    METACACHE_RECORD* rec;
+    for (rec=t->buckets[hash & (t->nbuckets-1)]; rec; rec=rec->next)
+	if ((rec->hash == hash) && (!strcmp(rec->filename, filename)))
+	    return rec;
+    return NULL;
 }
 
-static void _cache_set(METACACHE_RECORD* rec, MVFS_STAT* st)
+static void _table_drop(METACACHE_TABLE* t, METACACHE_RECORD* rec)
 {
-    rec->mtime = _curtime();
+    METACACHE_RECORD** p;
+    for (p=&t->buckets[rec->hash & (t->nbuckets-1)]; *p; p=&(*p)->next)
+    {
+	if (*p == rec)
+	{
+	    *p = rec->next;
+	    break;
+	}
+    }
+    _lru_unlink(t, rec);
+    t->entries--;
+    t->bytes -= rec->size;
     mvfs_stat_free(rec->stat);
-    rec->stat = (st ? mvfs_stat_dup(st) : NULL);
+    _dir_put(rec->dir);
+    free(rec->link_target);
+    free(rec);
 }
 
-static void _cache_clear(METACACHE_RECORD* rec)
+// add an empty record
+static METACACHE_RECORD* _table_insert(METACACHE_TABLE* t, const char* filename, unsigned hash)
 {
+    size_t len = strlen(filename);
+    METACACHE_RECORD* rec = calloc(1,sizeof(METACACHE_RECORD)+len+1);
     if (rec == NULL)
+	return NULL;
+
+    memcpy(rec->filename, filename, len+1);
+    rec->hash  = hash;
+    rec->size  = sizeof(METACACHE_RECORD)+len+1;
+    rec->next  = t->buckets[hash & (t->nbuckets-1)];
+    t->buckets[hash & (t->nbuckets-1)] = rec;
+    t->entries++;
+    t->bytes += rec->size;
+    _lru_push(t, rec);
+
+    if (t->entries > t->nbuckets)
+	_table_grow(t);
+    return rec;
+}
+
+// the low bits select the bucket, so pick the shard by the high ones
+static inline METACACHE_SHARD* _shard(METACACHE_FS_PRIV* fspriv, unsigned hash)
+{
+    return &fspriv->shards[(hash >> 24) & (CACHE_SHARDS-1)];
+}
+
+#define STAT_INC(shard,counter)	__sync_fetch_and_add(&((shard)->stats.counter), 1)
+
+// evict records until we're within the limits again, the oldest
+// first unless they've been hit meanwhile - called with write lock
+static void _cache_trim(METACACHE_FS_PRIV* fspriv, METACACHE_SHARD* shard)
+{
+    METACACHE_TABLE* t = &shard->table;
+    while ((t->oldest) &&
+	   (((fspriv->max_entries) && (t->entries > fspriv->max_entries)) ||
+	    ((fspriv->max_bytes) && (t->bytes > fspriv->max_bytes))))
     {
-	DEBUGMSG("NULL rec passed");
+	METACACHE_RECORD* rec = t->oldest;
+	if (rec->referenced)
+	{
+	    rec->referenced = 0;
+	    _lru_unlink(t, rec);
+	    _lru_push(t, rec);
+	    continue;
+	}
+	_table_drop(t, rec);
+	STAT_INC(shard, evictions);
+    }
+}
+
+/*
+   look up filename: returns an copy of the cached stat, or NULL with
+   *errcode set for an negative record, or NULL and *errcode=0 on miss
+   (not counted here - the caller may still find it in an listing).
+   only takes the read lock - expired records are left to be replaced
+   or evicted by writers.
+*/
+static MVFS_STAT* _cache_get(METACACHE_FS_PRIV* fspriv, const char* filename, int* errcode)
+{
+    unsigned hash = _hash_name(filename);
+    METACACHE_SHARD* shard = _shard(fspriv, hash);
+    MVFS_STAT* st = NULL;
+
+    *errcode = 0;
+    pthread_rwlock_rdlock(&shard->lock);
+    METACACHE_RECORD* rec = _table_find(&shard->table, filename, hash);
+    if ((rec == NULL) || ((rec->stat == NULL) && (rec->errcode == 0)))
+    {
+	pthread_rwlock_unlock(&shard->lock);
+	return NULL;
+    }
+
+    if (rec->expires <= _curtime())
+    {
+	pthread_rwlock_unlock(&shard->lock);
+	DEBUGMSG("expired cache record for %s", filename);
+	STAT_INC(shard, expired);
+	return NULL;
+    }
+
+    // avoid dirtying the cacheline if already marked
+    if (!__atomic_load_n(&rec->referenced, __ATOMIC_RELAXED))
+	__atomic_store_n(&rec->referenced, 1, __ATOMIC_RELAXED);
+
+    if (rec->stat)
+	st = mvfs_stat_dup(rec->stat);
+    else
+	*errcode = rec->errcode;
+    pthread_rwlock_unlock(&shard->lock);
+
+    if (st)
+	STAT_INC(shard, hits);
+    else
+	STAT_INC(shard, neg_hits);
+    return st;
+}
+
+static void _cache_invalidate(METACACHE_FS_PRIV* fspriv, const char* filename)
+{
+    unsigned hash = _hash_name(filename);
+    METACACHE_SHARD* shard = _shard(fspriv, hash);
+
+    pthread_rwlock_wrlock(&shard->lock);
+    shard->generation++;
+    METACACHE_RECORD* rec = _table_find(&shard->table, filename, hash);
+    if (rec)
+	_table_drop(&shard->table, rec);
+    pthread_rwlock_unlock(&shard->lock);
+}
+
+/*
+   store an stat (or an error code) for filename, replacing old data.
+   if generation doesn't match anymore, the path has been invalidated
+   while the backend was asked - the result may be stale, so drop it.
+*/
+static void _cache_store(METACACHE_FS_PRIV* fspriv, const char* filename, MVFS_STAT* st, int errcode, uint64_t ttl, unsigned long generation)
+{
+    unsigned hash = _hash_name(filename);
+    METACACHE_SHARD* shard = _shard(fspriv, hash);
+    METACACHE_TABLE* t = &shard->table;
+
+    // copy outside the lock
+    MVFS_STAT* newst = (((st) && (ttl)) ? mvfs_stat_dup(st) : NULL);
+
+    pthread_rwlock_wrlock(&shard->lock);
+    METACACHE_RECORD* rec = _table_find(t, filename, hash);
+
+    if ((ttl == 0) || (generation != shard->generation))
+    {
+	if (rec)
+	    _table_drop(t, rec);
+	pthread_rwlock_unlock(&shard->lock);
+	mvfs_stat_free(newst);
 	return;
     }
-    rec->mtime = _curtime();
-    mvfs_stat_free(rec->stat);
-    rec->stat = NULL;
+
+    if (rec == NULL)
+    {
+	if ((rec = _table_insert(t, filename, hash)) == NULL)
+	{
+	    pthread_rwlock_unlock(&shard->lock);
+	    ERRMSG("out of memory");
+	    mvfs_stat_free(newst);
+	    return;
+	}
+    }
+    else
+    {
+	_lru_unlink(t, rec);
+	_lru_push(t, rec);
+    }
+
+    MVFS_STAT* oldst = rec->stat;
+    size_t oldsize = _stat_size(oldst);
+    size_t newsize = _stat_size(newst);
+    rec->stat       = newst;
+    rec->errcode    = errcode;
+    rec->expires    = _curtime()+ttl;
+    rec->referenced = 0;
+    rec->size      += newsize - oldsize;
+    t->bytes       += newsize - oldsize;
+
+    _cache_trim(fspriv, shard);
+    pthread_rwlock_unlock(&shard->lock);
+    mvfs_stat_free(oldst);
+}
+
+static inline unsigned long _cache_generation(METACACHE_FS_PRIV* fspriv, const char* filename)
+{
+    METACACHE_SHARD* shard = _shard(fspriv, _hash_name(filename));
+    pthread_rwlock_rdlock(&shard->lock);
+    unsigned long gen = shard->generation;
+    pthread_rwlock_unlock(&shard->lock);
+    return gen;
+}
+
+static inline void _cache_set(METACACHE_FS_PRIV* fspriv, const char* filename, MVFS_STAT* st, unsigned long generation)
+{
+    _cache_store(fspriv, filename, st, 0, (st ? _cache_ttl(fspriv, filename, 0) : 0), generation);
+}
+
+// remember an failed lookup - only ENOENT is worth caching, other
+// errors are most likely transient
+static inline void _cache_set_error(METACACHE_FS_PRIV* fspriv, const char* filename, int errcode, unsigned long generation)
+{
+    _cache_store(fspriv, filename, NULL, errcode, ((errcode == ENOENT) ? _cache_ttl(fspriv, filename, 1) : 0), generation);
+}
+
+// fetch an valid listing for path - returns an reference, or NULL
+static METACACHE_DIR* _cache_get_dir(METACACHE_FS_PRIV* fspriv, const char* path)
+{
+    unsigned hash = _hash_name(path);
+    METACACHE_SHARD* shard = _shard(fspriv, hash);
+    METACACHE_DIR* dir = NULL;
+
+    pthread_rwlock_rdlock(&shard->lock);
+    METACACHE_RECORD* rec = _table_find(&shard->table, path, hash);
+    if ((rec) && (rec->dir) && (rec->dir_expires > _curtime()))
+    {
+	dir = rec->dir;
+	_dir_get(dir);
+	if (!__atomic_load_n(&rec->referenced, __ATOMIC_RELAXED))
+	    __atomic_store_n(&rec->referenced, 1, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+
+    if (dir)
+	STAT_INC(shard, dir_hits);
+    return dir;
+}
+
+// store an complete listing (takes an own reference)
+static void _cache_set_dir(METACACHE_FS_PRIV* fspriv, const char* path, METACACHE_DIR* dir, unsigned long generation)
+{
+    unsigned hash = _hash_name(path);
+    METACACHE_SHARD* shard = _shard(fspriv, hash);
+    METACACHE_TABLE* t = &shard->table;
+    uint64_t ttl = _cache_ttl(fspriv, path, 0);
+
+    pthread_rwlock_wrlock(&shard->lock);
+    if ((ttl == 0) || (generation != shard->generation))
+    {
+	pthread_rwlock_unlock(&shard->lock);
+	return;
+    }
+
+    METACACHE_RECORD* rec = _table_find(t, path, hash);
+    if ((rec == NULL) && ((rec = _table_insert(t, path, hash)) == NULL))
+    {
+	pthread_rwlock_unlock(&shard->lock);
+	ERRMSG("out of memory");
+	return;
+    }
+
+    METACACHE_DIR* old = rec->dir;
+    if (old)
+    {
+	rec->size -= old->size;
+	t->bytes  -= old->size;
+    }
+    _dir_get(dir);
+    rec->dir         = dir;
+    rec->dir_expires = _curtime()+ttl;
+    rec->size       += dir->size;
+    t->bytes        += dir->size;
+
+    _cache_trim(fspriv, shard);
+    pthread_rwlock_unlock(&shard->lock);
+    _dir_put(old);
+}
+
+// answer an stat from the parent's listing - NULL and *errcode=0 if there is none
+static MVFS_STAT* _cache_get_from_dir(METACACHE_FS_PRIV* fspriv, const char* filename, int* errcode)
+{
+    char parent[4096];
+    const char* name;
+
+    *errcode = 0;
+    if (!_split_path(filename, parent, sizeof(parent), &name))
+	return NULL;
+
+    METACACHE_DIR* dir = _cache_get_dir(fspriv, parent);
+    if (dir == NULL)
+	return NULL;
+
+    MVFS_STAT* ent = _dir_find(dir, name);
+    MVFS_STAT* st = (ent ? mvfs_stat_dup(ent) : NULL);
+    if (ent == NULL)
+	*errcode = ENOENT;
+    _dir_put(dir);
+    return st;
+}
+
+// drop the listing of the path's parent directory
+static void _cache_invalidate_parent(METACACHE_FS_PRIV* fspriv, const char* filename)
+{
+    char parent[4096];
+    const char* name;
+
+    if (_split_path(filename, parent, sizeof(parent), &name))
+	_cache_invalidate(fspriv, parent);
+}
+
+// drop everything below path (not path itself) - eg. after renaming an directory
+static void _cache_invalidate_tree(METACACHE_FS_PRIV* fspriv, const char* path)
+{
+    size_t len = strlen(path);
+    int x;
+
+    while ((len) && (path[len-1] == '/'))
+	len--;
+
+    for (x=0; x<CACHE_SHARDS; x++)
+    {
+	METACACHE_SHARD* shard = &fspriv->shards[x];
+	pthread_rwlock_wrlock(&shard->lock);
+	shard->generation++;
+	METACACHE_RECORD* rec = shard->table.newest;
+	while (rec)
+	{
+	    METACACHE_RECORD* older = rec->older;
+	    if ((!strncmp(rec->filename, path, len)) && (rec->filename[len] == '/'))
+		_table_drop(&shard->table, rec);
+	    rec = older;
+	}
+	pthread_rwlock_unlock(&shard->lock);
+    }
+}
+
+/*
+   data has been written to filename up to offset end (-1 if unknown),
+   or it has been truncated to end: patch size and mtime of the cached
+   stat in place instead of asking the backend again. the parent's
+   listing still has the old size, so it's dropped.
+*/
+static void _cache_written(METACACHE_FS_PRIV* fspriv, const char* filename, off64_t end, int truncated)
+{
+    unsigned hash = _hash_name(filename);
+    METACACHE_SHARD* shard = _shard(fspriv, hash);
+
+    pthread_rwlock_wrlock(&shard->lock);
+    shard->generation++;		// backend stats in flight are outdated
+    METACACHE_RECORD* rec = _table_find(&shard->table, filename, hash);
+    MVFS_STAT* st = (((rec) && (rec->stat) && (end >= 0)) ? mvfs_stat_copy(rec->stat) : NULL);
+    if (st)
+    {
+	// the old one may still be referenced by callers
+	if ((truncated) || (end > st->size))
+	    st->size = end;
+	st->mtime = time(NULL);
+	mvfs_stat_free(rec->stat);
+	rec->stat = st;
+    }
+    else if (rec)
+	_table_drop(&shard->table, rec);
+    pthread_rwlock_unlock(&shard->lock);
+
+    char parent[4096];
+    const char* name;
+    if (!_split_path(filename, parent, sizeof(parent), &name))
+	return;
+
+    // only take the write lock if there's an listing at all
+    hash  = _hash_name(parent);
+    shard = _shard(fspriv, hash);
+    pthread_rwlock_rdlock(&shard->lock);
+    rec = _table_find(&shard->table, parent, hash);
+    int have_dir = ((rec) && (rec->dir));
+    pthread_rwlock_unlock(&shard->lock);
+    if (!have_dir)
+	return;
+
+    METACACHE_DIR* dir = NULL;
+    pthread_rwlock_wrlock(&shard->lock);
+    shard->generation++;
+    if ((rec = _table_find(&shard->table, parent, hash)) && (dir = rec->dir))
+    {
+	rec->dir = NULL;
+	rec->size          -= dir->size;
+	shard->table.bytes -= dir->size;
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    _dir_put(dir);
+}
+
+// fetch an cached readlink() result - returns 0 if there's none
+static int _cache_get_link(METACACHE_FS_PRIV* fspriv, const char* path, MVFS_SYMLINK* link)
+{
+    unsigned hash = _hash_name(path);
+    METACACHE_SHARD* shard = _shard(fspriv, hash);
+    int found = 0;
+
+    pthread_rwlock_rdlock(&shard->lock);
+    METACACHE_RECORD* rec = _table_find(&shard->table, path, hash);
+    if ((rec) && ((rec->link_target) || (rec->link_errcode)) && (rec->link_expires > _curtime()))
+    {
+	found = 1;
+	link->errcode = rec->link_errcode;
+	link->target[0] = 0;
+	if (rec->link_target)
+	    strcpy(link->target, rec->link_target);
+	if (!__atomic_load_n(&rec->referenced, __ATOMIC_RELAXED))
+	    __atomic_store_n(&rec->referenced, 1, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+
+    if (found)
+    {
+	if (link->errcode)
+	    STAT_INC(shard, neg_hits);
+	else
+	    STAT_INC(shard, hits);
+    }
+    return found;
+}
+
+static void _cache_set_link(METACACHE_FS_PRIV* fspriv, const char* path, MVFS_SYMLINK* link, unsigned long generation)
+{
+    unsigned hash = _hash_name(path);
+    METACACHE_SHARD* shard = _shard(fspriv, hash);
+    METACACHE_TABLE* t = &shard->table;
+
+    // not being an symlink or not existing is as stable as an target
+    int err = ((link->errcode < 0) ? -link->errcode : link->errcode);
+    uint64_t ttl = 0;
+    if (err == 0)
+	ttl = _cache_ttl(fspriv, path, 0);
+    else if ((err == ENOENT) || (err == EINVAL))
+	ttl = _cache_ttl(fspriv, path, 1);
+
+    char* target = (((ttl) && (err == 0)) ? strdup(link->target) : NULL);
+
+    pthread_rwlock_wrlock(&shard->lock);
+    METACACHE_RECORD* rec = _table_find(t, path, hash);
+    if ((ttl) && (generation == shard->generation) && (rec == NULL))
+	rec = _table_insert(t, path, hash);
+    if (rec == NULL)
+    {
+	pthread_rwlock_unlock(&shard->lock);
+	free(target);
+	return;
+    }
+
+    char* old = rec->link_target;
+    if (old)
+    {
+	rec->size -= strlen(old)+1;
+	t->bytes  -= strlen(old)+1;
+    }
+    rec->link_target  = NULL;
+    rec->link_errcode = 0;
+
+    if ((ttl) && (generation == shard->generation))
+    {
+	rec->link_target  = target;
+	rec->link_errcode = link->errcode;
+	rec->link_expires = _curtime()+ttl;
+	if (target)
+	{
+	    rec->size += strlen(target)+1;
+	    t->bytes  += strlen(target)+1;
+	}
+	target = NULL;
+	_cache_trim(fspriv, shard);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    free(old);
+    free(target);
+}
+
+static void _pending_put(METACACHE_PENDING* p)
+{
+    if (--p->refs)
+	return;
+    mvfs_stat_free(p->stat);
+    free(p);
+}
+
+/*
+   cache miss on filename: ask the backend, unless another thread is
+   already doing so - then just wait for its result.
+*/
+static MVFS_STAT* _cache_fetch(METACACHE_FS_PRIV* fspriv, const char* filename, int* errcode)
+{
+    unsigned hash = _hash_name(filename);
+    METACACHE_SHARD* shard = _shard(fspriv, hash);
+    METACACHE_PENDING* p;
+
+    STAT_INC(shard, misses);
+    pthread_mutex_lock(&shard->pending_lock);
+    for (p=shard->pending; p; p=p->next)
+	if ((p->hash == hash) && (!strcmp(p->filename, filename)))
+	    break;
+
+    if (p)
+    {
+	p->refs++;
+	while (!p->done)
+	    pthread_cond_wait(&shard->pending_cond, &shard->pending_lock);
+	MVFS_STAT* st = (p->stat ? mvfs_stat_dup(p->stat) : NULL);
+	*errcode = p->errcode;
+	_pending_put(p);
+	pthread_mutex_unlock(&shard->pending_lock);
+	STAT_INC(shard, coalesced);
+	return st;
+    }
+
+    if ((p = calloc(1,sizeof(METACACHE_PENDING))) != NULL)
+    {
+	p->filename = filename;
+	p->hash     = hash;
+	p->refs     = 1;
+	p->next     = shard->pending;
+	shard->pending = p;
+    }
+    pthread_mutex_unlock(&shard->pending_lock);
+
+    unsigned long gen = _cache_generation(fspriv, filename);
+    MVFS_STAT* st = mvfs_fs_statfile(fspriv->fs, filename);
+    *errcode = (st ? 0 : fspriv->fs->errcode);
+    if (st)
+	_cache_set(fspriv, filename, st, gen);
+    else
+	_cache_set_error(fspriv, filename, *errcode, gen);
+
+    if (p == NULL)
+	return st;
+
+    pthread_mutex_lock(&shard->pending_lock);
+    METACACHE_PENDING** pp;
+    for (pp=&shard->pending; *pp; pp=&(*pp)->next)
+    {
+	if (*pp == p)
+	{
+	    *pp = p->next;
+	    break;
+	}
+    }
+    p->done     = 1;
+    p->filename = NULL;
+    p->errcode  = *errcode;
+    if ((st) && (p->refs > 1))
+	p->stat = mvfs_stat_dup(st);
+    pthread_cond_broadcast(&shard->pending_cond);
+    _pending_put(p);
+    pthread_mutex_unlock(&shard->pending_lock);
+    return st;
+}
+
+// ret bytes have been written at offset (-1: at the current position)
+static ssize_t _file_written(MVFS_FILE* file, ssize_t ret, off64_t offset)
+{
+    METACACHE_FILE_PRIV* priv = (file->priv.ptr);
+    METACACHE_FS_PRIV* fspriv = (file->fs->priv.ptr);
+
+    if (ret <= 0)
+	return ret;
+
+    off64_t end = ((offset < 0) ? mvfs_file_seek(priv->cfid, 0, SEEK_CUR) : offset+ret);
+    _cache_written(fspriv, priv->pathname, end, 0);
+    return ret;
 }
 
 static off64_t _mvfs_metacache_fileopseek (MVFS_FILE* file, off64_t offset, int whence)
 {
     __FILEOPS_HEAD((off64_t)-1);
+    __FILEOPS_CFID((off64_t)-1);
     return mvfs_file_seek(priv->cfid, offset, whence);
 }
 
 static ssize_t _mvfs_metacache_fileoppread (MVFS_FILE* file, void* buf, size_t count, off64_t offset)
 {
     __FILEOPS_HEAD((ssize_t)-1);
+    __FILEOPS_CFID((ssize_t)-1);
     return mvfs_file_pread(priv->cfid, buf, count, offset);
 }
 
 static ssize_t _mvfs_metacache_fileopread (MVFS_FILE* file, void* buf, size_t count)
 {
     __FILEOPS_HEAD((ssize_t)-1);
+    __FILEOPS_CFID((ssize_t)-1);
     return mvfs_file_read(priv->cfid, buf, count);
 }
 
+static ssize_t _mvfs_metacache_fileopread_into (MVFS_FILE* file, const void** data, size_t count)
+{
+    __FILEOPS_HEAD((ssize_t)-1);
+    __FILEOPS_CFID((ssize_t)-1);
+    return mvfs_file_read_into(priv->cfid, data, count);
+}
+
+static int _mvfs_metacache_fileoprelease (MVFS_FILE* file, const void* data)
+{
+    __FILEOPS_HEAD(-1);
+    __FILEOPS_CFID(-1);
+    return mvfs_file_release(priv->cfid, data);
+}
+
 static ssize_t _mvfs_metacache_fileopwrite (MVFS_FILE* file, const void* buf, size_t count)
 {
     __FILEOPS_HEAD((ssize_t)-1);
-    return mvfs_file_write(priv->cfid, buf, count);
+    __FILEOPS_CFID((ssize_t)-1);
+    return _file_written(file, mvfs_file_write(priv->cfid, buf, count), -1);
 }
 
 static ssize_t _mvfs_metacache_fileoppwrite (MVFS_FILE* file, const void* buf, size_t count, off64_t offset)
+{
+    __FILEOPS_HEAD((ssize_t)-1);
+    __FILEOPS_CFID((ssize_t)-1);
+    return _file_written(file, mvfs_file_pwrite(priv->cfid, buf, count, offset), offset);
+}
+
+static ssize_t _mvfs_metacache_fileopreadv (MVFS_FILE* file, const struct iovec* iov, int iovcnt)
+{
+    __FILEOPS_HEAD((ssize_t)-1);
+    __FILEOPS_CFID((ssize_t)-1);
+    return mvfs_file_readv(priv->cfid, iov, iovcnt);
+}
+
+static ssize_t _mvfs_metacache_fileopwritev (MVFS_FILE* file, const struct iovec* iov, int iovcnt)
+{
+    __FILEOPS_HEAD((ssize_t)-1);
+    __FILEOPS_CFID((ssize_t)-1);
+    return _file_written(file, mvfs_file_writev(priv->cfid, iov, iovcnt), -1);
+}
+
+static ssize_t _mvfs_metacache_fileoppreadv (MVFS_FILE* file, const struct iovec* iov, int iovcnt, off64_t offset)
+{
+    __FILEOPS_HEAD((ssize_t)-1);
+    __FILEOPS_CFID((ssize_t)-1);
+    return mvfs_file_preadv(priv->cfid, iov, iovcnt, offset);
+}
+
+static ssize_t _mvfs_metacache_fileoppwritev (MVFS_FILE* file, const struct iovec* iov, int iovcnt, off64_t offset)
+{
+    __FILEOPS_HEAD((ssize_t)-1);
+    __FILEOPS_CFID((ssize_t)-1);
+    return _file_written(file, mvfs_file_pwritev(priv->cfid, iov, iovcnt, offset), offset);
+}
+
+static void* _mvfs_metacache_fileopmmap (MVFS_FILE* file, off64_t offset, size_t len, int prot)
+{
+    __FILEOPS_HEAD(NULL);
+    __FILEOPS_CFID(NULL);
+    void* addr = mvfs_file_map(priv->cfid, offset, len, prot);
+    if ((addr) && (prot & PROT_WRITE))
+	priv->mapped_rw = 1;
+    return addr;
+}
+
+static int _mvfs_metacache_fileopmunmap (MVFS_FILE* file, void* addr, size_t len)
 {
     __FILEOPS_HEAD(-1);
-    return mvfs_file_pwrite(priv->cfid, buf, count, offset);
+    int ret = mvfs_file_unmap(priv->cfid, addr, len);
+
+    // can't tell what has been changed through the mapping
+    if (priv->mapped_rw)
+    {
+	_cache_invalidate(fspriv, priv->pathname);
+	_cache_invalidate_parent(fspriv, priv->pathname);
+    }
+    return ret;
 }
 
 static int _mvfs_metacache_fileopsetflag (MVFS_FILE* file, MVFS_FILE_FLAG flag, long value)
 {
     __FILEOPS_HEAD(-1);
+
+    // just an hint - cached listings are complete anyways
+    if (flag == SCAN_NAMES_ONLY)
+    {
+	if ((value <= 0) || (priv->replay))
+	{
+	    if (priv->cfid)
+		mvfs_file_setflag(priv->cfid, flag, 0);
+	    priv->names_only = 0;
+	    return 0;
+	}
+	__FILEOPS_CFID(-1);
+	priv->names_only = (mvfs_file_setflag(priv->cfid, flag, value) == 0);
+	return 0;
+    }
+
+    __FILEOPS_CFID(-1);
     return mvfs_file_setflag(priv->cfid, flag, value);
 }
 
 static int _mvfs_metacache_fileopgetflag (MVFS_FILE* file, MVFS_FILE_FLAG flag, long* value)
 {
     __FILEOPS_HEAD(-1);
+    __FILEOPS_CFID(-1);
     return mvfs_file_getflag(priv->cfid, flag, value);
 }
 
@@ -252,40 +1250,81 @@ static MVFS_STAT* _mvfs_metacache_fileopstat(MVFS_FILE* file)
 {
     __FILEOPS_HEAD(NULL);
 
-    METACACHE_RECORD* rec = _cache_lookup(fspriv, priv->pathname);
-    if (rec->stat != NULL)
+    // the file is open, so an negative record must be stale
+    int err;
+    MVFS_STAT* st = _cache_get(fspriv, priv->pathname, &err);
+    if (st)
     {
 	DEBUGMSG("got an stat record for %s", priv->pathname);
-	return mvfs_stat_dup(rec->stat);
+	return st;
+    }
+
+    // not opened yet - no need to do so just for an stat
+    if (priv->cfid == NULL)
+    {
+	if ((st = mvfs_fs_statfile(file->fs, priv->pathname)) == NULL)
+	    file->errcode = file->fs->errcode;
+	return st;
     }
 
-    MVFS_STAT* st = mvfs_file_stat(priv->cfid);
+    STAT_INC(_shard(fspriv, _hash_name(priv->pathname)), misses);
+    unsigned long gen = _cache_generation(fspriv, priv->pathname);
+    st = mvfs_file_stat(priv->cfid);
     if (st==NULL)
     {
 	DEBUGMSG("stat() failed :((");
+	file->errcode = priv->cfid->errcode;
+	_cache_invalidate(fspriv, priv->pathname);
 	return NULL;
     }
 
-    _cache_set(rec, st);
+    _cache_set(fspriv, priv->pathname, st, gen);
     DEBUGMSG("refreshed / added stat to cache for: %s", priv->pathname);
 
     return st;
 }
 
-static MVFS_FILE* _open_cfid(MVFS_FILESYSTEM* fs, MVFS_FILE* cfid, const char* name)
+static MVFS_FILE* _open_cfid(MVFS_FILESYSTEM* fs, MVFS_FILE* cfid, const char* name, mode_t mode)
 {
     MVFS_FILE* file = mvfs_file_alloc(fs, _fileops);
     METACACHE_FILE_PRIV* priv = calloc(1,sizeof(METACACHE_FILE_PRIV));
     file->priv.ptr = priv;
     priv->cfid = cfid;
     priv->pathname = strdup(name);
+    priv->mode = mode;
     return file;
 }
 
+static int _open_backend(MVFS_FILE* file)
+{
+    METACACHE_FILE_PRIV* priv = (file->priv.ptr);
+    METACACHE_FS_PRIV* fspriv = (file->fs->priv.ptr);
+
+    if ((priv->cfid = mvfs_fs_openfile(fspriv->fs, priv->pathname, priv->mode)) == NULL)
+    {
+	DEBUGMSG("couldnt open file: \"%s\"", priv->pathname);
+	file->errcode = fspriv->fs->errcode;
+	return -1;
+    }
+    return 0;
+}
+
 static MVFS_FILE* _mvfs_metacache_fsop_open(MVFS_FILESYSTEM* fs, const char* name, mode_t mode)
 {
     __FSOPS_HEAD(NULL);
 
+    // plain read-only open of an directory we've got an listing of
+    if (((mode & O_ACCMODE) == O_RDONLY) && (!(mode & (O_CREAT|O_TRUNC))))
+    {
+	METACACHE_DIR* dir = _cache_get_dir(fspriv, name);
+	if (dir)
+	{
+	    MVFS_FILE* file = _open_cfid(fs, NULL, name, mode);
+	    ((METACACHE_FILE_PRIV*)file->priv.ptr)->replay = dir;
+	    return file;
+	}
+    }
+
     MVFS_FILE* fid = mvfs_fs_openfile(fspriv->fs, name, mode);
     if (fid == NULL)
     {
@@ -293,8 +1332,17 @@ static MVFS_FILE* _mvfs_metacache_fsop_open(MVFS_FILESYSTEM* fs, const char* nam
 	fs->errcode = fspriv->fs->errcode;
 	return NULL;
     }
-    
-    return _open_cfid(fs, fid, name);
+
+    // may have created an new file
+    if (mode & O_CREAT)
+    {
+	_cache_invalidate(fspriv, name);
+	_cache_invalidate_parent(fspriv, name);
+    }
+    else if (mode & O_TRUNC)
+	_cache_written(fspriv, name, 0, 1);
+
+    return _open_cfid(fs, fid, name, mode);
 }
 
 static MVFS_STAT* _mvfs_metacache_fsop_stat(MVFS_FILESYSTEM* fs, const char* filename)
@@ -302,25 +1350,20 @@ static MVFS_STAT* _mvfs_metacache_fsop_stat(MVFS_FILESYSTEM* fs, const char* fil
     __FSOPS_HEAD(NULL);
     DEBUGMSG("lookup: %s", filename);
 
+    int err;
+    MVFS_STAT* st = _cache_get(fspriv, filename, &err);
+    if ((st == NULL) && (err == 0))
+	st = _cache_get_from_dir(fspriv, filename, &err);
+    if ((st == NULL) && (err == 0))
+	st = _cache_fetch(fspriv, filename, &err);
 
-    METACACHE_RECORD* rec = _cache_lookup(fspriv, filename);
-    if (rec->stat != NULL)
+    if (st == NULL)
     {
-	DEBUGMSG("got an stat record for %s (%s)", filename, rec->stat->name);
-	MVFS_STAT* newst = mvfs_stat_dup(rec->stat);
-	return newst;
-    }
-    
-    MVFS_STAT* st = mvfs_fs_statfile(fspriv->fs, filename);
-    if (st==NULL)
-    {
-	DEBUGMSG("stat() failed :((");
+	DEBUGMSG("stat() failed: %s", strerror(err));
+	fs->errcode = err;
 	return NULL;
     }
 
-    _cache_set(rec, st);
-    DEBUGMSG("refreshed / added stat to cache for: %s", filename);
-
     return st;
 }
 
@@ -329,19 +1372,56 @@ static int _mvfs_metacache_fsop_unlink(MVFS_FILESYSTEM* fs, const char* filename
     __FSOPS_HEAD(-EFAULT);
     DEBUGMSG("name=\"%s\"", filename);
 
-    METACACHE_RECORD* rec = _cache_lookup(fspriv, filename);
-    _cache_clear(rec);
     int ret = mvfs_fs_unlink(fspriv->fs, filename);
+    _cache_invalidate(fspriv, filename);
+    _cache_invalidate_parent(fspriv, filename);
 
     DEBUGMSG("unlink() fs returned %d", ret);
     return ret;
 }
 
-// FIXME: should also cache this, perhaps in the stat structure ? or some extension ?
 static MVFS_SYMLINK _mvfs_metacache_fsop_readlink(MVFS_FILESYSTEM* fs, const char* filename)
 {
     __FSOPS_HEAD(((MVFS_SYMLINK){.errcode = -EFAULT}));
-    return mvfs_fs_readlink(fspriv->fs, filename);
+
+    MVFS_SYMLINK link;
+    if (_cache_get_link(fspriv, filename, &link))
+	return link;
+
+    STAT_INC(_shard(fspriv, _hash_name(filename)), misses);
+    unsigned long gen = _cache_generation(fspriv, filename);
+    link = mvfs_fs_readlink(fspriv->fs, filename);
+    _cache_set_link(fspriv, filename, &link, gen);
+    return link;
+}
+
+// n2 is the new link
+static int _mvfs_metacache_fsop_symlink(MVFS_FILESYSTEM* fs, const char* n1, const char* n2)
+{
+    __FSOPS_HEAD(-EFAULT);
+    DEBUGMSG("\"%s\" -> \"%s\"", n2, n1);
+
+    int ret = mvfs_fs_symlink(fspriv->fs, n1, n2);
+    _cache_invalidate(fspriv, n2);
+    _cache_invalidate_parent(fspriv, n2);
+    return ret;
+}
+
+static int _mvfs_metacache_fsop_rename(MVFS_FILESYSTEM* fs, const char* n1, const char* n2)
+{
+    __FSOPS_HEAD(-EFAULT);
+    DEBUGMSG("\"%s\" -> \"%s\"", n1, n2);
+
+    int ret = mvfs_fs_rename(fspriv->fs, n1, n2);
+    _cache_invalidate(fspriv, n1);
+    _cache_invalidate_parent(fspriv, n1);
+    _cache_invalidate(fspriv, n2);
+    _cache_invalidate_parent(fspriv, n2);
+
+    // an directory takes its whole subtree along
+    _cache_invalidate_tree(fspriv, n1);
+    _cache_invalidate_tree(fspriv, n2);
+    return ret;
 }
 
 static int _mvfs_metacache_fsop_chmod(MVFS_FILESYSTEM* fs, const char* filename, mode_t mode)
@@ -349,23 +1429,115 @@ static int _mvfs_metacache_fsop_chmod(MVFS_FILESYSTEM* fs, const char* filename,
     __FSOPS_HEAD(-EFAULT);
     DEBUGMSG("name=\"%s\"", filename);
 
-    METACACHE_RECORD* rec = _cache_lookup(fspriv, filename);
-    _cache_clear(rec);
     int ret = mvfs_fs_chmod(fspriv->fs, filename, mode);
+    _cache_invalidate(fspriv, filename);
+    _cache_invalidate_parent(fspriv, filename);
 
     DEBUGMSG("fs returned %d", ret);
     return ret;
 }
 
-static void free_CACHEENT(void* ptr)
+static int _mvfs_metacache_fsop_chown(MVFS_FILESYSTEM* fs, const char* filename, const char* uid, const char* gid)
 {
-    METACACHE_RECORD* rec = (METACACHE_RECORD*)ptr;
-    if (rec->stat)
-	mvfs_stat_free(rec->stat);
-    free(rec);
+    __FSOPS_HEAD(-EFAULT);
+    DEBUGMSG("name=\"%s\"", filename);
+
+    int ret = mvfs_fs_chown(fspriv->fs, filename, uid, gid);
+    _cache_invalidate(fspriv, filename);
+    _cache_invalidate_parent(fspriv, filename);
+
+    DEBUGMSG("fs returned %d", ret);
+    return ret;
 }
 
-MVFS_FILESYSTEM* mvfs_metacachefs_create_1(MVFS_FILESYSTEM* clientfs)
+static int _mvfs_metacache_fsop_mkdir(MVFS_FILESYSTEM* fs, const char* filename, mode_t mode)
+{
+    __FSOPS_HEAD(-EFAULT);
+    DEBUGMSG("name=\"%s\"", filename);
+
+    int ret = mvfs_fs_mkdir(fspriv->fs, filename, mode);
+    _cache_invalidate(fspriv, filename);
+    _cache_invalidate_parent(fspriv, filename);
+
+    DEBUGMSG("fs returned %d", ret);
+    return ret;
+}
+
+static int _mvfs_metacache_fsop_free(MVFS_FILESYSTEM* fs)
+{
+    __FSOPS_HEAD(-EFAULT);
+    int x;
+
+    for (x=0; x<CACHE_SHARDS; x++)
+    {
+	_table_free(&(fspriv->shards[x].table));
+	pthread_rwlock_destroy(&(fspriv->shards[x].lock));
+	pthread_mutex_destroy(&(fspriv->shards[x].pending_lock));
+	pthread_cond_destroy(&(fspriv->shards[x].pending_cond));
+    }
+    for (x=0; x<fspriv->nttls; x++)
+	free(fspriv->ttls[x].prefix);
+    free(fspriv->ttls);
+    free(fspriv);
+    fs->priv.ptr = NULL;
+    return 0;
+}
+
+// parse "/prefix=ttl[:neg_ttl],..." (milliseconds) into the prefix table
+static void _parse_ttl_prefixes(METACACHE_FS_PRIV* fspriv, const char* spec)
+{
+    char* buf = strdup(spec);
+    char* save = NULL;
+    char* tok;
+
+    for (tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+    {
+	char* eq = strrchr(tok, '=');
+	if ((eq == NULL) || (eq == tok))
+	{
+	    ERRMSG("ignoring malformed ttl prefix \"%s\"", tok);
+	    continue;
+	}
+	*eq = 0;
+
+	char* end;
+	uint64_t ttl = strtoull(eq+1, &end, 10)*1000;
+	uint64_t neg_ttl = ((ttl < fspriv->neg_ttl) ? ttl : fspriv->neg_ttl);
+	if (*end == ':')
+	    neg_ttl = strtoull(end+1, &end, 10)*1000;
+	if (*end)
+	{
+	    ERRMSG("ignoring malformed ttl for prefix \"%s\"", tok);
+	    continue;
+	}
+
+	METACACHE_TTL* ttls = realloc(fspriv->ttls, (fspriv->nttls+1)*sizeof(METACACHE_TTL));
+	if (ttls == NULL)
+	{
+	    ERRMSG("out of memory");
+	    break;
+	}
+	fspriv->ttls = ttls;
+	ttls[fspriv->nttls].prefix  = strdup(tok);
+	ttls[fspriv->nttls].len     = strlen(tok);
+	ttls[fspriv->nttls].ttl     = ttl;
+	ttls[fspriv->nttls].neg_ttl = neg_ttl;
+	fspriv->nttls++;
+    }
+
+    free(buf);
+}
+
+/*
+   recognized args (all times in milliseconds, 0 disables caching):
+
+     ttl         - lifetime of stat records
+     neg_ttl     - lifetime of negative (ENOENT) records
+     ttl_prefix  - per path prefix overrides, eg. "/tmp=0,/usr=60000:10000"
+     max_entries - maximum number of cached records (0 = unlimited)
+     max_bytes   - maximum memory used by the cache (0 = unlimited)
+*/
+MVFS_FILESYSTEM* mvfs_metacachefs_create_args(MVFS_FILESYSTEM* clientfs, MVFS_ARGS* args)
 {
     if (clientfs==NULL)
     {
@@ -373,15 +1545,87 @@ MVFS_FILESYSTEM* mvfs_metacachefs_create_1(MVFS_FILESYSTEM* clientfs)
 	return NULL;
     }
 
-    MVFS_FILESYSTEM* newfs = mvfs_fs_alloc(_fsops, FS_MAGIC);
     METACACHE_FS_PRIV* fspriv = calloc(1,sizeof(METACACHE_FS_PRIV));
+    if (fspriv == NULL)
+    {
+	ERRMSG("out of memory");
+	return NULL;
+    }
+
+    int x;
+    for (x=0; x<CACHE_SHARDS; x++)
+    {
+	if (_table_init(&(fspriv->shards[x].table)))
+	{
+	    ERRMSG("out of memory");
+	    while (x--)
+		_table_free(&(fspriv->shards[x].table));
+	    free(fspriv);
+	    return NULL;
+	}
+	pthread_rwlock_init(&(fspriv->shards[x].lock), NULL);
+	pthread_mutex_init(&(fspriv->shards[x].pending_lock), NULL);
+	pthread_cond_init(&(fspriv->shards[x].pending_cond), NULL);
+    }
+
+    MVFS_FILESYSTEM* newfs = mvfs_fs_alloc(_fsops, FS_MAGIC);
     newfs->priv.ptr=fspriv;
     fspriv->fs = clientfs;
-    hash_initialise(&(fspriv->cache), 997U, hash_hash_string, hash_compare_string, hash_copy_string, free, free_CACHEENT);
+    fspriv->ttl = CACHE_TIMEOUT;
+    fspriv->neg_ttl = CACHE_NEG_TIMEOUT;
+    fspriv->max_entries = CACHE_MAX_ENTRIES;
+    fspriv->max_bytes = CACHE_MAX_BYTES;
+
+    const char* val;
+    if ((val = mvfs_args_get(args, "ttl")))
+	fspriv->ttl = strtoull(val, NULL, 10)*1000;
+    if ((val = mvfs_args_get(args, "neg_ttl")))
+	fspriv->neg_ttl = strtoull(val, NULL, 10)*1000;
+    if ((val = mvfs_args_get(args, "ttl_prefix")))
+	_parse_ttl_prefixes(fspriv, val);
+    if ((val = mvfs_args_get(args, "max_entries")))
+	fspriv->max_entries = strtoul(val, NULL, 10);
+    if ((val = mvfs_args_get(args, "max_bytes")))
+	fspriv->max_bytes = strtoul(val, NULL, 10);
+
+    // the limits apply per shard
+    fspriv->max_entries = (fspriv->max_entries + CACHE_SHARDS-1) / CACHE_SHARDS;
+    fspriv->max_bytes   = (fspriv->max_bytes + CACHE_SHARDS-1) / CACHE_SHARDS;
 
     return newfs;
 }
 
+MVFS_FILESYSTEM* mvfs_metacachefs_create_1(MVFS_FILESYSTEM* clientfs)
+{
+    return mvfs_metacachefs_create_args(clientfs, NULL);
+}
+
+int mvfs_metacachefs_getstats(MVFS_FILESYSTEM* fs, MVFS_METACACHE_STATS* stats)
+{
+    __FSOPS_HEAD(-EFAULT);
+    if (stats == NULL)
+	return -EFAULT;
+    int x;
+
+    memset(stats, 0, sizeof(MVFS_METACACHE_STATS));
+    for (x=0; x<CACHE_SHARDS; x++)
+    {
+	METACACHE_SHARD* shard = &fspriv->shards[x];
+	pthread_rwlock_rdlock(&shard->lock);
+	stats->hits      += shard->stats.hits;
+	stats->neg_hits  += shard->stats.neg_hits;
+	stats->misses    += shard->stats.misses;
+	stats->dir_hits  += shard->stats.dir_hits;
+	stats->coalesced += shard->stats.coalesced;
+	stats->expired   += shard->stats.expired;
+	stats->evictions += shard->stats.evictions;
+	stats->entries   += shard->table.entries;
+	stats->bytes     += shard->table.bytes + shard->table.nbuckets*sizeof(METACACHE_RECORD*);
+	pthread_rwlock_unlock(&shard->lock);
+    }
+    return 0;
+}
+
 static int _mvfs_metacache_fileopclose(MVFS_FILE* file)
 {
     __FILEOPS_HEAD(-1);
@@ -391,6 +1635,10 @@ static int _mvfs_metacache_fileopclose(MVFS_FILE* file)
     if (priv->pathname)
 	free(priv->pathname);
     priv->pathname = NULL;
+    _dir_put(priv->replay);
+    priv->replay = NULL;
+    _dir_put(priv->building);
+    priv->building = NULL;
     return 0;
 }
 
@@ -400,42 +1648,164 @@ static int _mvfs_metacache_fileopfree(MVFS_FILE* file)
     _mvfs_metacache_fileopclose(file);
     free(priv);
     file->priv.ptr = NULL;
+    mvfs_fs_unref(file->fs);
     return 0;
 }
 
 static int _mvfs_metacache_fileopeof(MVFS_FILE* file)
 {
     __FILEOPS_HEAD(1);
+    if (priv->replay)
+	return (priv->replay_pos >= priv->replay->count);
+    __FILEOPS_CFID(1);
     return mvfs_file_eof(priv->cfid);
 }
 
 static MVFS_FILE* _mvfs_metacache_fileoplookup(MVFS_FILE* file, const char* name)
 {
     __FILEOPS_HEAD(NULL);
-    MVFS_FILE* f = mvfs_file_lookup(file, name);
+    __FILEOPS_CFID(NULL);
+    MVFS_FILE* f = mvfs_file_lookup(priv->cfid, name);
     if (f==NULL)
 	return NULL;
-    
-    return _open_cfid(file->fs, f, name);
+
+    char* fn = _child_path(priv->pathname, name);
+    MVFS_FILE* ret = _open_cfid(file->fs, f, (fn ? fn : name), O_RDONLY);
+    free(fn);
+    return ret;
+}
+
+// backend scan finished - store the listing if it really is an directory
+static void _scan_complete(MVFS_FILE* file)
+{
+    METACACHE_FILE_PRIV* priv = (file->priv.ptr);
+    METACACHE_FS_PRIV* fspriv = (file->fs->priv.ptr);
+    METACACHE_DIR* dir = priv->building;
+
+    priv->building = NULL;
+    MVFS_STAT* st = _mvfs_metacache_fileopstat(file);
+    if ((st) && (S_ISDIR(st->mode)) && (_dir_finish(dir) == 0))
+	_cache_set_dir(fspriv, priv->pathname, dir, priv->building_gen);
+    mvfs_stat_free(st);
+    _dir_put(dir);
+}
+
+// collect an listing if we're scanning from the beginning
+static void _scan_start(MVFS_FILE* file)
+{
+    METACACHE_FILE_PRIV* priv = (file->priv.ptr);
+    METACACHE_FS_PRIV* fspriv = (file->fs->priv.ptr);
+
+    if (priv->scanning)
+	return;
+    priv->scanning = 1;
+    if (priv->names_only)
+	return;
+    priv->building = _dir_alloc();
+    priv->building_gen = _cache_generation(fspriv, priv->pathname);
+}
+
+// an entry came in from the backend
+static void _scan_entry(MVFS_FILE* file, MVFS_STAT* st)
+{
+    METACACHE_FILE_PRIV* priv = (file->priv.ptr);
+    METACACHE_FS_PRIV* fspriv = (file->fs->priv.ptr);
+
+    // incomplete stats must not get into the cache
+    if (priv->names_only)
+	return;
+
+    char* fn = _child_path(priv->pathname, st->name);
+    if (fn)
+	_cache_set(fspriv, fn, st, _cache_generation(fspriv, fn));
+    free(fn);
+
+    if ((priv->building) && (_dir_add(priv->building, st) < 0))
+    {
+	_dir_put(priv->building);
+	priv->building = NULL;
+    }
 }
 
 static MVFS_STAT* _mvfs_metacache_fileopscan(MVFS_FILE* file)
 {
     __FILEOPS_HEAD(NULL);
+    file->errcode = 0;
+
+    if (priv->replay)
+    {
+	if (priv->replay_pos >= priv->replay->count)
+	    return NULL;
+	return mvfs_stat_dup(priv->replay->entries[priv->replay_pos++]);
+    }
+
+    _scan_start(file);
     MVFS_STAT* st = mvfs_file_scan(priv->cfid);
+    if ((st==NULL) && (priv->cfid->errcode))
+    {
+	// an incomplete listing is useless
+	_dir_put(priv->building);
+	priv->building = NULL;
+	file->errcode = priv->cfid->errcode;
+	return NULL;
+    }
     if (st==NULL)
+    {
+	if (priv->building)
+	    _scan_complete(file);
 	return NULL;
+    }
 
-    char* fn = calloc(1,strlen(priv->pathname)+strlen(st->name)+3);
-    sprintf(fn, "%s/%s", priv->pathname, st->name);
-    
-    METACACHE_RECORD* rec = _cache_lookup(fspriv, fn);
-    _cache_set(rec, st);
+    _scan_entry(file, st);
     return st;
 }
 
+static ssize_t _mvfs_metacache_fileopscanbatch(MVFS_FILE* file, MVFS_STAT** stats, size_t max)
+{
+    __FILEOPS_HEAD(-1);
+
+    if (priv->replay)
+    {
+	size_t count = 0;
+	while ((count < max) && (priv->replay_pos < priv->replay->count))
+	    stats[count++] = mvfs_stat_dup(priv->replay->entries[priv->replay_pos++]);
+	return count;
+    }
+
+    _scan_start(file);
+    ssize_t count = mvfs_file_scan_batch(priv->cfid, stats, max);
+    if (count < 0)
+    {
+	// an incomplete listing is useless
+	_dir_put(priv->building);
+	priv->building = NULL;
+	file->errcode = priv->cfid->errcode;
+	return -1;
+    }
+    if ((count == 0) && (max))
+    {
+	if (priv->building)
+	    _scan_complete(file);
+	return 0;
+    }
+
+    ssize_t x;
+    for (x=0; x<count; x++)
+	_scan_entry(file, stats[x]);
+    return count;
+}
+
 static int _mvfs_metacache_fileopreset(MVFS_FILE* file)
 {
     __FILEOPS_HEAD(-1);
+    if (priv->replay)
+    {
+	priv->replay_pos = 0;
+	return 1;
+    }
+
+    _dir_put(priv->building);
+    priv->building = NULL;
+    priv->scanning = 0;
     return mvfs_file_reset(priv->cfid);
 }
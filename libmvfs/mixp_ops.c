@@ -20,18 +20,31 @@
 #include <errno.h>
 #include <string.h>
 #include <malloc.h>
+#include <stdlib.h>
+#include <pthread.h>
 
 #include <mvfs/mvfs.h>
 #include <mvfs/default_ops.h>
 #include <mvfs/mixpfs.h>
 #include <mvfs/_utils.h>
 
+#include "readahead.h"
+#include "writebehind.h"
+
 #include <9p-mixp/mixp.h>
 
-#define MIXP_FS_CLIENT(fs)	((MIXP_CLIENT*)(fs->priv.ptr))
+#define MIXP_FS_PRIV(fs)	((MIXP_FS_PRIV*)(fs->priv.ptr))
+#define MIXP_FS_CLIENT(fs)	(MIXP_FS_PRIV(fs)->client)
 
 #define	FS_MAGIC	"metux/mixp-fs-1"
 
+// write-behind buffer size / pipeline chunk size if the server didn't tell an iounit
+#define MIXP_WB_BUFSIZE	8192
+#define MIXP_CHUNKSIZE	8192
+
+// upper limit for the number of parallel Treads per file
+#define MIXP_PIPELINE_MAX	64
+
 static inline char* SSTRDUP(const char* str)
 {
     if (str==NULL)
@@ -45,6 +58,14 @@ static ssize_t    mvfs_mixpfs_fileops_pread  (MVFS_FILE* file, void* buf, size_t
 static ssize_t    mvfs_mixpfs_fileops_pwrite (MVFS_FILE* file, const void* buf, size_t count, off64_t offset);
 static ssize_t    mvfs_mixpfs_fileops_read   (MVFS_FILE* file, void* buf, size_t count);
 static ssize_t    mvfs_mixpfs_fileops_write  (MVFS_FILE* file, const void* buf, size_t count);
+static ssize_t    mvfs_mixpfs_fileops_readv  (MVFS_FILE* file, const struct iovec* iov, int iovcnt);
+static ssize_t    mvfs_mixpfs_fileops_writev (MVFS_FILE* file, const struct iovec* iov, int iovcnt);
+static ssize_t    mvfs_mixpfs_fileops_preadv (MVFS_FILE* file, const struct iovec* iov, int iovcnt, off64_t offset);
+static ssize_t    mvfs_mixpfs_fileops_pwritev(MVFS_FILE* file, const struct iovec* iov, int iovcnt, off64_t offset);
+static ssize_t    mvfs_mixpfs_fileops_read_into (MVFS_FILE* file, const void** data, size_t count);
+static int        mvfs_mixpfs_fileops_release(MVFS_FILE* file, const void* data);
+static int        mvfs_mixpfs_fileops_setflag(MVFS_FILE* file, MVFS_FILE_FLAG flag, long value);
+static int        mvfs_mixpfs_fileops_getflag(MVFS_FILE* file, MVFS_FILE_FLAG flag, long* value);
 static int        mvfs_mixpfs_fileops_close  (MVFS_FILE* file);
 static int        mvfs_mixpfs_fileops_free   (MVFS_FILE* file);
 static int        mvfs_mixpfs_fileops_eof    (MVFS_FILE* file);
@@ -52,6 +73,7 @@ static MVFS_STAT* mvfs_mixpfs_fileops_stat   (MVFS_FILE* file);
 static MVFS_FILE* mvfs_mixpfs_fileops_lookup (MVFS_FILE* file, const char* name);
 static MVFS_STAT* mvfs_mixpfs_fileops_scan   (MVFS_FILE* file);
 static int        mvfs_mixpfs_fileops_reset  (MVFS_FILE* file);
+static ssize_t    mvfs_mixpfs_fileops_scan_batch (MVFS_FILE* file, MVFS_STAT** stats, size_t max);
 
 static MVFS_FILE_OPS mixpfs_fileops = 
 {
@@ -59,13 +81,22 @@ static MVFS_FILE_OPS mixpfs_fileops =
     .read       = mvfs_mixpfs_fileops_read,
     .write      = mvfs_mixpfs_fileops_write,
     .pread	= mvfs_mixpfs_fileops_pread,
+    .read_into	= mvfs_mixpfs_fileops_read_into,
+    .release	= mvfs_mixpfs_fileops_release,
     .pwrite	= mvfs_mixpfs_fileops_pwrite,
+    .readv	= mvfs_mixpfs_fileops_readv,
+    .writev	= mvfs_mixpfs_fileops_writev,
+    .preadv	= mvfs_mixpfs_fileops_preadv,
+    .pwritev	= mvfs_mixpfs_fileops_pwritev,
+    .setflag	= mvfs_mixpfs_fileops_setflag,
+    .getflag	= mvfs_mixpfs_fileops_getflag,
     .close	= mvfs_mixpfs_fileops_close,
     .free	= mvfs_mixpfs_fileops_free,
     .eof        = mvfs_mixpfs_fileops_eof,
     .lookup     = mvfs_mixpfs_fileops_lookup,
     .scan       = mvfs_mixpfs_fileops_scan,
     .reset      = mvfs_mixpfs_fileops_reset,
+    .scan_batch = mvfs_mixpfs_fileops_scan_batch,
     .stat       = mvfs_mixpfs_fileops_stat
 };
 
@@ -73,11 +104,55 @@ static MVFS_STAT* mvfs_mixpfs_fsops_stat   (MVFS_FILESYSTEM* fs, const char* nam
 static MVFS_FILE* mvfs_mixpfs_fsops_open   (MVFS_FILESYSTEM* fs, const char* name, mode_t mode);
 static int        mvfs_mixpfs_fsops_unlink (MVFS_FILESYSTEM* fs, const char* name);
 
+static int        mvfs_mixpfs_fsops_free   (MVFS_FILESYSTEM* fs);
+
 static MVFS_FILESYSTEM_OPS mixpfs_fsops = 
 {
     .openfile	= mvfs_mixpfs_fsops_open,
     .unlink	= mvfs_mixpfs_fsops_unlink,
-    .stat       = mvfs_mixpfs_fsops_stat
+    .stat       = mvfs_mixpfs_fsops_stat,
+    .free	= mvfs_mixpfs_fsops_free
+};
+
+typedef struct
+{
+    MIXP_CLIENT* client;
+    int          pipeline;	// default read pipeline depth for new files
+} MIXP_FS_PRIV;
+
+/*
+   Read pipeline: libmixp handles only one request per fid at a time,
+   so we open some more fids on the same file and let an worker thread
+   per fid fetch iounit sized chunks of the requested range. The chunks
+   land right at their place in the caller's buffer, so the replies
+   are put back in order without any extra copy.
+*/
+typedef struct _mixp_pipeline MIXP_PIPELINE;
+
+typedef struct
+{
+    pthread_t      thread;
+    MIXP_CFID*     cfid;
+    MIXP_PIPELINE* pipe;
+} MIXP_PIPE_WORKER;
+
+struct _mixp_pipeline
+{
+    pthread_mutex_t   lock;
+    pthread_cond_t    cond;
+    int               nworkers;
+    MIXP_PIPE_WORKER* workers;
+    int               shutdown;
+
+    // the current job
+    char*             buf;
+    off64_t           offset;
+    size_t            count;
+    size_t            chunk;
+    int               limit;		// no chunks beyond this one (EOF seen)
+    int               next;		// next chunk to hand out
+    int               inflight;
+    ssize_t*          results;
 };
 
 typedef struct _mixp_dirent MIXP_DIRENT;
@@ -87,14 +162,29 @@ struct _mixp_dirent
     MIXP_DIRENT* next;
 };
 
+/*
+   Files returned by lookup are only resolved, not opened: the name is
+   checked against the parent's directory listing if that's already
+   loaded (no round trip at all), otherwise stat'ed. The fid is opened
+   on the first data access, and the stat from the lookup is handed
+   out by the first stat() call. So a lookup + stat, or descending
+   into an already scanned directory, won't cost an extra Topen.
+*/
 typedef struct 
 {
-    MIXP_CFID*   cfid;
+    MIXP_CFID*   cfid;		// NULL until first used, see __mixp_cfid()
+    int          omode;		// P9 open mode for the fid
     char*        pathname;
     int          eof;
     off64_t	 pos;
+    mode_t       type;		// file type if already known, 0 otherwise
+    MVFS_STAT*   stat;		// from the lookup, until asked for
     MIXP_DIRENT* dirents;
     MIXP_DIRENT* dirptr;
+    MIXP_DIRENT* dirhint;	// where the last lookup matched
+    int            pipeline;	// read pipeline depth, <2 means off
+    MIXP_PIPELINE* pipe;
+    pthread_mutex_t pipelock;	// guards pipe and pipeline
 } MIXP_FILE_PRIV;
 
 #ifdef _MVFS_SANITY_CHECKS
@@ -119,16 +209,33 @@ typedef struct
 
 #endif
 
+// the file's fid - opened on first use. not locked: anything running
+// in other threads (read-ahead, write-behind) has it opened beforehand
+static MIXP_CFID* __mixp_cfid(MVFS_FILE* file)
+{
+    __FILEOPS_HEAD(NULL);
+    if (priv->cfid)
+	return priv->cfid;
+
+    if ((priv->cfid = mixp_open(MIXP_FS_CLIENT(file->fs), priv->pathname, priv->omode)) == NULL)
+    {
+	DEBUGMSG("couldnt open file: \"%s\"", priv->pathname);
+	file->errcode = ENOENT;
+    }
+    return priv->cfid;
+}
+
 static int __mixp_flushdir(MVFS_FILE* file)
 {
     __FILEOPS_HEAD(-EFAULT);
     MIXP_DIRENT* walk;
-    for (walk=priv->dirents; walk; walk=priv->dirents)
+    while ((walk = priv->dirents))
     {
+	priv->dirents = walk->next;
 	mixp_stat_free(walk->stat);
 	free(walk);
     }
-    priv->dirents = priv->dirptr = NULL;
+    priv->dirents = priv->dirptr = priv->dirhint = NULL;
     return 0;
 }
 
@@ -139,13 +246,9 @@ static int __mixp_readdir(MVFS_FILE* file)
     // directory already loaded ?
     if (priv->dirents != NULL)
 	return 0;
-	
-    MIXP_CFID*    fid;
-    char* buf;
-    int lflag; 
-    int dflag;
-    int i;
 
+    // not known from the lookup yet
+    if (priv->type == 0)
     {
 	MIXP_STAT* stat = mixp_stat(MIXP_FS_CLIENT(file->fs), priv->pathname);
 	if (stat==NULL)
@@ -153,51 +256,407 @@ static int __mixp_readdir(MVFS_FILE* file)
 	    DEBUGMSG("couldnt stat dir: \"%s\"", priv->pathname);
 	    return -ENOENT;
 	}
-	if ((stat->mode & P9_DMDIR) == 0)
-	{
-	    DEBUGMSG("file \"%s\" is not an directory", priv->pathname);
-	    mixp_stat_free(stat);
-	    return -1;
-	}
+	priv->type = ((stat->mode & P9_DMDIR) ? S_IFDIR : S_IFREG);
 	mixp_stat_free(stat);
     }
-    
-    fid = mixp_open(MIXP_FS_CLIENT(file->fs), priv->pathname, P9_OREAD);
+    if (!S_ISDIR(priv->type))
+    {
+	DEBUGMSG("file \"%s\" is not an directory", priv->pathname);
+	return -ENOTDIR;
+    }
+
+    // our own fid will do, unless it's been opened for writing
+    MIXP_CFID* fid;
+    if (priv->omode == P9_OREAD)
+	fid = __mixp_cfid(file);
+    else
+	fid = mixp_open(MIXP_FS_CLIENT(file->fs), priv->pathname, P9_OREAD);
     if (fid == NULL)
     {
 	DEBUGMSG("couldnt open file \"%s\"", priv->pathname);
 	return -ENOENT;
     }
-    
+
+    size_t chunk = (fid->iounit ? fid->iounit : MIXP_CHUNKSIZE);
+    char* buf = malloc(chunk);
+    MIXP_DIRENT* entries = NULL;
+    MIXP_DIRENT* walk = NULL;
+    off64_t offset = 0;
+    long count = -1;
+
+    // directories may only be read sequentially, from the start
+    while ((buf) && ((count = mixp_pread(fid, buf, chunk, offset))>0))
     {
-	int count;
-	MIXP_STAT* newstat;
-	MIXP_MESSAGE m;
-	MIXP_DIRENT* entries = NULL;
-	MIXP_DIRENT* walk = NULL;
-	buf = calloc(1,fid->iounit);
-	while ((count = mixp_read(fid, buf, fid->iounit))>0)
+	MIXP_MESSAGE m = mixp_message(buf, count, MsgUnpack);
+	offset += count;
+	while (m.pos < m.end)
 	{
-	    m = mixp_message(buf, count, MsgUnpack);
-	    while (m.pos < m.end)
+	    MIXP_STAT* newstat = calloc(1,sizeof(MIXP_STAT));
+	    mixp_pstat(&m, newstat);
+	    if (entries == NULL)
 	    {
-		newstat = calloc(1,sizeof(MIXP_STAT));
-		mixp_pstat(&m, newstat);
-		if (entries == NULL)
-		{
-		    entries = walk = (MIXP_DIRENT*)calloc(1,sizeof(MIXP_DIRENT));
-		}
-		else
+		entries = walk = (MIXP_DIRENT*)calloc(1,sizeof(MIXP_DIRENT));
+	    }
+	    else
+	    {
+		walk->next = (MIXP_DIRENT*)calloc(1,sizeof(MIXP_DIRENT));
+		walk = walk->next;
+	    }
+	    walk->stat = newstat;
+	}
+    }
+
+    free(buf);
+    if (fid != priv->cfid)
+	mixp_close(fid);
+
+    // an partial listing would look like an complete one
+    if (count < 0)
+    {
+	DEBUGMSG("couldnt read dir: \"%s\"", priv->pathname);
+	priv->dirents = entries;
+	__mixp_flushdir(file);
+	return -EIO;
+    }
+
+    priv->dirents = priv->dirptr = priv->dirhint = entries;
+    return 0;
+}
+
+static void* __mixp_pipeline_worker(void* arg)
+{
+    MIXP_PIPE_WORKER* w = (MIXP_PIPE_WORKER*)arg;
+    MIXP_PIPELINE* pipe = w->pipe;
+
+    pthread_mutex_lock(&pipe->lock);
+    while (!pipe->shutdown)
+    {
+	if ((pipe->buf == NULL) || (pipe->next >= pipe->limit))
+	{
+	    pthread_cond_wait(&pipe->cond, &pipe->lock);
+	    continue;
+	}
+
+	int i = pipe->next++;
+	size_t pos = i * pipe->chunk;
+	size_t len = pipe->count - pos;
+	if (len > pipe->chunk)
+	    len = pipe->chunk;
+	pipe->inflight++;
+	pthread_mutex_unlock(&pipe->lock);
+
+	ssize_t ret = mixp_pread(w->cfid, pipe->buf+pos, len, pipe->offset+pos);
+
+	pthread_mutex_lock(&pipe->lock);
+	pipe->results[i] = ret;
+	// short read: everything behind is beyond EOF
+	if ((ret < (ssize_t)len) && (i+1 < pipe->limit))
+	    pipe->limit = i+1;
+	pipe->inflight--;
+	pthread_cond_broadcast(&pipe->cond);
+    }
+    pthread_mutex_unlock(&pipe->lock);
+    return NULL;
+}
+
+static void __mixp_pipeline_free(MIXP_PIPELINE* pipe)
+{
+    int x;
+    pthread_mutex_lock(&pipe->lock);
+    pipe->shutdown = 1;
+    pthread_cond_broadcast(&pipe->cond);
+    pthread_mutex_unlock(&pipe->lock);
+
+    for (x=0; x<pipe->nworkers; x++)
+    {
+	pthread_join(pipe->workers[x].thread, NULL);
+	mixp_close(pipe->workers[x].cfid);
+    }
+
+    pthread_mutex_destroy(&pipe->lock);
+    pthread_cond_destroy(&pipe->cond);
+    free(pipe->workers);
+    free(pipe);
+}
+
+static void __mixp_pipeline_stop(MVFS_FILE* file)
+{
+    __FILEOPS_HEAD();
+    pthread_mutex_lock(&priv->pipelock);
+    MIXP_PIPELINE* pipe = priv->pipe;
+    priv->pipe = NULL;
+    pthread_mutex_unlock(&priv->pipelock);
+
+    if (pipe)
+	__mixp_pipeline_free(pipe);
+}
+
+// called with pipelock held
+static MIXP_PIPELINE* __mixp_pipeline_start(MVFS_FILE* file)
+{
+    __FILEOPS_HEAD(NULL);
+    if (priv->pipe)
+	return priv->pipe;
+    if (__mixp_cfid(file) == NULL)
+	return NULL;
+
+    MIXP_PIPELINE* pipe = (MIXP_PIPELINE*)calloc(1,sizeof(MIXP_PIPELINE));
+    pipe->workers = (MIXP_PIPE_WORKER*)calloc(priv->pipeline,sizeof(MIXP_PIPE_WORKER));
+    pipe->chunk   = (priv->cfid->iounit ? priv->cfid->iounit : MIXP_CHUNKSIZE);
+    pthread_mutex_init(&pipe->lock, NULL);
+    pthread_cond_init(&pipe->cond, NULL);
+    priv->pipe = pipe;
+
+    for (pipe->nworkers=0; pipe->nworkers<priv->pipeline; pipe->nworkers++)
+    {
+	MIXP_PIPE_WORKER* w = &(pipe->workers[pipe->nworkers]);
+	w->pipe = pipe;
+	if ((w->cfid = mixp_open(MIXP_FS_CLIENT(file->fs), priv->pathname, P9_OREAD)) == NULL)
+	{
+	    ERRMSG("couldnt open extra fid for \"%s\"", priv->pathname);
+	    goto err;
+	}
+	if (pthread_create(&w->thread, NULL, __mixp_pipeline_worker, w) != 0)
+	{
+	    ERRMSG("cannot start pipeline worker");
+	    mixp_close(w->cfid);
+	    goto err;
+	}
+    }
+
+    DEBUGMSG("%d fids for \"%s\"", pipe->nworkers, priv->pathname);
+    return pipe;
+
+err:
+    // fall back to plain reads
+    priv->pipe = NULL;
+    __mixp_pipeline_free(pipe);
+    priv->pipeline = 0;
+    return NULL;
+}
+
+// called with pipelock held - one job at a time
+static ssize_t __mixp_pipeline_pread(MIXP_PIPELINE* pipe, void* buf, size_t count, off64_t offset)
+{
+    int nchunks = (count + pipe->chunk - 1) / pipe->chunk;
+    ssize_t* results = (ssize_t*)calloc(nchunks,sizeof(ssize_t));
+
+    pthread_mutex_lock(&pipe->lock);
+    pipe->buf     = buf;
+    pipe->offset  = offset;
+    pipe->count   = count;
+    pipe->limit   = nchunks;
+    pipe->next    = 0;
+    pipe->results = results;
+    pthread_cond_broadcast(&pipe->cond);
+
+    while ((pipe->inflight) || (pipe->next < pipe->limit))
+	pthread_cond_wait(&pipe->cond, &pipe->lock);
+
+    pipe->buf     = NULL;
+    pipe->results = NULL;
+    int limit     = pipe->limit;
+    pthread_mutex_unlock(&pipe->lock);
+
+    // the data is contiguous up to the first short chunk
+    ssize_t total = 0;
+    int x;
+    for (x=0; x<limit; x++)
+    {
+	if (results[x] > 0)
+	    total += results[x];
+	if (results[x] < (ssize_t)pipe->chunk)
+	    break;
+    }
+
+    if ((total == 0) && (results[0] < 0))
+	total = -1;
+
+    free(results);
+    return total;
+}
+
+// positional read - pipelined if enabled and worth it
+static ssize_t __mixp_pread(MVFS_FILE* file, void* buf, size_t count, off64_t offset)
+{
+    __FILEOPS_HEAD((ssize_t)-1);
+    if (__mixp_cfid(file) == NULL)
+	return -1;
+
+    // the read-ahead thread may get here too, so the pipeline is
+    // started and used under pipelock - one job at a time anyways
+    if ((priv->pipeline > 1) && (count > priv->cfid->iounit))
+    {
+	pthread_mutex_lock(&priv->pipelock);
+	MIXP_PIPELINE* pipe = __mixp_pipeline_start(file);
+	if (pipe)
+	{
+	    ssize_t ret = __mixp_pipeline_pread(pipe, buf, count, offset);
+	    pthread_mutex_unlock(&priv->pipelock);
+	    return ret;
+	}
+	pthread_mutex_unlock(&priv->pipelock);
+    }
+
+    return mixp_pread(priv->cfid, buf, count, offset);
+}
+
+/*
+   Vectored I/O: small vector elements are packed into iounit sized
+   messages through an bounce buffer, so a header + payload write
+   goes out as one Twrite instead of one round trip per element.
+   Elements of at least an iounit are transferred directly.
+*/
+static ssize_t __mixp_preadv(MVFS_FILE* file, const struct iovec* iov, int iovcnt, off64_t offset)
+{
+    __FILEOPS_HEAD((ssize_t)-1);
+    if (__mixp_cfid(file) == NULL)
+	return -1;
+
+    size_t chunk = (priv->cfid->iounit ? priv->cfid->iounit : MIXP_CHUNKSIZE);
+    char* buffer = NULL;
+    ssize_t done = 0;
+    size_t skip = 0;
+    int x = 0;
+
+    for (;;)
+    {
+	while ((x < iovcnt) && (skip == iov[x].iov_len))
+	{
+	    x++;
+	    skip = 0;
+	}
+	if (x >= iovcnt)
+	    break;
+
+	// large element: read right into it (may be pipelined)
+	if (iov[x].iov_len - skip >= chunk)
+	{
+	    size_t len = iov[x].iov_len - skip;
+	    ssize_t got = __mixp_pread(file, (char*)iov[x].iov_base+skip, len, offset+done);
+	    if (got < 1)
+		break;
+	    done += got;
+	    skip += got;
+	    if ((size_t)got < len)
+		break;
+	    continue;
+	}
+
+	if ((buffer == NULL) && ((buffer = malloc(chunk)) == NULL))
+	{
+	    file->errcode = ENOMEM;
+	    break;
+	}
+
+	// plan which elements fit into one message
+	size_t len = 0;
+	int y;
+	for (y=x; (y < iovcnt) && (len < chunk); y++)
+	    len += iov[y].iov_len - ((y==x) ? skip : 0);
+	if (len > chunk)
+	    len = chunk;
+
+	ssize_t got = mixp_pread(priv->cfid, buffer, len, offset+done);
+	if (got < 1)
+	    break;
+
+	// scatter into the elements
+	size_t pos = 0;
+	while (pos < (size_t)got)
+	{
+	    size_t n = iov[x].iov_len - skip;
+	    if (n > got - pos)
+		n = got - pos;
+	    memcpy((char*)iov[x].iov_base+skip, buffer+pos, n);
+	    pos  += n;
+	    skip += n;
+	    if (skip == iov[x].iov_len)
+	    {
+		x++;
+		skip = 0;
+	    }
+	}
+	done += got;
+	if ((size_t)got < len)
+	    break;
+    }
+
+    free(buffer);
+    return done;
+}
+
+static ssize_t __mixp_pwritev(MVFS_FILE* file, const struct iovec* iov, int iovcnt, off64_t offset)
+{
+    __FILEOPS_HEAD((ssize_t)-1);
+    if (__mixp_cfid(file) == NULL)
+	return -1;
+
+    size_t chunk = (priv->cfid->iounit ? priv->cfid->iounit : MIXP_WB_BUFSIZE);
+    char* buffer = NULL;
+    ssize_t done = 0;
+    size_t skip = 0;
+    int x = 0;
+
+    for (;;)
+    {
+	while ((x < iovcnt) && (skip == iov[x].iov_len))
+	{
+	    x++;
+	    skip = 0;
+	}
+	if (x >= iovcnt)
+	    break;
+
+	const char* msg;
+	size_t len;
+
+	if (iov[x].iov_len - skip >= chunk)
+	{
+	    msg   = (const char*)iov[x].iov_base+skip;
+	    len   = chunk;
+	    skip += chunk;
+	}
+	else
+	{
+	    if ((buffer == NULL) && ((buffer = malloc(chunk)) == NULL))
+	    {
+		file->errcode = ENOMEM;
+		break;
+	    }
+
+	    // gather as much as fits into one message
+	    len = 0;
+	    while ((x < iovcnt) && (len < chunk))
+	    {
+		size_t n = iov[x].iov_len - skip;
+		if (n > chunk - len)
+		    n = chunk - len;
+		memcpy(buffer+len, (const char*)iov[x].iov_base+skip, n);
+		len  += n;
+		skip += n;
+		if (skip == iov[x].iov_len)
 		{
-		    walk->next = (MIXP_DIRENT*)calloc(1,sizeof(MIXP_DIRENT));
-		    walk = walk->next;
+		    x++;
+		    skip = 0;
 		}
-		walk->stat = newstat;
-		newstat = NULL;
 	    }
+	    msg = buffer;
+	}
+
+	ssize_t s = mixp_pwrite(priv->cfid, msg, len, offset+done);
+	if (s < 0)
+	{
+	    file->errcode = EIO;
+	    break;
 	}
-	priv->dirents = priv->dirptr = entries;
+	done += s;
+	if ((size_t)s < len)
+	    break;
     }
+
+    free(buffer);
+    return ((done == 0) && (file->errcode)) ? -1 : done;
 }
 
 off64_t mvfs_mixpfs_fileops_seek (MVFS_FILE* file, off64_t offset, int whence)
@@ -218,14 +677,44 @@ off64_t mvfs_mixpfs_fileops_seek (MVFS_FILE* file, off64_t offset, int whence)
 	    file->errcode = EINVAL;
 	    return (off64_t)-1;
     }
+
+    priv->eof = 0;
+    return priv->pos;
+}
+
+// fetch handler for the read-ahead engine (called from the prefetch thread)
+static ssize_t __mixp_readahead_fetch(MVFS_FILE* file, void* buf, size_t count, off64_t offset)
+{
+    // errors have to get through - the read paths map them to EOF anyways
+    ssize_t ret = __mixp_pread(file, buf, count, offset);
+    if (ret<0)
+	errno = EIO;
+    return ret;
+}
+
+// flush handler for the write-behind engine (called from the writer thread)
+static ssize_t __mixp_writebehind_flush(MVFS_FILE* file, const void* buf, size_t count, off64_t offset)
+{
+    __FILEOPS_HEAD((ssize_t)-1);
+    ssize_t ret = mixp_pwrite(priv->cfid, buf, count, offset);
+    if (ret<0)
+	errno = EIO;
+    return ret;
 }
 
 ssize_t mvfs_mixpfs_fileops_pread (MVFS_FILE* file, void* buf, size_t count, off64_t offset)
 {
     __FILEOPS_HEAD((ssize_t)-1);
 
-    memset(buf, 0, count);
-    ssize_t ret = mixp_pread(priv->cfid, buf, count, offset);
+    if (mvfs_writebehind_barrier(file, priv->pos) < 0)
+	return -1;
+
+    ssize_t ret;
+    if (file->readahead)
+	ret = mvfs_readahead_pread(file, buf, count, offset);
+    else
+	ret = __mixp_pread(file, buf, count, offset);
+
     if (ret<1)		// 0 and -1 signal EOF ;-o
     {
 	priv->eof=1;
@@ -239,8 +728,16 @@ ssize_t mvfs_mixpfs_fileops_pread (MVFS_FILE* file, void* buf, size_t count, off
 ssize_t mvfs_mixpfs_fileops_read (MVFS_FILE* file, void* buf, size_t count)
 {
     __FILEOPS_HEAD((ssize_t)-1);
-    memset(buf, 0, count);
-    ssize_t ret = mixp_read(priv->cfid, buf, count);
+
+    if (mvfs_writebehind_barrier(file, priv->pos) < 0)
+	return -1;
+
+    ssize_t ret;
+    if (file->readahead)
+	ret = mvfs_readahead_pread(file, buf, count, priv->pos);
+    else
+	ret = __mixp_pread(file, buf, count, priv->pos);
+
     if (ret<1)		// 0 and -1 signal EOF ;-o
     {
 	priv->eof=1;
@@ -251,19 +748,138 @@ ssize_t mvfs_mixpfs_fileops_read (MVFS_FILE* file, void* buf, size_t count)
     return ret;
 }
 
+// libmixp doesn't give away its receive buffers, so we can only lend
+// from the read-ahead window
+ssize_t mvfs_mixpfs_fileops_read_into (MVFS_FILE* file, const void** data, size_t count)
+{
+    __FILEOPS_HEAD((ssize_t)-1);
+
+    if (file->readahead == NULL)
+	return mvfs_default_fileops_read_into(file, data, count);
+
+    if (mvfs_writebehind_barrier(file, priv->pos) < 0)
+	return -1;
+
+    ssize_t ret = mvfs_readahead_lend(file, data, count, priv->pos);
+    if (ret<1)
+    {
+	priv->eof=1;
+	return 0;
+    }
+
+    priv->pos+=ret;
+    return ret;
+}
+
+int mvfs_mixpfs_fileops_release (MVFS_FILE* file, const void* data)
+{
+    if (mvfs_readahead_release(file, data))
+	return 0;
+    return mvfs_default_fileops_release(file, data);
+}
+
 ssize_t mvfs_mixpfs_fileops_write (MVFS_FILE* file, const void* buf, size_t count)
 {
     __FILEOPS_HEAD((ssize_t)-1);
-    ssize_t s = mixp_write(priv->cfid, buf, count);
-    priv->pos+=s;
+
+    if (file->writebehind)
+    {
+	ssize_t s = mvfs_writebehind_pwrite(file, buf, count, priv->pos);
+	if (s>0)
+	    priv->pos+=s;
+	return s;
+    }
+
+    if (__mixp_cfid(file) == NULL)
+	return -1;
+
+    // reads go to priv->pos, so writes have to as well
+    ssize_t s = mixp_pwrite(priv->cfid, buf, count, priv->pos);
+    if (s>0)
+	priv->pos+=s;
+    mvfs_readahead_invalidate(file, priv->pos);
     return s;
 }
 
 ssize_t mvfs_mixpfs_fileops_pwrite (MVFS_FILE* file, const void* buf, size_t count, off64_t offset)
 {
     __FILEOPS_HEAD(-1);
+
+    // positional - the file position stays where it is
+    if (file->writebehind)
+	return mvfs_writebehind_pwrite(file, buf, count, offset);
+
+    if (__mixp_cfid(file) == NULL)
+	return -1;
+
     ssize_t s = mixp_pwrite(priv->cfid, buf, count, offset);
-    priv->pos+=s;
+    if (s>0)
+	mvfs_readahead_invalidate(file, offset);
+    return s;
+}
+
+ssize_t mvfs_mixpfs_fileops_readv (MVFS_FILE* file, const struct iovec* iov, int iovcnt)
+{
+    __FILEOPS_HEAD((ssize_t)-1);
+
+    if (file->readahead)
+	return mvfs_default_fileops_readv(file, iov, iovcnt);
+
+    if (mvfs_writebehind_barrier(file, priv->pos) < 0)
+	return -1;
+
+    ssize_t ret = __mixp_preadv(file, iov, iovcnt, priv->pos);
+    if (ret<1)
+    {
+	priv->eof=1;
+	return 0;
+    }
+
+    priv->pos+=ret;
+    return ret;
+}
+
+// unlike pread(), the vectored variants leave the file position alone
+ssize_t mvfs_mixpfs_fileops_preadv (MVFS_FILE* file, const struct iovec* iov, int iovcnt, off64_t offset)
+{
+    __FILEOPS_HEAD((ssize_t)-1);
+
+    if (file->readahead)
+	return mvfs_default_fileops_preadv(file, iov, iovcnt, offset);
+
+    if (mvfs_writebehind_barrier(file, priv->pos) < 0)
+	return -1;
+
+    return __mixp_preadv(file, iov, iovcnt, offset);
+}
+
+ssize_t mvfs_mixpfs_fileops_writev (MVFS_FILE* file, const struct iovec* iov, int iovcnt)
+{
+    __FILEOPS_HEAD((ssize_t)-1);
+
+    // write-behind coalesces on its own
+    if (file->writebehind)
+	return mvfs_default_fileops_writev(file, iov, iovcnt);
+
+    file->errcode = 0;
+    ssize_t s = __mixp_pwritev(file, iov, iovcnt, priv->pos);
+    if (s>0)
+	priv->pos+=s;
+    mvfs_readahead_invalidate(file, priv->pos);
+    return s;
+}
+
+ssize_t mvfs_mixpfs_fileops_pwritev (MVFS_FILE* file, const struct iovec* iov, int iovcnt, off64_t offset)
+{
+    __FILEOPS_HEAD((ssize_t)-1);
+
+    if (file->writebehind)
+	return mvfs_default_fileops_pwritev(file, iov, iovcnt, offset);
+
+    file->errcode = 0;
+    ssize_t s = __mixp_pwritev(file, iov, iovcnt, offset);
+    if (s>0)
+	mvfs_readahead_invalidate(file, offset);
     return s;
 }
 
@@ -276,6 +892,10 @@ static inline const char* __mvfs_flag2str(MVFS_FILE_FLAG f)
 	case WRITE_TIMEOUT:	return "WRITE_TIMEOUT";
 	case READ_AHEAD:	return "READ_AHEAD";
 	case WRITE_ASYNC:	return "WRITE_ASYNNC";
+	case READ_AHEAD_HITS:	return "READ_AHEAD_HITS";
+	case READ_AHEAD_MISSES:	return "READ_AHEAD_MISSES";
+	case READ_PIPELINE:	return "READ_PIPELINE";
+	case SCAN_NAMES_ONLY:	return "SCAN_NAMES_ONLY";
 	default:		return "UNKNOWN";
     }
 }
@@ -283,14 +903,69 @@ static inline const char* __mvfs_flag2str(MVFS_FILE_FLAG f)
 int mvfs_mixpfs_fileops_setflag (MVFS_FILE* file, MVFS_FILE_FLAG flag, long value)
 {
     __FILEOPS_HEAD(-1);
-    DEBUGMSG("%s not supported", __mvfs_flag2str(flag));
-    file->errcode = EINVAL;
-    return -1;
+    int ret;
+
+    switch (flag)
+    {
+	case READ_AHEAD:
+	    if (value <= 0)
+		return mvfs_readahead_stop(file);
+	    // the prefetch thread mustn't race us in opening the fid
+	    if (__mixp_cfid(file) == NULL)
+		return -1;
+	    if ((ret = mvfs_readahead_start(file, __mixp_readahead_fetch, value, priv->pos)) < 0)
+	    {
+		file->errcode = -ret;
+		return -1;
+	    }
+	    return 0;
+	case READ_PIPELINE:
+	    if (value > MIXP_PIPELINE_MAX)
+		value = MIXP_PIPELINE_MAX;
+	    {
+		pthread_mutex_lock(&priv->pipelock);
+		MIXP_PIPELINE* pipe = priv->pipe;
+		priv->pipe = NULL;
+		priv->pipeline = value;		// workers get started on the next large read
+		pthread_mutex_unlock(&priv->pipelock);
+		if (pipe)
+		    __mixp_pipeline_free(pipe);
+	    }
+	    return 0;
+	case WRITE_ASYNC:
+	    if (value <= 0)
+		return mvfs_writebehind_stop(file);
+	    if (__mixp_cfid(file) == NULL)
+		return -1;
+	    // coalesce into iounit sized chunks, so each one fits into one Twrite
+	    if ((ret = mvfs_writebehind_start(file, __mixp_writebehind_flush,
+		    (priv->cfid->iounit ? priv->cfid->iounit : MIXP_WB_BUFSIZE), value)) < 0)
+	    {
+		file->errcode = -ret;
+		return -1;
+	    }
+	    return 0;
+	default:
+	    DEBUGMSG("%s not supported", __mvfs_flag2str(flag));
+	    file->errcode = EINVAL;
+	    return -1;
+    }
 }
 
 int mvfs_mixpfs_fileops_getflag (MVFS_FILE* file, MVFS_FILE_FLAG flag, long* value)
 {
     __FILEOPS_HEAD(-1);
+    if (mvfs_readahead_getflag(file, flag, value))
+	return 0;
+    if (mvfs_writebehind_getflag(file, flag, value))
+	return 0;
+    if (flag == READ_PIPELINE)
+    {
+	if (value)
+	    *value = priv->pipeline;
+	return 0;
+    }
+
     DEBUGMSG("%s not supported", __mvfs_flag2str(flag));
     file->errcode = EINVAL;
     return -1;
@@ -304,11 +979,9 @@ static inline MVFS_STAT* _convert_stat(MIXP_STAT* st)
 	return NULL;
     }
 
-    MVFS_STAT* stat_mvfs = (MVFS_STAT*)calloc(1,sizeof(MVFS_STAT));
-
-    stat_mvfs->name  = SSTRDUP(st->name);
-    stat_mvfs->uid   = SSTRDUP(st->uid);
-    stat_mvfs->gid   = SSTRDUP(st->gid);
+    MVFS_STAT* stat_mvfs = mvfs_stat_alloc(st->name, st->uid, st->gid);
+    if (stat_mvfs == NULL)
+	return NULL;
 
     stat_mvfs->mode  = 0;
     stat_mvfs->size  = st->length;
@@ -360,6 +1033,18 @@ static inline MVFS_STAT* _convert_stat(MIXP_STAT* st)
 MVFS_STAT* mvfs_mixpfs_fileops_stat(MVFS_FILE* file)
 {
     __FILEOPS_HEAD(NULL);
+    if (mvfs_writebehind_flush(file) < 0)
+	return NULL;
+
+    // fresh from the lookup - no need to ask again
+    if (priv->stat)
+    {
+	MVFS_STAT* st = priv->stat;
+	priv->stat = NULL;
+	file->errcode = 0;
+	return st;
+    }
+
     MIXP_STAT* mst = mixp_stat(MIXP_FS_CLIENT(file->fs), priv->pathname);
     MVFS_STAT* st = _convert_stat(mst);
     if (st == NULL)
@@ -370,6 +1055,22 @@ MVFS_STAT* mvfs_mixpfs_fileops_stat(MVFS_FILE* file)
     return st;
 }
 
+static MVFS_FILE* __mixp_file_alloc(MVFS_FILESYSTEM* fs, const char* name, int omode, MIXP_CFID* fid)
+{
+    MVFS_FILE* file = mvfs_file_alloc(fs,mixpfs_fileops);
+    MIXP_FILE_PRIV* priv = calloc(1,sizeof(MIXP_FILE_PRIV));
+    file->priv.ptr = priv;
+    
+    priv->cfid = fid;
+    priv->omode = omode;
+    priv->pos  = 0;
+    priv->pathname = SSTRDUP(name);
+    priv->pipeline = MIXP_FS_PRIV(fs)->pipeline;
+    pthread_mutex_init(&priv->pipelock, NULL);
+
+    return file;
+}
+
 // FIXME: handle the various file modes !!!
 MVFS_FILE* mvfs_mixpfs_fsops_open(MVFS_FILESYSTEM* fs, const char* name, mode_t mode)
 {
@@ -388,16 +1089,8 @@ MVFS_FILE* mvfs_mixpfs_fsops_open(MVFS_FILESYSTEM* fs, const char* name, mode_t
 	fs->errcode = ENOENT;
 	return NULL;
     }
-    
-    MVFS_FILE* file = mvfs_file_alloc(fs,mixpfs_fileops);
-    MIXP_FILE_PRIV* priv = calloc(1,sizeof(MIXP_FILE_PRIV));
-    file->priv.ptr = priv;
-    
-    priv->cfid = fid;
-    priv->pos  = 0;
-    priv->pathname = SSTRDUP(name);
 
-    return file;
+    return __mixp_file_alloc(fs, name, m, fid);
 }
 
 MVFS_STAT* mvfs_mixpfs_fsops_stat(MVFS_FILESYSTEM* fs, const char* name)
@@ -409,15 +1102,17 @@ MVFS_STAT* mvfs_mixpfs_fsops_stat(MVFS_FILESYSTEM* fs, const char* name)
     }
 
     MIXP_STAT* mst = mixp_stat(MIXP_FS_CLIENT(fs), name);
-    MVFS_STAT* st = _convert_stat(mst);
-    mixp_stat_free(mst);
-    if (st == NULL)
+    if (mst == NULL)
     {
-	ERRMSG("NULL stat");
-	fs->errcode = EINVAL;
+	// libmixp doesn't tell why - an failed walk is by far the most
+	// common reason, and callers (eg. metacache) rely on ENOENT
+	DEBUGMSG("NULL stat for %s", name);
+	fs->errcode = ENOENT;
 	return NULL;
     }
 
+    MVFS_STAT* st = _convert_stat(mst);
+    mixp_stat_free(mst);
     return st;
 }
 
@@ -453,15 +1148,34 @@ MVFS_FILESYSTEM* mvfs_mixpfs_create_args(MVFS_ARGS* args)
 	return NULL;
     }
 
+    MIXP_FS_PRIV* fspriv = (MIXP_FS_PRIV*)calloc(1,sizeof(MIXP_FS_PRIV));
+    fspriv->client = client;
+
+    const char* pipeline = mvfs_args_get(args,"pipeline");
+    if (pipeline)
+	fspriv->pipeline = atoi(pipeline);
+    if (fspriv->pipeline > MIXP_PIPELINE_MAX)
+	fspriv->pipeline = MIXP_PIPELINE_MAX;
+
     MVFS_FILESYSTEM* fs = mvfs_fs_alloc(mixpfs_fsops,FS_MAGIC);
-    fs->priv.ptr=client;
+    fs->priv.ptr=fspriv;
 
     return fs;
 }
 
+static int mvfs_mixpfs_fsops_free(MVFS_FILESYSTEM* fs)
+{
+    free(fs->priv.ptr);
+    fs->priv.ptr = NULL;
+    return 0;
+}
+
 int mvfs_mixpfs_fileops_close(MVFS_FILE* file)
 {
     __FILEOPS_HEAD(-1);
+    int ret = mvfs_writebehind_stop(file);
+    mvfs_readahead_stop(file);
+    __mixp_pipeline_stop(file);
     if (priv->cfid)
 	mixp_close(priv->cfid);
     priv->cfid=NULL;
@@ -470,15 +1184,21 @@ int mvfs_mixpfs_fileops_close(MVFS_FILE* file)
     if (priv->pathname)
 	free(priv->pathname);
     priv->pathname = NULL;
-    return 0;
+    if (priv->stat)
+	mvfs_stat_free(priv->stat);
+    priv->stat = NULL;
+    __mixp_flushdir(file);
+    return ret;
 }
 
 int mvfs_mixpfs_fileops_free(MVFS_FILE* file)
 {
     __FILEOPS_HEAD(-1);
     mvfs_mixpfs_fileops_close(file);
+    pthread_mutex_destroy(&priv->pipelock);
     free(priv);
     file->priv.ptr = NULL;
+    mvfs_fs_unref(file->fs);
     return 0;
 }
 
@@ -488,6 +1208,19 @@ int mvfs_mixpfs_fileops_eof(MVFS_FILE* file)
     return ((priv->eof) ? 1 : 0);
 }
 
+// find an entry in the loaded directory listing, starting where the last one was found
+static MIXP_DIRENT* __mixp_dirent_find(MIXP_FILE_PRIV* priv, const char* name)
+{
+    MIXP_DIRENT* walk;
+    for (walk=priv->dirhint; walk; walk=walk->next)
+	if ((walk->stat) && (walk->stat->name) && (!strcmp(walk->stat->name, name)))
+	    return (priv->dirhint = walk);
+    for (walk=priv->dirents; walk != priv->dirhint; walk=walk->next)
+	if ((walk->stat) && (walk->stat->name) && (!strcmp(walk->stat->name, name)))
+	    return (priv->dirhint = walk);
+    return NULL;
+}
+
 MVFS_FILE* mvfs_mixpfs_fileops_lookup(MVFS_FILE* file, const char* name)
 {
     __FILEOPS_HEAD(NULL);
@@ -497,7 +1230,33 @@ MVFS_FILE* mvfs_mixpfs_fileops_lookup(MVFS_FILE* file, const char* name)
 
     DEBUGMSG("name=\"%s\" oldname=\"%s\" newname=\"%s\"", name, priv->pathname, buffer);
 
-    MVFS_FILE* newfile = mvfs_mixpfs_fsops_open(file->fs, buffer, O_RDONLY);
+    // already listed - otherwise it might have been created meanwhile
+    MVFS_STAT* st = NULL;
+    MIXP_DIRENT* ent = (priv->dirents ? __mixp_dirent_find(priv, name) : NULL);
+    if (ent)
+	st = _convert_stat(ent->stat);
+    else
+    {
+	MIXP_STAT* mst = mixp_stat(MIXP_FS_CLIENT(file->fs), buffer);
+	if (mst)
+	{
+	    st = _convert_stat(mst);
+	    mixp_stat_free(mst);
+	}
+    }
+
+    if (st == NULL)
+    {
+	DEBUGMSG("couldnt find file: \"%s\"", buffer);
+	file->errcode = ENOENT;
+	free(buffer);
+	return NULL;
+    }
+
+    MVFS_FILE* newfile = __mixp_file_alloc(file->fs, buffer, P9_OREAD, NULL);
+    MIXP_FILE_PRIV* newpriv = (MIXP_FILE_PRIV*)(newfile->priv.ptr);
+    newpriv->type = (st->mode & S_IFMT);
+    newpriv->stat = st;
     free(buffer);
     return newfile;
 }
@@ -505,7 +1264,8 @@ MVFS_FILE* mvfs_mixpfs_fileops_lookup(MVFS_FILE* file, const char* name)
 MVFS_STAT* mvfs_mixpfs_fileops_scan(MVFS_FILE* file)
 {
     __FILEOPS_HEAD(NULL);
-    __mixp_readdir(file);
+    int ret = __mixp_readdir(file);
+    file->errcode = ((ret < 0) ? -ret : 0);
 
     if (priv->dirptr == NULL)
 	return NULL;
@@ -522,10 +1282,45 @@ MVFS_STAT* mvfs_mixpfs_fileops_scan(MVFS_FILE* file)
     return stat;
 }
 
+// the whole directory has been read in already - just convert the entries
+ssize_t mvfs_mixpfs_fileops_scan_batch(MVFS_FILE* file, MVFS_STAT** stats, size_t max)
+{
+    __FILEOPS_HEAD(-1);
+    int ret = __mixp_readdir(file);
+    if (ret < 0)
+    {
+	file->errcode = -ret;
+	return -1;
+    }
+
+    size_t count = 0;
+    while ((count < max) && (priv->dirptr))
+    {
+	MIXP_STAT* st = priv->dirptr->stat;
+	if (st == NULL)
+	{
+	    ERRMSG("UH! got an empty list entry!");
+	    break;
+	}
+
+	MVFS_STAT* stat = _convert_stat(st);
+	if (stat == NULL)
+	    break;
+	stats[count++] = stat;
+	priv->dirptr = priv->dirptr->next;
+    }
+    return count;
+}
+
 int mvfs_mixpfs_fileops_reset(MVFS_FILE* file)
 {
     __FILEOPS_HEAD(-1);
-    __mixp_readdir(file);
+    int ret = __mixp_readdir(file);
+    if (ret < 0)
+    {
+	file->errcode = -ret;
+	return -1;
+    }
     priv->dirptr = priv->dirents;
     return ((priv->dirptr == NULL) ? 0 : 1);
 }
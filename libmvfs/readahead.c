@@ -0,0 +1,437 @@
+/*
+    libmvfs - metux Virtual Filesystem Library
+
+    Read-ahead engine
+
+    A background thread keeps a window of data right behind the
+    reader's current position, so sequential reads are served from
+    memory instead of waiting for an backend round trip each.
+
+    Backends may not cope with concurrent requests on one file (eg.
+    libmixp allows only one per fid), so fetches - the prefetcher's
+    as well as direct ones on random access - are serialized.
+
+    Readers just advance the window's head, only the prefetcher moves
+    the remaining data to the front when it needs room at the end - so
+    small reads through a large window don't memmove it each time.
+
+    Several threads may read through the engine at once. Stopping it
+    (also by mvfs_readahead_start() replacing it) lets readers still
+    waiting for data return and waits for everyone inside to leave
+    before freeing. Calls which haven't got in yet can't be held off,
+    since the file has no lock of its own: the caller has to make sure
+    no new reads start while the engine is stopped or replaced.
+
+    Copyright (C) 2008 Enrico Weigelt, metux IT service <weigelt@metux.de>
+    This code is published under the terms of the GNU Public License 2.0
+*/
+
+#include "mvfs-internal.h"
+
+#include <string.h>
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+
+#include <mvfs/mvfs.h>
+#include <mvfs/_utils.h>
+
+#include "readahead.h"
+
+// maximum chunk size the prefetch thread asks the backend for at once
+#define RA_BLOCKSIZE	65536
+
+struct __mvfs_readahead
+{
+    MVFS_FILE*			fp;
+    MVFS_READAHEAD_FETCH	fetch;
+    pthread_t			thread;
+    pthread_mutex_t		lock;
+    pthread_mutex_t		fetchlock;	// one fetch at a time - never taken with lock held
+    pthread_cond_t		cond;
+    char*			window;		// window[head] holds the byte at file offset start
+    size_t			size;
+    size_t			blocksize;
+    off64_t			start;
+    size_t			head;
+    size_t			fill;
+    size_t			lent;		// bytes at head currently lent out
+    int				eof;
+    int				error;
+    int				shutdown;
+    int				users;		// callers inside pread/lend/... - stop waits for them
+    unsigned long		generation;	// bumped whenever the window gets repositioned
+    long			hits;
+    long			misses;
+};
+
+// drop n bytes from the window head - start+fill and head+fill stay the same,
+// so the prefetch thread can fetch right into the window's tail meanwhile
+static inline void _slide(MVFS_READAHEAD* ra, size_t n)
+{
+    ra->fill  -= n;
+    ra->start += n;
+    ra->head  += n;
+}
+
+// give back lent data, so it may be dropped from the window
+static inline void _return_lent(MVFS_READAHEAD* ra)
+{
+    if (ra->lent == 0)
+	return;
+    _slide(ra, ra->lent);
+    ra->lent = 0;
+    pthread_cond_broadcast(&ra->cond);
+}
+
+// callers (not the prefetcher) entering / leaving the engine - lock held
+static inline void _enter(MVFS_READAHEAD* ra)
+{
+    ra->users++;
+}
+
+static inline void _leave(MVFS_READAHEAD* ra)
+{
+    if ((--ra->users == 0) && (ra->shutdown))
+	pthread_cond_broadcast(&ra->cond);
+}
+
+static inline void _reposition(MVFS_READAHEAD* ra, off64_t pos)
+{
+    ra->generation++;
+    ra->start = pos;
+    ra->head  = 0;
+    ra->fill  = 0;
+    ra->lent  = 0;
+    ra->eof   = 0;
+    ra->error = 0;
+    pthread_cond_broadcast(&ra->cond);
+}
+
+static void* _prefetch_thread(void* arg)
+{
+    MVFS_READAHEAD* ra = (MVFS_READAHEAD*)arg;
+
+    pthread_mutex_lock(&ra->lock);
+    while (!ra->shutdown)
+    {
+	if (ra->eof || ra->error || (ra->fill >= ra->size))
+	{
+	    pthread_cond_wait(&ra->cond, &ra->lock);
+	    continue;
+	}
+
+	unsigned long gen = ra->generation;
+	off64_t offset = ra->start + ra->fill;
+	size_t  count  = ra->size - ra->fill;
+	if (count > ra->blocksize)
+	    count = ra->blocksize;
+
+	// only we move the data to the front, the reader just advances head
+	if (ra->head + ra->fill + count > ra->size)
+	{
+	    // can't move data which is lent out - wait for its release
+	    if (ra->lent)
+	    {
+		pthread_cond_wait(&ra->cond, &ra->lock);
+		continue;
+	    }
+	    memmove(ra->window, ra->window+ra->head, ra->fill);
+	    ra->head = 0;
+	}
+
+	char* tail = ra->window + ra->head + ra->fill;
+	pthread_mutex_unlock(&ra->lock);
+	pthread_mutex_lock(&ra->fetchlock);
+	errno = 0;
+	ssize_t got = ra->fetch(ra->fp, tail, count, offset);
+	int err = errno;
+	pthread_mutex_unlock(&ra->fetchlock);
+	pthread_mutex_lock(&ra->lock);
+
+	// the reader moved the window meanwhile - data is useless now
+	if (gen != ra->generation)
+	    continue;
+
+	// the reader only slides the window while we're fetching, so
+	// start+fill still points to the offset we've just fetched
+	if (got < 0)
+	    ra->error = (err ? err : EIO);
+	else if (got == 0)
+	    ra->eof = 1;
+	else
+	    ra->fill += got;
+	pthread_cond_broadcast(&ra->cond);
+    }
+    pthread_mutex_unlock(&ra->lock);
+    return NULL;
+}
+
+int mvfs_readahead_start(MVFS_FILE* fp, MVFS_READAHEAD_FETCH fetch, size_t window, off64_t pos)
+{
+    if ((fp == NULL) || (fetch == NULL) || (window == 0))
+	return -EINVAL;
+
+    mvfs_readahead_stop(fp);
+
+    MVFS_READAHEAD* ra = (MVFS_READAHEAD*)calloc(1,sizeof(MVFS_READAHEAD));
+    ra->fp        = fp;
+    ra->fetch     = fetch;
+    ra->size      = window;
+    ra->blocksize = ((window < RA_BLOCKSIZE) ? window : RA_BLOCKSIZE);
+    ra->start     = pos;
+    ra->window    = malloc(ra->size);
+
+    if (ra->window == NULL)
+    {
+	ERRMSG("cannot allocate %ld bytes read-ahead window", (long)window);
+	free(ra);
+	return -ENOMEM;
+    }
+
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_mutex_init(&ra->fetchlock, NULL);
+    pthread_cond_init(&ra->cond, NULL);
+
+    if (pthread_create(&ra->thread, NULL, _prefetch_thread, ra) != 0)
+    {
+	ERRMSG("cannot start prefetch thread");
+	pthread_mutex_destroy(&ra->lock);
+	pthread_mutex_destroy(&ra->fetchlock);
+	pthread_cond_destroy(&ra->cond);
+	free(ra->window);
+	free(ra);
+	return -EAGAIN;
+    }
+
+    fp->readahead = ra;
+    return 0;
+}
+
+int mvfs_readahead_stop(MVFS_FILE* fp)
+{
+    if ((fp == NULL) || (fp->readahead == NULL))
+	return 0;
+
+    MVFS_READAHEAD* ra = fp->readahead;
+    fp->readahead = NULL;
+
+    // readers waiting for data give up on shutdown - let them leave first
+    pthread_mutex_lock(&ra->lock);
+    ra->shutdown = 1;
+    pthread_cond_broadcast(&ra->cond);
+    while (ra->users)
+	pthread_cond_wait(&ra->cond, &ra->lock);
+    pthread_mutex_unlock(&ra->lock);
+    pthread_join(ra->thread, NULL);
+
+    DEBUGMSG("hits=%ld misses=%ld", ra->hits, ra->misses);
+
+    pthread_mutex_destroy(&ra->lock);
+    pthread_mutex_destroy(&ra->fetchlock);
+    pthread_cond_destroy(&ra->cond);
+    free(ra->window);
+    free(ra);
+    return 0;
+}
+
+int mvfs_readahead_invalidate(MVFS_FILE* fp, off64_t pos)
+{
+    if ((fp == NULL) || (fp->readahead == NULL))
+	return 0;
+
+    MVFS_READAHEAD* ra = fp->readahead;
+    pthread_mutex_lock(&ra->lock);
+    _reposition(ra, (pos < 0) ? ra->start : pos);
+    pthread_mutex_unlock(&ra->lock);
+    return 0;
+}
+
+ssize_t mvfs_readahead_pread(MVFS_FILE* fp, void* buf, size_t count, off64_t offset)
+{
+    MVFS_READAHEAD* ra = fp->readahead;
+    if (ra == NULL)
+    {
+	fp->errcode = EINVAL;
+	return -1;
+    }
+
+    if (count == 0)
+	return 0;
+
+    pthread_mutex_lock(&ra->lock);
+    _enter(ra);
+    _return_lent(ra);
+
+    // within the window (or right at its end): consume from memory,
+    // waiting for the prefetcher if it hasn't caught up yet
+    if ((offset >= ra->start) && (offset <= ra->start + (off64_t)ra->fill))
+    {
+	size_t done = 0;
+	_slide(ra, offset - ra->start);
+	ra->hits++;
+
+	while (done < count)
+	{
+	    if (ra->fill)
+	    {
+		size_t n = count - done;
+		if (n > ra->fill)
+		    n = ra->fill;
+		memcpy((char*)buf+done, ra->window+ra->head, n);
+		_slide(ra, n);
+		done += n;
+		pthread_cond_broadcast(&ra->cond);
+		continue;
+	    }
+
+	    if (ra->eof || ra->shutdown)
+		break;
+
+	    if (ra->error)
+	    {
+		int err = ra->error;
+		ra->error = 0;		// let the prefetcher retry on next call
+		pthread_cond_broadcast(&ra->cond);
+		if (done)
+		    break;
+		_leave(ra);
+		pthread_mutex_unlock(&ra->lock);
+		fp->errcode = err;
+		return -1;
+	    }
+
+	    pthread_cond_wait(&ra->cond, &ra->lock);
+	}
+
+	_leave(ra);
+	pthread_mutex_unlock(&ra->lock);
+	fp->errcode = 0;
+	return done;
+    }
+
+    // random access: fetch directly and let the prefetcher continue behind it
+    // - waits for an fetch still in flight, whose data is outdated anyways
+    ra->misses++;
+    _reposition(ra, offset+count);
+    pthread_mutex_unlock(&ra->lock);
+
+    pthread_mutex_lock(&ra->fetchlock);
+    errno = 0;
+    ssize_t got = ra->fetch(fp, buf, count, offset);
+    int err = errno;
+    pthread_mutex_unlock(&ra->fetchlock);
+
+    pthread_mutex_lock(&ra->lock);
+    // short read - the prefetcher is behind EOF (or a gap) now
+    if ((got >= 0) && ((size_t)got < count))
+	_reposition(ra, offset+got);
+    _leave(ra);
+    pthread_mutex_unlock(&ra->lock);
+
+    if (got < 0)
+    {
+	fp->errcode = (err ? err : EIO);
+	return -1;
+    }
+
+    fp->errcode = 0;
+    return got;
+}
+
+ssize_t mvfs_readahead_lend(MVFS_FILE* fp, const void** data, size_t count, off64_t offset)
+{
+    MVFS_READAHEAD* ra = fp->readahead;
+    if (ra == NULL)
+    {
+	fp->errcode = EINVAL;
+	return -1;
+    }
+
+    pthread_mutex_lock(&ra->lock);
+    _enter(ra);
+    _return_lent(ra);
+
+    if ((offset >= ra->start) && (offset <= ra->start + (off64_t)ra->fill))
+    {
+	_slide(ra, offset - ra->start);
+	ra->hits++;
+    }
+    else
+    {
+	// nothing to copy into - just move the window and wait for it
+	ra->misses++;
+	_reposition(ra, offset);
+    }
+
+    while ((ra->fill == 0) && !ra->eof && !ra->error && !ra->shutdown)
+	pthread_cond_wait(&ra->cond, &ra->lock);
+
+    if (ra->fill)
+    {
+	size_t n = ((count < ra->fill) ? count : ra->fill);
+	ra->lent = n;
+	*data = ra->window + ra->head;
+	_leave(ra);
+	pthread_mutex_unlock(&ra->lock);
+	fp->errcode = 0;
+	return n;
+    }
+
+    int err = ra->error;
+    ra->error = 0;
+    pthread_cond_broadcast(&ra->cond);
+    _leave(ra);
+    pthread_mutex_unlock(&ra->lock);
+
+    *data = NULL;
+    if (err)
+    {
+	fp->errcode = err;
+	return -1;
+    }
+    return 0;
+}
+
+int mvfs_readahead_release(MVFS_FILE* fp, const void* data)
+{
+    MVFS_READAHEAD* ra = fp->readahead;
+    if (ra == NULL)
+	return 0;
+
+    pthread_mutex_lock(&ra->lock);
+    if ((ra->lent == 0) || (data != ra->window + ra->head))
+    {
+	pthread_mutex_unlock(&ra->lock);
+	return 0;
+    }
+    _return_lent(ra);
+    pthread_mutex_unlock(&ra->lock);
+    return 1;
+}
+
+int mvfs_readahead_getflag(MVFS_FILE* fp, MVFS_FILE_FLAG flag, long* value)
+{
+    MVFS_READAHEAD* ra = fp->readahead;
+    long v = 0;
+
+    if ((flag != READ_AHEAD) && (flag != READ_AHEAD_HITS) && (flag != READ_AHEAD_MISSES))
+	return 0;
+
+    if (ra != NULL)
+    {
+	pthread_mutex_lock(&ra->lock);
+	switch (flag)
+	{
+	    case READ_AHEAD:		v = ra->size;	break;
+	    case READ_AHEAD_HITS:	v = ra->hits;	break;
+	    case READ_AHEAD_MISSES:	v = ra->misses;	break;
+	    default:					break;
+	}
+	pthread_mutex_unlock(&ra->lock);
+    }
+
+    if (value)
+	*value = v;
+    return 1;
+}
@@ -0,0 +1,49 @@
+/*
+    libmvfs - metux Virtual Filesystem Library
+
+    Read-ahead engine - internal, don't use outside of libmvfs
+
+    Copyright (C) 2008 Enrico Weigelt, metux IT service <weigelt@metux.de>
+    This code is published under the terms of the GNU Public License 2.0
+*/
+
+#ifndef __MVFS_INTERNAL_READAHEAD_H
+#define __MVFS_INTERNAL_READAHEAD_H
+
+#include <mvfs/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+   driver callback which fetches a chunk directly from the backend.
+   it is called from the prefetch thread, so it must not touch the
+   file's position or errcode. on error it returns -1 and sets errno.
+*/
+typedef ssize_t (*MVFS_READAHEAD_FETCH)(MVFS_FILE* fp, void* buf, size_t count, off64_t offset);
+
+/*
+   start/stop free an running engine: they wait for calls already in
+   progress, but no new ones may start on this file meanwhile.
+*/
+/* start prefetching a window of given size at pos - replaces an already running engine */
+int     mvfs_readahead_start      (MVFS_FILE* fp, MVFS_READAHEAD_FETCH fetch, size_t window, off64_t pos);
+/* stop the prefetch thread and release the window */
+int     mvfs_readahead_stop       (MVFS_FILE* fp);
+/* read through the window - sets fp->errcode on error */
+ssize_t mvfs_readahead_pread      (MVFS_FILE* fp, void* buf, size_t count, off64_t offset);
+/* zero-copy read: lend a pointer into the window - valid until mvfs_readahead_release() */
+ssize_t mvfs_readahead_lend       (MVFS_FILE* fp, const void** data, size_t count, off64_t offset);
+/* give back lent data - returns 0 if data wasn't lent by the read-ahead engine */
+int     mvfs_readahead_release    (MVFS_FILE* fp, const void* data);
+/* drop the window (eg. after writes) and restart prefetching at pos (-1: where the window started) */
+int     mvfs_readahead_invalidate (MVFS_FILE* fp, off64_t pos);
+/* handle READ_AHEAD* flag queries - returns 0 if the flag is not ours */
+int     mvfs_readahead_getflag    (MVFS_FILE* fp, MVFS_FILE_FLAG flag, long* value);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,156 @@
+/*
+    libmvfs - metux Virtual Filesystem Library
+
+    File status objects
+
+    An stat is allocated as one block together with its name, behind an
+    hidden reference counter. Stats are never changed once handed out,
+    so mvfs_stat_dup() just takes another reference - caches can hand
+    out their entries without copying. uid and gid names are interned
+    in an global pool, as there're only few of them.
+
+    Copyright (C) 2008 Enrico Weigelt, metux IT service <weigelt@metux.de>
+    This code is published under the terms of the GNU Public License 2.0
+*/
+
+#include "mvfs-internal.h"
+
+#include <string.h>
+#include <errno.h>
+#include <malloc.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include <mvfs/types.h>
+#include <mvfs/stat.h>
+#include <mvfs/_utils.h>
+
+#define POOL_BUCKETS	64	// must be an power of 2
+
+typedef struct
+{
+    int       refs;
+    MVFS_STAT stat;
+    char      name[];
+} MVFS_STAT_BLOCK;
+
+#define STAT_BLOCK(st)	((MVFS_STAT_BLOCK*)((char*)(st) - offsetof(MVFS_STAT_BLOCK, stat)))
+
+typedef struct __pool_string POOL_STRING;
+
+struct __pool_string
+{
+    POOL_STRING* next;
+    unsigned     hash;
+    char         str[];
+};
+
+// strings are never removed, so found ones can be used without lock
+static POOL_STRING*     _pool[POOL_BUCKETS];
+static pthread_rwlock_t _pool_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static unsigned _hash_name(const char* name)
+{
+    unsigned h = 2166136261u;
+    while (*name)
+	h = (h ^ (unsigned char)*name++) * 16777619u;
+    return h;
+}
+
+static const char* _pool_find(const char* str, unsigned hash)
+{
+    POOL_STRING* p;
+    for (p=_pool[hash & (POOL_BUCKETS-1)]; p; p=p->next)
+	if ((p->hash == hash) && (!strcmp(p->str, str)))
+	    return p->str;
+    return NULL;
+}
+
+const char* mvfs_stat_intern(const char* str)
+{
+    if ((str == NULL) || (*str == 0))
+	return "";
+
+    unsigned hash = _hash_name(str);
+    pthread_rwlock_rdlock(&_pool_lock);
+    const char* found = _pool_find(str, hash);
+    pthread_rwlock_unlock(&_pool_lock);
+    if (found)
+	return found;
+
+    pthread_rwlock_wrlock(&_pool_lock);
+    if ((found = _pool_find(str, hash)) == NULL)
+    {
+	size_t len = strlen(str);
+	POOL_STRING* p = malloc(sizeof(POOL_STRING)+len+1);
+	if (p)
+	{
+	    memcpy(p->str, str, len+1);
+	    p->hash = hash;
+	    p->next = _pool[hash & (POOL_BUCKETS-1)];
+	    _pool[hash & (POOL_BUCKETS-1)] = p;
+	    found = p->str;
+	}
+    }
+    pthread_rwlock_unlock(&_pool_lock);
+
+    if (found == NULL)
+	ERRMSG("out of memory");
+    return (found ? found : "");
+}
+
+int mvfs_stat_free(MVFS_STAT* st)
+{
+    if (st == NULL)
+	return -EFAULT;
+
+    MVFS_STAT_BLOCK* blk = STAT_BLOCK(st);
+    if (__sync_sub_and_fetch(&blk->refs, 1) == 0)
+	free(blk);
+    return 0;
+}
+
+MVFS_STAT* mvfs_stat_dup(MVFS_STAT* st)
+{
+    if (st == NULL)
+	return NULL;
+
+    __sync_fetch_and_add(&STAT_BLOCK(st)->refs, 1);
+    return st;
+}
+
+MVFS_STAT* mvfs_stat_copy(MVFS_STAT* oldst)
+{
+    if (oldst == NULL)
+	return NULL;
+
+    MVFS_STAT* newst = mvfs_stat_alloc(oldst->name, oldst->uid, oldst->gid);
+    if (newst == NULL)
+	return NULL;
+    newst->mode  = oldst->mode;
+    newst->size  = oldst->size;
+    newst->atime = oldst->atime;
+    newst->mtime = oldst->mtime;
+    newst->ctime = oldst->ctime;
+    return newst;
+}
+
+MVFS_STAT* mvfs_stat_alloc(const char* name, const char* uid, const char* gid)
+{
+    size_t len = (name ? strlen(name) : 0);
+    MVFS_STAT_BLOCK* blk = malloc(sizeof(MVFS_STAT_BLOCK)+len+1);
+    if (blk == NULL)
+    {
+	ERRMSG("out of memory");
+	return NULL;
+    }
+
+    memset(blk, 0, sizeof(MVFS_STAT_BLOCK));
+    memcpy(blk->name, (name ? name : ""), len+1);
+    blk->refs      = 1;
+    blk->stat.name = blk->name;
+    blk->stat.uid  = mvfs_stat_intern(uid);
+    blk->stat.gid  = mvfs_stat_intern(gid);
+    return &blk->stat;
+}
@@ -0,0 +1,623 @@
+/*
+    libmvfs - metux Virtual Filesystem Library
+
+    Parallel tree walker
+
+    Every directory is an task. Each worker thread has its own queue:
+    subdirectories found by an scan are pushed to it and popped again
+    newest first (depth first, so few directories are open at once).
+    Idle workers steal the oldest tasks from the others.
+
+    Subdirectories are opened via lookup on their parent, which stays
+    open until all of them are - hostfs then does openat() instead of
+    resolving the whole path again. Drivers without lookup get their
+    directories opened by path.
+
+    In ordered mode the workers just collect the scanned entries in an
+    tree of nodes, which the calling thread emits depth first, waiting
+    for each node's scan to finish. Nodes are freed once emitted. With
+    WALK_MAX_BUFFERED entries waiting, workers don't start new scans
+    until the emitter has caught up halfway, so an slow callback doesn't
+    pile up the whole tree - except for the directory the emitter is
+    waiting for, which one of them fetches out of the queues.
+
+    Copyright (C) 2008 Enrico Weigelt, metux IT service <weigelt@metux.de>
+    This code is published under the terms of the GNU Public License 2.0
+*/
+
+#include "mvfs-internal.h"
+
+#include <string.h>
+#include <errno.h>
+#include <malloc.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <mvfs/mvfs.h>
+#include <mvfs/walk.h>
+#include <mvfs/_utils.h>
+
+#define WALK_BATCH		256
+#define WALK_MAX_THREADS	64
+#define WALK_MAX_BUFFERED	65536	// ordered mode: scanned entries (and nodes) not emitted yet
+
+typedef struct __walk_dirref WALK_DIRREF;
+
+// an scanned directory, kept open for looking up its subdirectories
+struct __walk_dirref
+{
+    MVFS_FILE*      file;
+    int             refs;		// tasks still to be opened
+    pthread_mutex_t lock;		// lookups aren't necessarily thread-safe
+};
+
+typedef struct __walk_node WALK_NODE;
+
+// ordered mode: an directory's entries, waiting to be emitted
+struct __walk_node
+{
+    int         done;			// scanned - protected by the walk's lock
+    size_t      count;
+    MVFS_STAT** entries;
+    WALK_NODE** children;		// per entry, NULL if not descended into
+};
+
+typedef struct __walk_task WALK_TASK;
+
+struct __walk_task
+{
+    WALK_TASK*   newer;			// queue links
+    WALK_TASK*   older;
+    WALK_DIRREF* parent;		// NULL for the root
+    WALK_NODE*   node;			// ordered mode only
+    int          depth;			// of the directory itself - 0 for the root
+    const char*  name;			// last path element
+    char         path[];
+};
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    WALK_TASK*      newest;		// pushed and popped by the owner
+    WALK_TASK*      oldest;		// stolen by the others
+} WALK_QUEUE;
+
+typedef struct
+{
+    MVFS_FILESYSTEM*   fs;
+    MVFS_WALK_CALLBACK callback;
+    MVFS_WALK_OPTS     opts;
+    int                nqueues;
+    WALK_QUEUE*        queues;
+    pthread_mutex_t    lock;		// protects the counters and node states
+    pthread_cond_t     cond;		// new tasks, finished nodes, end of the walk
+    long               queued;		// tasks waiting in the queues - atomic
+    long               pending;		// tasks not finished yet
+    long               buffered;	// ordered mode: entries and nodes not emitted yet - atomic
+    int                throttle;	// ordered mode w/ an concurrent emitter
+    WALK_NODE*         wanted;		// the emitter waits for its scan
+    int                result;		// set once, aborts the walk
+} WALK;
+
+typedef struct
+{
+    WALK*     walk;
+    int       id;
+    pthread_t thread;
+    int       started;
+} WALK_WORKER;
+
+static inline int _aborted(WALK* walk)
+{
+    return __atomic_load_n(&walk->result, __ATOMIC_RELAXED);
+}
+
+// the emitter is done with an entry or node - wake up the workers at half the limit
+static void _consumed(WALK* walk)
+{
+    if (__sync_sub_and_fetch(&walk->buffered, 1) != WALK_MAX_BUFFERED/2)
+	return;
+    pthread_mutex_lock(&walk->lock);
+    pthread_cond_broadcast(&walk->cond);
+    pthread_mutex_unlock(&walk->lock);
+}
+
+static void _abort(WALK* walk, int code)
+{
+    pthread_mutex_lock(&walk->lock);
+    if (walk->result == 0)
+	__atomic_store_n(&walk->result, code, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&walk->cond);
+    pthread_mutex_unlock(&walk->lock);
+}
+
+static inline void _join_path(char* buf, const char* dir, const char* name)
+{
+    size_t len = strlen(dir);
+    if ((len) && (dir[len-1] == '/'))
+	sprintf(buf, "%s%s", dir, name);
+    else
+	sprintf(buf, "%s/%s", dir, name);
+}
+
+static WALK_TASK* _task_alloc(const char* dir, const char* name, int depth, int ordered)
+{
+    size_t len = (dir ? strlen(dir)+1 : 0) + strlen(name);
+    WALK_TASK* task = calloc(1, sizeof(WALK_TASK)+len+1);
+    if (task == NULL)
+	return NULL;
+
+    if (dir)
+    {
+	_join_path(task->path, dir, name);
+	task->name = task->path + strlen(task->path) - strlen(name);
+    }
+    else
+    {
+	strcpy(task->path, name);
+	task->name = task->path;
+    }
+
+    if ((ordered) && ((task->node = calloc(1, sizeof(WALK_NODE))) == NULL))
+    {
+	free(task);
+	return NULL;
+    }
+
+    task->depth = depth;
+    return task;
+}
+
+static void _dirref_put(WALK_DIRREF* ref)
+{
+    if ((ref == NULL) || (__sync_sub_and_fetch(&ref->refs, 1)))
+	return;
+    mvfs_file_close(ref->file);
+    pthread_mutex_destroy(&ref->lock);
+    free(ref);
+}
+
+static void _node_free(WALK_NODE* node)
+{
+    size_t x;
+    if (node == NULL)
+	return;
+    for (x=0; x<node->count; x++)
+    {
+	if (node->entries[x])
+	    mvfs_stat_free(node->entries[x]);
+	_node_free(node->children[x]);
+    }
+    free(node->entries);
+    free(node->children);
+    free(node);
+}
+
+// push an directory's subdirectories - the first one ends up newest
+static void _push(WALK* walk, int self, WALK_TASK* first, WALK_TASK* last, long count)
+{
+    WALK_QUEUE* queue = &walk->queues[self];
+
+    pthread_mutex_lock(&queue->lock);
+    last->older = queue->newest;
+    if (queue->newest)
+	queue->newest->newer = last;
+    else
+	queue->oldest = last;
+    queue->newest = first;
+    pthread_mutex_unlock(&queue->lock);
+
+    pthread_mutex_lock(&walk->lock);
+    __sync_fetch_and_add(&walk->queued, count);
+    walk->pending += count;
+    pthread_cond_broadcast(&walk->cond);
+    pthread_mutex_unlock(&walk->lock);
+}
+
+// queue lock held
+static void _unlink(WALK_QUEUE* queue, WALK_TASK* task)
+{
+    if (task->newer)
+	task->newer->older = task->older;
+    else
+	queue->newest = task->older;
+    if (task->older)
+	task->older->newer = task->newer;
+    else
+	queue->oldest = task->newer;
+    task->newer = task->older = NULL;
+}
+
+static WALK_TASK* _take(WALK_QUEUE* queue, int newest)
+{
+    pthread_mutex_lock(&queue->lock);
+    WALK_TASK* task = (newest ? queue->newest : queue->oldest);
+    if (task)
+	_unlink(queue, task);
+    pthread_mutex_unlock(&queue->lock);
+    return task;
+}
+
+// our own newest task, otherwise steal someone else's oldest
+static WALK_TASK* _pop(WALK* walk, int self)
+{
+    WALK_TASK* task = _take(&walk->queues[self], 1);
+    int x;
+
+    for (x=1; (task == NULL) && (x<walk->nqueues); x++)
+	task = _take(&walk->queues[(self+x) % walk->nqueues], 0);
+
+    if (task)
+	__sync_fetch_and_sub(&walk->queued, 1);
+    return task;
+}
+
+// the task scanning given node - NULL if not queued (anymore)
+static WALK_TASK* _pop_node(WALK* walk, WALK_NODE* node)
+{
+    WALK_TASK* task = NULL;
+    int x;
+
+    for (x=0; (task == NULL) && (x<walk->nqueues); x++)
+    {
+	WALK_QUEUE* queue = &walk->queues[x];
+	pthread_mutex_lock(&queue->lock);
+	for (task=queue->newest; (task) && (task->node != node); task=task->older);
+	if (task)
+	    _unlink(queue, task);
+	pthread_mutex_unlock(&queue->lock);
+    }
+
+    if (task)
+	__sync_fetch_and_sub(&walk->queued, 1);
+    return task;
+}
+
+/*
+   ordered mode: hold off new scans while too much is waiting for the
+   emitter. only the scan it's waiting for may still go - returned
+   if we've got it, NULL when it's time to go on as usual.
+*/
+static WALK_TASK* _throttle(WALK* walk)
+{
+    if ((!walk->throttle) || (__atomic_load_n(&walk->buffered, __ATOMIC_RELAXED) < WALK_MAX_BUFFERED))
+	return NULL;
+
+    WALK_TASK* task = NULL;
+    pthread_mutex_lock(&walk->lock);
+    while ((task == NULL) && (!walk->result) &&
+	   (__atomic_load_n(&walk->buffered, __ATOMIC_RELAXED) >= WALK_MAX_BUFFERED))
+    {
+	if (walk->wanted)
+	{
+	    // just one of us goes looking - it might be in scan already
+	    WALK_NODE* node = walk->wanted;
+	    walk->wanted = NULL;
+	    pthread_mutex_unlock(&walk->lock);
+	    task = _pop_node(walk, node);
+	    pthread_mutex_lock(&walk->lock);
+	    continue;
+	}
+	pthread_cond_wait(&walk->cond, &walk->lock);
+    }
+    pthread_mutex_unlock(&walk->lock);
+    return task;
+}
+
+static MVFS_FILE* _open(WALK* walk, WALK_TASK* task)
+{
+    MVFS_FILE* dir = NULL;
+
+    if (task->parent)
+    {
+	pthread_mutex_lock(&task->parent->lock);
+	dir = mvfs_file_lookup(task->parent->file, task->name);
+	pthread_mutex_unlock(&task->parent->lock);
+	_dirref_put(task->parent);
+	task->parent = NULL;
+    }
+
+    if (dir == NULL)
+	dir = mvfs_fs_openfile(walk->fs, task->path, O_RDONLY);
+
+    if ((dir) && (walk->opts.names_only))
+	mvfs_file_setflag(dir, SCAN_NAMES_ONLY, 1);
+    return dir;
+}
+
+// make room for count more entries in an node
+static int _node_grow(WALK_NODE* node, size_t count)
+{
+    MVFS_STAT** entries = realloc(node->entries, (node->count+count)*sizeof(MVFS_STAT*));
+    if (entries == NULL)
+	return -1;
+    node->entries = entries;
+
+    WALK_NODE** children = realloc(node->children, (node->count+count)*sizeof(WALK_NODE*));
+    if (children == NULL)
+	return -1;
+    node->children = children;
+    return 0;
+}
+
+// scan one directory, queue its subdirectories
+static void _scan(WALK* walk, int self, WALK_TASK* task)
+{
+    MVFS_STAT* stats[WALK_BATCH];
+    WALK_TASK* first = NULL;
+    WALK_TASK* last  = NULL;
+    WALK_NODE* node  = task->node;
+    long nchildren = 0;
+    ssize_t count = 0, x;
+    int depth = task->depth+1;
+
+    MVFS_FILE* dir = _open(walk, task);
+    if (dir == NULL)
+    {
+	if (task->depth == 0)
+	    _abort(walk, -(walk->fs->errcode ? walk->fs->errcode : ENOENT));
+	goto out;
+    }
+
+    while ((!_aborted(walk)) && ((count = mvfs_file_scan_batch(dir, stats, WALK_BATCH)) > 0))
+    {
+	if ((node) && (_node_grow(node, count) < 0))
+	{
+	    for (x=0; x<count; x++)
+		mvfs_stat_free(stats[x]);
+	    _abort(walk, -ENOMEM);
+	    break;
+	}
+	if (node)
+	    __sync_fetch_and_add(&walk->buffered, count);
+
+	for (x=0; x<count; x++)
+	{
+	    MVFS_STAT* st = stats[x];
+	    char path[strlen(task->path)+strlen(st->name)+2];
+	    _join_path(path, task->path, st->name);
+
+	    WALK_TASK* child = NULL;
+	    if ((S_ISDIR(st->mode)) &&
+		((walk->opts.max_depth <= 0) || (depth < walk->opts.max_depth)) &&
+		((walk->opts.filter == NULL) || (walk->opts.filter(path, st, depth, walk->opts.arg))) &&
+		((child = _task_alloc(task->path, st->name, depth, (node != NULL)))))
+	    {
+		if (last)
+		    last->older = child;
+		else
+		    first = child;
+		child->newer = last;
+		last = child;
+		nchildren++;
+	    }
+
+	    if (node)
+	    {
+		node->entries[node->count]  = st;
+		node->children[node->count] = (child ? child->node : NULL);
+		node->count++;
+		continue;
+	    }
+
+	    int ret = walk->callback(path, st, depth, walk->opts.arg);
+	    mvfs_stat_free(st);
+	    if (ret < 0)
+		_abort(walk, ret);
+	}
+    }
+
+    if ((count < 0) && (task->depth == 0))
+	_abort(walk, -(dir->errcode ? dir->errcode : EIO));
+
+    if (nchildren == 0)
+    {
+	mvfs_file_close(dir);
+	goto out;
+    }
+
+    WALK_DIRREF* ref = malloc(sizeof(WALK_DIRREF));
+    if (ref)
+    {
+	ref->file = dir;
+	ref->refs = nchildren;
+	pthread_mutex_init(&ref->lock, NULL);
+    }
+    else
+	mvfs_file_close(dir);
+
+    WALK_TASK* child;
+    for (child=first; child; child=child->older)
+	child->parent = ref;
+    _push(walk, self, first, last, nchildren);
+
+out:
+    if (node)
+	__sync_fetch_and_add(&walk->buffered, 1);
+    pthread_mutex_lock(&walk->lock);
+    if (node)
+	node->done = 1;
+    if (--walk->pending == 0)
+	pthread_cond_broadcast(&walk->cond);
+    else if (node)
+	pthread_cond_broadcast(&walk->cond);
+    pthread_mutex_unlock(&walk->lock);
+    free(task);
+}
+
+static void* _worker(void* arg)
+{
+    WALK_WORKER* worker = (WALK_WORKER*)arg;
+    WALK* walk = worker->walk;
+
+    while (1)
+    {
+	WALK_TASK* task = _throttle(walk);
+	if ((task == NULL) && (!_aborted(walk)))
+	    task = _pop(walk, worker->id);
+	if (task)
+	{
+	    _scan(walk, worker->id, task);
+	    continue;
+	}
+
+	pthread_mutex_lock(&walk->lock);
+	while ((!__atomic_load_n(&walk->queued, __ATOMIC_RELAXED)) && (walk->pending) && (!walk->result))
+	    pthread_cond_wait(&walk->cond, &walk->lock);
+	int stop = ((walk->pending == 0) || (walk->result));
+	pthread_mutex_unlock(&walk->lock);
+	if (stop)
+	    break;
+    }
+
+    return NULL;
+}
+
+// ordered mode: call back depth first, as the scans come in
+static void _emit(WALK* walk, WALK_NODE* node, const char* dirname, int depth)
+{
+    size_t x;
+
+    // throttled workers still have to scan this one
+    pthread_mutex_lock(&walk->lock);
+    if ((!node->done) && (!walk->result))
+    {
+	walk->wanted = node;
+	pthread_cond_broadcast(&walk->cond);
+	while ((!node->done) && (!walk->result))
+	    pthread_cond_wait(&walk->cond, &walk->lock);
+	walk->wanted = NULL;
+    }
+    int done = node->done;
+    pthread_mutex_unlock(&walk->lock);
+    if (!done)
+	return;
+
+    for (x=0; (x<node->count) && (!_aborted(walk)); x++)
+    {
+	MVFS_STAT* st = node->entries[x];
+	char path[strlen(dirname)+strlen(st->name)+2];
+	_join_path(path, dirname, st->name);
+
+	int ret = walk->callback(path, st, depth, walk->opts.arg);
+	node->entries[x] = NULL;
+	mvfs_stat_free(st);
+	_consumed(walk);
+	if (ret < 0)
+	{
+	    _abort(walk, ret);
+	    return;
+	}
+
+	// an aborted walk's nodes may still be in use - freed after the end
+	WALK_NODE* child = node->children[x];
+	if (child)
+	{
+	    _emit(walk, child, path, depth+1);
+	    if (_aborted(walk))
+		return;
+	    node->children[x] = NULL;
+	    _node_free(child);
+	}
+    }
+    _consumed(walk);
+}
+
+int mvfs_walk(MVFS_FILESYSTEM* fs, const char* root, MVFS_WALK_CALLBACK callback, MVFS_WALK_OPTS* opts)
+{
+    if ((fs == NULL) || (root == NULL) || (callback == NULL))
+	return -EFAULT;
+
+    WALK walk;
+    memset(&walk, 0, sizeof(walk));
+    walk.fs       = fs;
+    walk.callback = callback;
+    if (opts)
+	walk.opts = *opts;
+
+    int nthreads = walk.opts.threads;
+    if (nthreads <= 0)
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads <= 0)
+	nthreads = 1;
+    if (nthreads > WALK_MAX_THREADS)
+	nthreads = WALK_MAX_THREADS;
+
+    WALK_TASK* task = _task_alloc(NULL, root, 0, walk.opts.ordered);
+    WALK_WORKER* workers = calloc(nthreads, sizeof(WALK_WORKER));
+    walk.queues = calloc(nthreads, sizeof(WALK_QUEUE));
+    if ((task == NULL) || (workers == NULL) || (walk.queues == NULL))
+    {
+	ERRMSG("out of memory");
+	if (task)
+	    free(task->node);
+	free(task);
+	free(workers);
+	free(walk.queues);
+	return -ENOMEM;
+    }
+
+    int x;
+    walk.nqueues = nthreads;
+    for (x=0; x<nthreads; x++)
+    {
+	pthread_mutex_init(&walk.queues[x].lock, NULL);
+	workers[x].walk = &walk;
+	workers[x].id   = x;
+    }
+    pthread_mutex_init(&walk.lock, NULL);
+    pthread_cond_init(&walk.cond, NULL);
+
+    WALK_NODE* rootnode = task->node;
+    _push(&walk, 0, task, task, 1);
+
+    // unordered: the calling thread works as worker 0
+    walk.throttle = walk.opts.ordered;
+    int started = 0;
+    for (x=(walk.opts.ordered ? 0 : 1); x<nthreads; x++)
+    {
+	if (pthread_create(&workers[x].thread, NULL, _worker, &workers[x]) == 0)
+	{
+	    workers[x].started = 1;
+	    started++;
+	}
+	else
+	    ERRMSG("cannot start worker %d", x);
+    }
+
+    if (!walk.opts.ordered)
+	_worker(&workers[0]);
+    else if (started == 0)
+    {
+	// no one to emit concurrently - scan everything first
+	walk.throttle = 0;
+	_worker(&workers[0]);
+	_emit(&walk, rootnode, root, 1);
+    }
+    else
+	_emit(&walk, rootnode, root, 1);
+
+    for (x=0; x<nthreads; x++)
+	if (workers[x].started)
+	    pthread_join(workers[x].thread, NULL);
+
+    // aborted - drop what's left
+    for (x=0; x<nthreads; x++)
+    {
+	while ((task = _take(&walk.queues[x], 1)))
+	{
+	    _dirref_put(task->parent);
+	    free(task);
+	}
+	pthread_mutex_destroy(&walk.queues[x].lock);
+    }
+    _node_free(rootnode);
+
+    pthread_cond_destroy(&walk.cond);
+    pthread_mutex_destroy(&walk.lock);
+    free(walk.queues);
+    free(workers);
+    return walk.result;
+}
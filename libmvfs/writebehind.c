@@ -0,0 +1,394 @@
+/*
+    libmvfs - metux Virtual Filesystem Library
+
+    Write-behind engine
+
+    Writes are copied into buffers of the backend's preferred size
+    (eg. the 9P iounit) and sent out by a background thread. While an
+    buffer is in flight, subsequent small writes get coalesced into
+    the next one. The number of queued buffers is bounded, writers
+    block once the queue is full.
+
+    Errors are sticky: they're reported by the next write, flush or
+    close, queued buffers behind an failed one get discarded.
+
+    Copyright (C) 2008 Enrico Weigelt, metux IT service <weigelt@metux.de>
+    This code is published under the terms of the GNU Public License 2.0
+*/
+
+#include "mvfs-internal.h"
+
+#include <string.h>
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+
+#include <mvfs/mvfs.h>
+#include <mvfs/_utils.h>
+
+#include "readahead.h"
+#include "writebehind.h"
+
+typedef struct __mvfs_wb_buffer	WB_BUFFER;
+
+struct __mvfs_wb_buffer
+{
+    off64_t	offset;
+    size_t	fill;
+    WB_BUFFER*	next;
+    char	data[];
+};
+
+struct __mvfs_writebehind
+{
+    MVFS_FILE*			fp;
+    MVFS_WRITEBEHIND_FLUSH	flush;
+    pthread_t			thread;
+    pthread_mutex_t		lock;
+    pthread_cond_t		cond;
+    size_t			bufsize;
+    int				depth;
+    WB_BUFFER*			current;	// buffer currently being filled
+    WB_BUFFER*			head;		// queued buffers, oldest first
+    WB_BUFFER*			tail;
+    WB_BUFFER*			unused;		// recycled buffers
+    int				queued;
+    int				busy;		// writer thread has a buffer in flight
+    int				dirty;		// writes accepted since last flush
+    int				error;
+    int				shutdown;
+};
+
+static WB_BUFFER* _buf_get(MVFS_WRITEBEHIND* wb, off64_t offset)
+{
+    WB_BUFFER* b = wb->unused;
+    if (b)
+	wb->unused = b->next;
+    else if ((b = (WB_BUFFER*)malloc(sizeof(WB_BUFFER)+wb->bufsize)) == NULL)
+	return NULL;
+
+    b->offset = offset;
+    b->fill   = 0;
+    b->next   = NULL;
+    return b;
+}
+
+static inline void _buf_put(MVFS_WRITEBEHIND* wb, WB_BUFFER* b)
+{
+    b->next = wb->unused;
+    wb->unused = b;
+}
+
+static inline WB_BUFFER* _dequeue(MVFS_WRITEBEHIND* wb)
+{
+    WB_BUFFER* b = wb->head;
+    if (b == NULL)
+	return NULL;
+    if ((wb->head = b->next) == NULL)
+	wb->tail = NULL;
+    wb->queued--;
+    b->next = NULL;
+    return b;
+}
+
+static inline void _discard_queue(MVFS_WRITEBEHIND* wb)
+{
+    WB_BUFFER* b;
+    while ((b = _dequeue(wb)))
+	_buf_put(wb, b);
+    if (wb->current)
+    {
+	_buf_put(wb, wb->current);
+	wb->current = NULL;
+    }
+}
+
+// move the current buffer to the queue, waiting for room if necessary
+static int _enqueue_current(MVFS_WRITEBEHIND* wb)
+{
+    if (wb->current == NULL)
+	return 0;
+
+    while ((wb->queued >= wb->depth) && (!wb->error))
+	pthread_cond_wait(&wb->cond, &wb->lock);
+
+    if (wb->error)
+	return -1;
+
+    // the writer might have taken it meanwhile
+    WB_BUFFER* b = wb->current;
+    if (b == NULL)
+	return 0;
+    wb->current = NULL;
+    if (b->fill == 0)
+    {
+	_buf_put(wb, b);
+	return 0;
+    }
+
+    if (wb->tail)
+	wb->tail->next = b;
+    else
+	wb->head = b;
+    wb->tail = b;
+    wb->queued++;
+    pthread_cond_broadcast(&wb->cond);
+    return 0;
+}
+
+static void* _writer_thread(void* arg)
+{
+    MVFS_WRITEBEHIND* wb = (MVFS_WRITEBEHIND*)arg;
+
+    pthread_mutex_lock(&wb->lock);
+    for (;;)
+    {
+	WB_BUFFER* b = _dequeue(wb);
+
+	// nothing queued: don't let an partial buffer wait for the next
+	// writes, send it out - following writes coalesce meanwhile
+	if ((b == NULL) && (wb->current) && (wb->current->fill))
+	{
+	    b = wb->current;
+	    wb->current = NULL;
+	}
+
+	if (b == NULL)
+	{
+	    if (wb->shutdown)
+		break;
+	    pthread_cond_wait(&wb->cond, &wb->lock);
+	    continue;
+	}
+
+	wb->busy = 1;
+	pthread_cond_broadcast(&wb->cond);	// there's room in the queue now
+	pthread_mutex_unlock(&wb->lock);
+
+	size_t done = 0;
+	int err = 0;
+	while (done < b->fill)
+	{
+	    errno = 0;
+	    ssize_t s = wb->flush(wb->fp, b->data+done, b->fill-done, b->offset+done);
+	    if (s <= 0)
+	    {
+		err = ((s < 0) && errno) ? errno : EIO;
+		break;
+	    }
+	    done += s;
+	}
+
+	pthread_mutex_lock(&wb->lock);
+	wb->busy = 0;
+	_buf_put(wb, b);
+	if ((err) && (!wb->error))
+	{
+	    ERRMSG("write-behind failed: %s", strerror(err));
+	    wb->error = err;
+	    _discard_queue(wb);
+	}
+	pthread_cond_broadcast(&wb->cond);
+    }
+    pthread_mutex_unlock(&wb->lock);
+    return NULL;
+}
+
+// fetch (and clear) a pending error - called with lock held
+static inline int _take_error(MVFS_WRITEBEHIND* wb)
+{
+    int err = wb->error;
+    wb->error = 0;
+    return err;
+}
+
+int mvfs_writebehind_start(MVFS_FILE* fp, MVFS_WRITEBEHIND_FLUSH flush, size_t bufsize, int depth)
+{
+    if ((fp == NULL) || (flush == NULL) || (bufsize == 0) || (depth < 1))
+	return -EINVAL;
+
+    // just resize the queue if already running
+    if (fp->writebehind)
+    {
+	if (mvfs_writebehind_flush(fp) < 0)
+	    return -fp->errcode;
+	pthread_mutex_lock(&fp->writebehind->lock);
+	fp->writebehind->depth = depth;
+	pthread_cond_broadcast(&fp->writebehind->cond);
+	pthread_mutex_unlock(&fp->writebehind->lock);
+	return 0;
+    }
+
+    MVFS_WRITEBEHIND* wb = (MVFS_WRITEBEHIND*)calloc(1,sizeof(MVFS_WRITEBEHIND));
+    wb->fp      = fp;
+    wb->flush   = flush;
+    wb->bufsize = bufsize;
+    wb->depth   = depth;
+
+    pthread_mutex_init(&wb->lock, NULL);
+    pthread_cond_init(&wb->cond, NULL);
+
+    if (pthread_create(&wb->thread, NULL, _writer_thread, wb) != 0)
+    {
+	ERRMSG("cannot start writer thread");
+	pthread_mutex_destroy(&wb->lock);
+	pthread_cond_destroy(&wb->cond);
+	free(wb);
+	return -EAGAIN;
+    }
+
+    fp->writebehind = wb;
+    return 0;
+}
+
+int mvfs_writebehind_stop(MVFS_FILE* fp)
+{
+    if ((fp == NULL) || (fp->writebehind == NULL))
+	return 0;
+
+    MVFS_WRITEBEHIND* wb = fp->writebehind;
+    int ret = mvfs_writebehind_flush(fp);
+    fp->writebehind = NULL;
+
+    pthread_mutex_lock(&wb->lock);
+    wb->shutdown = 1;
+    pthread_cond_broadcast(&wb->cond);
+    pthread_mutex_unlock(&wb->lock);
+    pthread_join(wb->thread, NULL);
+
+    _discard_queue(wb);
+    WB_BUFFER* b;
+    while ((b = wb->unused))
+    {
+	wb->unused = b->next;
+	free(b);
+    }
+
+    pthread_mutex_destroy(&wb->lock);
+    pthread_cond_destroy(&wb->cond);
+    free(wb);
+    return ((ret < 0) ? -1 : 0);
+}
+
+ssize_t mvfs_writebehind_pwrite(MVFS_FILE* fp, const void* buf, size_t count, off64_t offset)
+{
+    MVFS_WRITEBEHIND* wb = fp->writebehind;
+    if (wb == NULL)
+    {
+	fp->errcode = EINVAL;
+	return -1;
+    }
+
+    pthread_mutex_lock(&wb->lock);
+
+    int err;
+    if ((err = _take_error(wb)))
+	goto failed;
+
+    size_t done = 0;
+    while (done < count)
+    {
+	WB_BUFFER* b = wb->current;
+
+	// not contiguous or full - push it out and start an new one
+	if ((b) && ((b->offset + (off64_t)b->fill != offset + (off64_t)done) || (b->fill == wb->bufsize)))
+	{
+	    if (_enqueue_current(wb) < 0)
+	    {
+		err = _take_error(wb);
+		goto failed;
+	    }
+	    b = NULL;
+	}
+
+	if (b == NULL)
+	{
+	    if ((b = _buf_get(wb, offset+done)) == NULL)
+	    {
+		err = ENOMEM;
+		goto failed;
+	    }
+	    wb->current = b;
+	}
+
+	size_t n = wb->bufsize - b->fill;
+	if (n > count - done)
+	    n = count - done;
+	memcpy(b->data+b->fill, (const char*)buf+done, n);
+	b->fill += n;
+	done    += n;
+	wb->dirty = 1;
+    }
+
+    pthread_cond_broadcast(&wb->cond);
+    pthread_mutex_unlock(&wb->lock);
+    fp->errcode = 0;
+    return count;
+
+failed:
+    pthread_mutex_unlock(&wb->lock);
+    fp->errcode = err;
+    return -1;
+}
+
+// wait for the queue to drain - returns 1 if anything has been written
+static int _flush(MVFS_FILE* fp)
+{
+    MVFS_WRITEBEHIND* wb = fp->writebehind;
+    if (wb == NULL)
+	return 0;
+
+    pthread_mutex_lock(&wb->lock);
+    _enqueue_current(wb);
+    while ((wb->head || wb->busy) && (!wb->error))
+	pthread_cond_wait(&wb->cond, &wb->lock);
+
+    int dirty = wb->dirty;
+    int err   = _take_error(wb);
+    wb->dirty = 0;
+    pthread_mutex_unlock(&wb->lock);
+
+    if (err)
+    {
+	fp->errcode = err;
+	return -1;
+    }
+    return (dirty ? 1 : 0);
+}
+
+int mvfs_writebehind_flush(MVFS_FILE* fp)
+{
+    // the read-ahead window might hold data from before the writes
+    int ret = _flush(fp);
+    if (ret > 0)
+	mvfs_readahead_invalidate(fp, -1);
+    return ret;
+}
+
+int mvfs_writebehind_barrier(MVFS_FILE* fp, off64_t pos)
+{
+    int ret = _flush(fp);
+    if (ret < 0)
+	return -1;
+    if (ret > 0)
+	mvfs_readahead_invalidate(fp, pos);
+    return 0;
+}
+
+int mvfs_writebehind_getflag(MVFS_FILE* fp, MVFS_FILE_FLAG flag, long* value)
+{
+    if (flag != WRITE_ASYNC)
+	return 0;
+
+    long v = 0;
+    if (fp->writebehind)
+    {
+	pthread_mutex_lock(&fp->writebehind->lock);
+	v = fp->writebehind->depth;
+	pthread_mutex_unlock(&fp->writebehind->lock);
+    }
+
+    if (value)
+	*value = v;
+    return 1;
+}
@@ -0,0 +1,43 @@
+/*
+    libmvfs - metux Virtual Filesystem Library
+
+    Write-behind engine - internal, don't use outside of libmvfs
+
+    Copyright (C) 2008 Enrico Weigelt, metux IT service <weigelt@metux.de>
+    This code is published under the terms of the GNU Public License 2.0
+*/
+
+#ifndef __MVFS_INTERNAL_WRITEBEHIND_H
+#define __MVFS_INTERNAL_WRITEBEHIND_H
+
+#include <mvfs/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+   driver callback which writes a chunk directly to the backend.
+   it is called from the writer thread, so it must not touch the
+   file's position or errcode. on error it returns -1 and sets errno.
+*/
+typedef ssize_t (*MVFS_WRITEBEHIND_FLUSH)(MVFS_FILE* fp, const void* buf, size_t count, off64_t offset);
+
+/* start coalescing writes into bufsize'd buffers, at most depth of them queued */
+int     mvfs_writebehind_start   (MVFS_FILE* fp, MVFS_WRITEBEHIND_FLUSH flush, size_t bufsize, int depth);
+/* flush everything and stop the writer thread - returns -1 w/ errcode on pending errors */
+int     mvfs_writebehind_stop    (MVFS_FILE* fp);
+/* queue an write - returns -1 w/ errcode if an previous write failed */
+ssize_t mvfs_writebehind_pwrite  (MVFS_FILE* fp, const void* buf, size_t count, off64_t offset);
+/* wait until all queued writes are done and drop an stale read-ahead window - returns 1 if anything has been written since last call */
+int     mvfs_writebehind_flush   (MVFS_FILE* fp);
+/* to be called before reads: flush and drop an read-ahead window which might be stale now */
+int     mvfs_writebehind_barrier (MVFS_FILE* fp, off64_t pos);
+/* handle WRITE_ASYNC flag queries - returns 0 if the flag is not ours */
+int     mvfs_writebehind_getflag (MVFS_FILE* fp, MVFS_FILE_FLAG flag, long* value);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif